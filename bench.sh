@@ -0,0 +1,195 @@
+#!/bin/bash
+#
+# benchmark mchown against chown -R and find | xargs -P on synthetic trees
+#
+# Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+#
+# usage: bench.sh [-f tmpfs|ext4|xfs] [-t "1 2 4 ..."] [-s "shape ..."]
+#                 [-r runs] [-o out.csv] [-c] [-B]
+#
+#   -f  file system to build the trees on.  tmpfs is mounted fresh if we're
+#       allowed to, otherwise it's a directory in /dev/shm.  ext4 and xfs
+#       are a loopback image in $BENCH_TMP (default /var/tmp), which takes
+#       root.  default tmpfs
+#   -t  the -n thread counts to sweep, default 1 2 4 ... up to nproc
+#   -s  which tree shapes, default all of them, see SHAPES below
+#   -r  runs of each, default 3
+#   -o  the CSV file, default stdout
+#   -c  drop the page cache before every run, worth it on ext4/xfs
+#   -B  skip the chown -R and find | xargs baselines
+#
+# every run chowns the whole tree to a different owner than the last one,
+# so every run has the same amount of work to do.  needs to run as root.
+#
+# the CSV columns are:
+#   shape,fs,tool,threads,run,entries,wall_secs,files_per_sec,
+#   syscalls_per_file,csw_per_dir,peak_rss_kb
+# syscalls_per_file and csw_per_dir, context switches per directory, are
+# only known for mchown, from its --json summary.
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+MCHOWN=$BIN/mchown
+BENCHTOOL=$BIN/benchtool
+
+# name:benchtool tree options
+SHAPES=(
+	"bushy:-d 4 -f 8 -n 16"
+	"flat:-d 1 -f 4 -n 8 -H 200000"
+	"deep:-d 2 -f 2 -n 4 -c 2000"
+	"links:-d 3 -f 10 -n 20 -s 5 -l 5"
+)
+
+fs=tmpfs
+threads=""
+shapes=""
+runs=3
+out=/dev/stdout
+drop=0
+baselines=1
+
+while getopts "f:t:s:r:o:cB" opt; do
+	case $opt in
+		f) fs=$OPTARG ;;
+		t) threads=$OPTARG ;;
+		s) shapes=$OPTARG ;;
+		r) runs=$OPTARG ;;
+		o) out=$OPTARG ;;
+		c) drop=1 ;;
+		B) baselines=0 ;;
+		*) sed -n '/^# usage/,/^$/p' "$0" >&2; exit 1 ;;
+	esac
+done
+
+if [ "$(id -u)" != 0 ]; then
+	echo "bench.sh has to run as root, to chown" >&2
+	exit 1
+fi
+for b in "$MCHOWN" "$BENCHTOOL"; do
+	if [ ! -x "$b" ]; then
+		echo "no $b, run make bench" >&2
+		exit 1
+	fi
+done
+
+if [ -z "$threads" ]; then
+	n=1
+	while [ $n -lt "$(nproc)" ]; do
+		threads="$threads $n"
+		n=$((n * 2))
+	done
+	threads="$threads $(nproc)"
+fi
+
+work=$(mktemp -d "${BENCH_TMP:-/var/tmp}/mchown-bench.XXXXXX") || exit 1
+mnt=$work/mnt
+img=""
+mounted=0
+mkdir -p "$mnt"
+
+cleanup() {
+	if [ $mounted = 1 ]; then
+		umount "$mnt"
+	fi
+	rm -rf "$work"
+	if [ -n "$shm" ]; then
+		rm -rf "$shm"
+	fi
+}
+trap cleanup EXIT
+
+case $fs in
+	tmpfs)
+		if mount -t tmpfs -o size=4g mchown-bench "$mnt" 2>/dev/null; then
+			mounted=1
+			root=$mnt
+		else
+			shm=$(mktemp -d /dev/shm/mchown-bench.XXXXXX) || exit 1
+			root=$shm
+		fi
+		;;
+	ext4|xfs)
+		img=$work/fs.img
+		truncate -s 8G "$img" &&
+			mkfs."$fs" -q "$img" >/dev/null 2>&1 &&
+			mount -o loop "$img" "$mnt" || exit 1
+		mounted=1
+		root=$mnt
+		;;
+	*)
+		echo "don't know how to make a $fs file system" >&2
+		exit 1
+		;;
+esac
+
+owner=1000
+
+# run_one shape tool threads run entries tree
+run_one() {
+	local shape=$1 tool=$2 nthr=$3 run=$4 entries=$5 tree=$6
+	local json=$work/run.json res secs rss status sps cpd fps
+
+	owner=$((owner == 1000 ? 1001 : 1000))
+	if [ $drop = 1 ]; then
+		sync
+		echo 3 > /proc/sys/vm/drop_caches
+	fi
+	rm -f "$json"
+	case $tool in
+		mchown)
+			res=$("$BENCHTOOL" run "$MCHOWN" -n "$nthr" --json "$json" \
+				"$tree" $owner $owner)
+			;;
+		chown-R)
+			res=$("$BENCHTOOL" run chown -R $owner:$owner "$tree")
+			;;
+		find-xargs)
+			res=$("$BENCHTOOL" run sh -c "find '$tree' -print0 | \
+				xargs -0 -P $nthr -n 1000 chown -h $owner:$owner")
+			;;
+	esac
+	read -r secs rss status <<< "$res"
+	if [ "$status" != 0 ]; then
+		echo "$tool on $shape exited with $status" >&2
+	fi
+
+	sps=""
+	cpd=""
+	if [ -s "$json" ]; then
+		sps=$(awk -v n="$entries" '/"totals"/ {
+			match($0, /"syscalls": [0-9]+/)
+			printf "%.2f", substr($0, RSTART + 12, RLENGTH - 12) / n
+		}' "$json")
+		cpd=$(awk '/"context_switches"/ {
+			match($0, /"per_dir": [0-9.]+/)
+			print substr($0, RSTART + 11, RLENGTH - 11)
+		}' "$json")
+	fi
+	fps=$(awk -v n="$entries" -v s="$secs" \
+		'BEGIN { printf "%.0f", (s > 0) ? n / s : 0 }')
+	echo "$shape,$fs,$tool,$nthr,$run,$entries,$secs,$fps,$sps,$cpd,$rss" >> "$out"
+}
+
+echo "shape,fs,tool,threads,run,entries,wall_secs,files_per_sec,syscalls_per_file,csw_per_dir,peak_rss_kb" > "$out"
+
+for s in "${SHAPES[@]}"; do
+	name=${s%%:*}
+	if [ -n "$shapes" ] && [[ " $shapes " != *" $name "* ]]; then
+		continue
+	fi
+	tree=$root/$name
+	entries=$("$BENCHTOOL" tree ${s#*:} "$tree") || exit 1
+	echo "$name: $entries entries" >&2
+
+	for r in $(seq 1 "$runs"); do
+		for t in $threads; do
+			run_one "$name" mchown "$t" "$r" "$entries" "$tree"
+		done
+		if [ $baselines = 1 ]; then
+			run_one "$name" chown-R 1 "$r" "$entries" "$tree"
+			for t in $threads; do
+				run_one "$name" find-xargs "$t" "$r" "$entries" "$tree"
+			done
+		fi
+	done
+	rm -rf "$tree"
+done
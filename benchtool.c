@@ -0,0 +1,308 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * helper for bench.sh.  two things it needs that the shell is bad at:
+ *
+ *   benchtool tree [-d depth] [-f fanout] [-n files] [-s symlinks]
+ *                  [-l hardlinks] [-H huge] [-c chain] <dir>
+ *     builds a synthetic tree under dir, which must not exist yet.  every
+ *     directory down to depth gets files regular files, symlinks symlinks
+ *     and hardlinks hard links to its own files, and fanout subdirectories.
+ *     -H adds a single directory with that many files in it, -c a chain of
+ *     directories that many deep.  the names are fixed, so the same options
+ *     always build the same tree.  prints the number of entries made.
+ *
+ *   benchtool run <command> [args ...]
+ *     runs the command with its stdout thrown away, and prints its wall
+ *     time in seconds, its peak RSS in KB and its exit status.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define FERR(FMT, ...) fprintf(stderr, FMT "\n", ##__VA_ARGS__)
+
+struct shape {
+	int depth;
+	int fanout;
+	int files;
+	int symlinks;
+	int hardlinks;
+	int huge;
+	int chain;
+};
+
+static uint64_t entries;
+
+
+/*
+ * make nfiles empty files in dfd, named prefix0, prefix1, ...
+ * returns 0, or -1 after saying why
+ */
+ static int
+mk_files(int dfd, const char *prefix, int nfiles)
+{
+	char name[64];
+	int fd;
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof(name), "%s%d", prefix, i);
+		fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			FERR("Could not create '%s' errno %d", name, errno);
+			return -1;
+		}
+		close(fd);
+		entries++;
+	}
+
+	return 0;
+}
+
+
+/*
+ * fill the directory dfd in at level, and everything under it
+ * returns 0, or -1 after saying why
+ */
+ static int
+mk_level(int dfd, struct shape *sh, int level)
+{
+	char name[64];
+	char target[64];
+	int fd;
+	int i;
+
+	if (mk_files(dfd, "f", sh->files)) {
+		return -1;
+	}
+	for (i = 0; i < sh->symlinks; i++) {
+		snprintf(name, sizeof(name), "s%d", i);
+		snprintf(target, sizeof(target), "f%d", sh->files ? i % sh->files : i);
+		if (symlinkat(target, dfd, name)) {
+			FERR("Could not create symlink '%s' errno %d", name, errno);
+			return -1;
+		}
+		entries++;
+	}
+	for (i = 0; (i < sh->hardlinks) && sh->files; i++) {
+		snprintf(name, sizeof(name), "h%d", i);
+		snprintf(target, sizeof(target), "f%d", i % sh->files);
+		if (linkat(dfd, target, dfd, name, 0)) {
+			FERR("Could not create hard link '%s' errno %d", name, errno);
+			return -1;
+		}
+		entries++;
+	}
+	if (level >= sh->depth) {
+		return 0;
+	}
+	for (i = 0; i < sh->fanout; i++) {
+		snprintf(name, sizeof(name), "d%d", i);
+		if (mkdirat(dfd, name, 0755)) {
+			FERR("Could not create directory '%s' errno %d", name, errno);
+			return -1;
+		}
+		entries++;
+		fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			FERR("Could not open directory '%s' errno %d", name, errno);
+			return -1;
+		}
+		if (mk_level(fd, sh, level + 1)) {
+			close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+
+	return 0;
+}
+
+
+/*
+ * the huge directory and the deep chain, off the top
+ * returns 0, or -1 after saying why
+ */
+ static int
+mk_extras(int dfd, struct shape *sh)
+{
+	int fd;
+	int nfd;
+	int i;
+
+	if (sh->huge) {
+		if (mkdirat(dfd, "huge", 0755)) {
+			FERR("Could not create directory 'huge' errno %d", errno);
+			return -1;
+		}
+		entries++;
+		fd = openat(dfd, "huge", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if ((fd < 0) || mk_files(fd, "f", sh->huge)) {
+			FERR("Could not fill directory 'huge'");
+			return -1;
+		}
+		close(fd);
+	}
+
+	fd = dup(dfd);
+	for (i = 0; i < sh->chain; i++) {
+		if (mkdirat(fd, (i == 0) ? "chain" : "c", 0755)) {
+			FERR("Could not create chain directory %d errno %d", i, errno);
+			close(fd);
+			return -1;
+		}
+		entries++;
+		nfd = openat(fd, (i == 0) ? "chain" : "c",
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		close(fd);
+		if (nfd < 0) {
+			FERR("Could not open chain directory %d errno %d", i, errno);
+			return -1;
+		}
+		fd = nfd;
+	}
+	close(fd);
+
+	return 0;
+}
+
+
+ static int
+do_tree(int argc, char **argv)
+{
+	struct shape sh;
+	int optret;
+	int *val;
+	int fd;
+
+	memset(&sh, 0, sizeof(sh));
+	sh.depth = 3;
+	sh.fanout = 8;
+	sh.files = 16;
+
+	optret = getopt(argc, argv, "d:f:n:s:l:H:c:");
+	while (optret != -1) {
+		switch (optret) {
+			case 'd':
+				val = &sh.depth;
+				break;
+			case 'f':
+				val = &sh.fanout;
+				break;
+			case 'n':
+				val = &sh.files;
+				break;
+			case 's':
+				val = &sh.symlinks;
+				break;
+			case 'l':
+				val = &sh.hardlinks;
+				break;
+			case 'H':
+				val = &sh.huge;
+				break;
+			case 'c':
+				val = &sh.chain;
+				break;
+			default:
+				return 1;
+		}
+		if ((sscanf(optarg, "%d", val) != 1) || (*val < 0)) {
+			FERR("Could not process '%s' for -%c", optarg, optret);
+			return 1;
+		}
+		optret = getopt(argc, argv, "d:f:n:s:l:H:c:");
+	}
+	if (optind != argc - 1) {
+		FERR("usage: benchtool tree [-d depth] [-f fanout] [-n files] "
+			"[-s symlinks] [-l hardlinks] [-H huge] [-c chain] <dir>");
+		return 1;
+	}
+
+	if (mkdir(argv[optind], 0755)) {
+		FERR("Could not create '%s' errno %d", argv[optind], errno);
+		return 1;
+	}
+	entries = 1;
+	fd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if ((fd < 0) || mk_level(fd, &sh, 0) || mk_extras(fd, &sh)) {
+		return 1;
+	}
+	close(fd);
+	printf("%lu\n", entries);
+
+	return 0;
+}
+
+
+ static int
+do_run(int argc, char **argv)
+{
+	struct timespec start;
+	struct timespec end;
+	struct rusage ru;
+	pid_t pid;
+	int status;
+	int fd;
+
+	if (argc < 2) {
+		FERR("usage: benchtool run <command> [args ...]");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid < 0) {
+		FERR("Could not fork errno %d", errno);
+		return 1;
+	}
+	if (pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+		}
+		execvp(argv[1], &argv[1]);
+		FERR("Could not run '%s' errno %d", argv[1], errno);
+		_exit(127);
+	}
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		FERR("Could not wait for '%s' errno %d", argv[1], errno);
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%.3f %ld %d\n", (double)(end.tv_sec - start.tv_sec) +
+		(double)(end.tv_nsec - start.tv_nsec) / 1e9, ru.ru_maxrss,
+		WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+
+	return 0;
+}
+
+
+ int
+main(int argc, char **argv)
+{
+	if ((argc > 1) && !strcmp(argv[1], "tree")) {
+		return do_tree(argc - 1, &argv[1]);
+	}
+	if ((argc > 1) && !strcmp(argv[1], "run")) {
+		return do_run(argc - 1, &argv[1]);
+	}
+	FERR("usage: benchtool tree|run ...");
+
+	return 1;
+}
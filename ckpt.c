@@ -0,0 +1,1044 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * checkpoint and resume, for the CLI.
+ *
+ * the checkpoint is the frontier: the directories whose subtrees still
+ * have to be done.  everything in the job's tree that isn't under one of
+ * them is finished, so that's all --resume needs to know, and the finished
+ * subtrees, which can be millions of directories, never get written down.
+ *
+ * with --checkpoint FILE, the frontier is written to FILE every
+ * --checkpoint-secs.  while the run is going, it's the dir_jobs sitting on
+ * the deques, plus the dir_job each thread is working on, which takes in
+ * everything it has recursed into.  a thread keeps its dir_job's path in
+ * ck_path, under its ck_lock, which it holds from before it looks for a
+ * dir_job until the path is in ck_path.  the writer takes all the
+ * ck_locks before it looks at the deques, so it sees every dir_job in one
+ * place or the other.  a dir_job that was half done gets done again on
+ * resume, but nothing gets missed.  if the run fails, the last one written
+ * is left alone.
+ *
+ * SIGINT, SIGTERM and the --time-budget deadline stop the run properly
+ * instead.  ck_stopping tells mdpf to finish the directory it's in, but to
+ * put every subdirectory it comes across on the frontier instead of doing
+ * it, along with every dir_job it takes off a deque.  once the job runs
+ * dry, the frontier is exact, and ck_done writes it out.  a second signal
+ * just kills it.
+ *
+ * --resume reads FILE, opens the directories above each frontier entry
+ * from the top with openat, the way mdpf would have, and queues the
+ * entries on the main thread's deque for the pool.  FILE is removed once
+ * the job's done.
+ *
+ * the file is text: a header, a "dir <path>" line per entry, and an
+ * "end <count>" line, so a short one is obvious.  backslash and newline in
+ * paths are escaped.  it's written to FILE.tmp, fsync'd, and renamed.
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mchown.h"
+
+#define CK_MAGIC "mchown checkpoint 1"
+#define CK_TICK_MS 100
+
+char *ck_file;                   /* --checkpoint FILE, NULL for none */
+unsigned int ck_secs = CK_SECS_DEF;
+unsigned int time_budget;        /* secs, 0 for no deadline */
+int ck_resume;                   /* --resume */
+int ck_stopping;                 /* stopping to resume later, see above */
+
+static int ck_over;              /* ck_done's been called, hands off FILE */
+static int ck_broken;            /* a thread lost track of its path */
+static struct job_info *ck_job;
+static uid_t ck_uid;             /* job->ucred goes away in job_done */
+static gid_t ck_gid;
+static pthread_mutex_t ck_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the frontier, collected by ck_record while stopping */
+static pthread_mutex_t ck_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **ck_list;
+static size_t ck_nlist;
+static size_t ck_list_sz;
+
+/*
+ * what --resume couldn't get to, see ck_keep.  ck_write puts these in
+ * every checkpoint, so they're tried again next time.  ck_write_lock
+ */
+static char **ck_kept;
+static size_t ck_nkept;
+static size_t ck_kept_sz;
+
+
+/*
+ * put together the path of name in parent, or just name if parent is
+ * NULL, in *buf, growing it if need be.  unlike dn_path, any thread can
+ * use this.
+ * returns *buf, or NULL if it couldn't be grown
+ */
+ static char *
+ck_path_of(char **buf, size_t *sz, struct dnode *parent, const char *name)
+{
+	struct dnode *d;
+	size_t len;
+	size_t nlen;
+	char *p;
+	char *nbuf;
+
+	len = strlen(name) + 1;
+	for (d = parent; d; d = d->parent) {
+		len = len + strlen(d->name) + 1;
+	}
+	if (len > *sz) {
+		nbuf = realloc(*buf, len);
+		if (nbuf == NULL) {
+			return NULL;
+		}
+		*buf = nbuf;
+		*sz = len;
+	}
+	p = *buf + len - 1;
+	*p = '\0';
+	nlen = strlen(name);
+	p = p - nlen;
+	memcpy(p, name, nlen);
+	for (d = parent; d; d = d->parent) {
+		*(--p) = '/';
+		nlen = strlen(d->name);
+		p = p - nlen;
+		memcpy(p, d->name, nlen);
+	}
+
+	return *buf;
+}
+
+
+/*
+ * the path a dir_job stands for on the frontier.  a name batch's is the
+ * directory its files are in, which means doing that one again on resume
+ */
+ static char *
+ck_path_dj(char **buf, size_t *sz, struct dir_job *dj)
+{
+	if (dj->nb) {
+		return ck_path_of(buf, sz, dj->parent->parent, dj->parent->name);
+	}
+
+	return ck_path_of(buf, sz, dj->parent, dj->name);
+}
+
+
+/*
+ * add a copy of path to a list.  returns 0, or ENOMEM
+ */
+ int
+ck_list_add(char ***list, size_t *n, size_t *sz, const char *path)
+{
+	char **nlist;
+	char *copy;
+	size_t nsz;
+
+	if (*n == *sz) {
+		nsz = *sz ? *sz * 2 : 1024;
+		nlist = realloc(*list, nsz * sizeof(char *));
+		if (nlist == NULL) {
+			return ENOMEM;
+		}
+		*list = nlist;
+		*sz = nsz;
+	}
+	copy = strdup(path);
+	if (copy == NULL) {
+		return ENOMEM;
+	}
+	(*list)[(*n)++] = copy;
+
+	return 0;
+}
+
+
+ void
+ck_list_free(char **list, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		free(list[i]);
+	}
+	free(list);
+}
+
+
+/*
+ * write out a path with backslash and newline escaped
+ */
+ static void
+ck_put_path(FILE *fp, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\\') {
+			fputs("\\\\", fp);
+		} else if (*s == '\n') {
+			fputs("\\n", fp);
+		} else {
+			fputc(*s, fp);
+		}
+	}
+}
+
+
+/*
+ * undo ck_put_path, in place
+ */
+ static void
+ck_unescape(char *s)
+{
+	char *d;
+
+	for (d = s; *s; s++) {
+		if ((s[0] == '\\') && (s[1] == 'n')) {
+			*d++ = '\n';
+			s++;
+		} else if ((s[0] == '\\') && (s[1] == '\\')) {
+			*d++ = '\\';
+			s++;
+		} else {
+			*d++ = *s;
+		}
+	}
+	*d = '\0';
+}
+
+
+/*
+ * write a frontier to ck_file.  ck_write_lock must be held.
+ * returns 0, or an errno
+ */
+ static int
+ck_write(const char *state, char **list, size_t n)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+	size_t i;
+	int err;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", ck_file) >= (int)sizeof(tmp)) {
+		return ENAMETOOLONG;
+	}
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		return errno;
+	}
+	fprintf(fp, CK_MAGIC "\npath ");
+	ck_put_path(fp, ck_job->path);
+	fprintf(fp, "\nowner %u %u\nstate %s\n", ck_uid, ck_gid, state);
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "dir ");
+		ck_put_path(fp, list[i]);
+		fputc('\n', fp);
+	}
+	for (i = 0; i < ck_nkept; i++) {
+		fprintf(fp, "dir ");
+		ck_put_path(fp, ck_kept[i]);
+		fputc('\n', fp);
+	}
+	fprintf(fp, "end %lu\n", n + ck_nkept);
+	err = 0;
+	if (fflush(fp) || fsync(fileno(fp))) {
+		err = errno;
+	}
+	if (fclose(fp) && (err == 0)) {
+		err = errno;
+	}
+	if ((err == 0) && rename(tmp, ck_file)) {
+		err = errno;
+	}
+	if (err) {
+		unlink(tmp);
+	}
+
+	return err;
+}
+
+
+/*
+ * the frontier of the running job, written to ck_file.
+ * returns 0, or an errno
+ */
+ static int
+ck_snapshot(void)
+{
+	struct dj_deque *dq;
+	struct dir_job *dj;
+	char **list;
+	size_t n;
+	size_t sz;
+	char *buf;
+	size_t bufsz;
+	unsigned int x;
+	int t;
+	int err;
+
+	list = NULL;
+	n = sz = 0;
+	buf = NULL;
+	bufsz = 0;
+	err = 0;
+	for (t = 0; t <= nthreads; t++) {
+		pthread_mutex_lock(&threads[t].ck_lock);
+	}
+	for (t = 0; (t <= nthreads) && (!err); t++) {
+		if (threads[t].ck_path && threads[t].ck_path[0]) {
+			err = ck_list_add(&list, &n, &sz, threads[t].ck_path);
+		}
+	}
+	for (t = 0; (t <= nthreads) && (!err); t++) {
+		dq = &threads[t].dq;
+		pthread_mutex_lock(&dq->lock);
+		for (x = dq->head; (x != dq->tail) && (!err); x++) {
+			dj = &dq->ring[x & (dq->size - 1)];
+			if (ck_path_dj(&buf, &bufsz, dj) == NULL) {
+				err = ENOMEM;
+			} else {
+				err = ck_list_add(&list, &n, &sz, buf);
+			}
+		}
+		pthread_mutex_unlock(&dq->lock);
+	}
+	for (t = 0; t <= nthreads; t++) {
+		pthread_mutex_unlock(&threads[t].ck_lock);
+	}
+	free(buf);
+
+	pthread_mutex_lock(&ck_write_lock);
+	if ((!err) && (!ATOMIC_READ(ck_over)) && (!ATOMIC_READ(ck_stopping)) &&
+		(!ATOMIC_READ(shutdown_time))) {
+
+		err = ck_write("running", list, n);
+		DBUG("checkpoint: %lu dirs in the frontier", n);
+	}
+	pthread_mutex_unlock(&ck_write_lock);
+	ck_list_free(list, n);
+
+	return err;
+}
+
+
+/*
+ * write checkpoints every ck_secs, and watch for the time budget to run out
+ */
+ static void *
+ck_thread(void *arg __attribute__ ((unused)))
+{
+	struct timespec start;
+	struct timespec now;
+	struct timespec tick;
+	time_t last;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start.tv_sec;
+	tick.tv_sec = 0;
+	tick.tv_nsec = CK_TICK_MS * 1000000L;
+	while ((!ATOMIC_READ(ck_stopping)) && (!ATOMIC_READ(ck_over)) &&
+		(!ATOMIC_READ(shutdown_time))) {
+
+		nanosleep(&tick, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (time_budget &&
+			(now.tv_sec - start.tv_sec >= (time_t)time_budget)) {
+
+			WARN("The time budget of %u secs is used up, stopping",
+				time_budget);
+			ck_stop();
+			break;
+		}
+		if ((ck_file == NULL) || (now.tv_sec - last < (time_t)ck_secs)) {
+			continue;
+		}
+		last = now.tv_sec;
+		if (ATOMIC_READ(ck_broken)) {
+			continue;
+		}
+		err = ck_snapshot();
+		if (err) {
+			WARN("Could not write checkpoint '%s' errno %d", ck_file, err);
+		}
+	}
+
+	return NULL;
+}
+
+
+ static void
+ck_signal(int sig __attribute__ ((unused)))
+{
+	ck_stopping = 1;             /* SA_RESETHAND, so another one kills */
+}
+
+
+/*
+ * stop, leaving what isn't done yet on the frontier
+ */
+ void
+ck_stop(void)
+{
+	__atomic_store_n(&ck_stopping, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * start checkpointing job, watching the clock, and catching SIGINT and
+ * SIGTERM, if there's a checkpoint file, a time budget, or --watch.  the frontier
+ * has to be all on the deques or in ck_path before this.
+ * returns 0, or -1 after saying why
+ */
+ int
+ck_start(struct job_info *job)
+{
+	struct sigaction sa;
+	pthread_t tid;
+	pthread_attr_t attr;
+	int status;
+
+	/* ck_load got these before the pool could finish a resumed job */
+	if (ck_job != job) {
+		ck_job = job;
+		ck_uid = job->ucred->u;
+		ck_gid = job->ucred->g;
+	}
+	if ((ck_file == NULL) && (time_budget == 0) && (!watching)) {
+		return 0;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = ck_signal;
+	sa.sa_flags = (int)SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	status = pthread_create(&tid, &attr, ck_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (status) {
+		FERR("Failed to start the checkpoint thread.  errno=%d", status);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * dequeue for a pool thread, putting the path of what it got in ck_path.
+ * returns 1 if there was a dir_job, 0 if not
+ */
+ int
+ck_dequeue(struct dir_job *dj)
+{
+	int got;
+
+	if (ck_file == NULL) {
+		return dequeue(dj);
+	}
+	pthread_mutex_lock(&my_tpool->ck_lock);
+	got = dequeue(dj);
+	if (got && (ck_path_dj(&my_tpool->ck_path, &my_tpool->ck_path_sz, dj) ==
+		NULL)) {
+
+		/* the frontier can't be known any more */
+		WARN("[%02d] Out of memory for the checkpoint, no more will be "
+			"written", my_tpool->thread_num);
+		__atomic_store_n(&ck_broken, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&my_tpool->ck_lock);
+
+	return got;
+}
+
+
+/*
+ * the calling thread is working on path, or with NULL, isn't any more
+ */
+ void
+ck_working(const char *path)
+{
+	if (ck_file == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&my_tpool->ck_lock);
+	if (path == NULL) {
+		if (my_tpool->ck_path) {
+			my_tpool->ck_path[0] = '\0';
+		}
+	} else if (ck_path_of(&my_tpool->ck_path, &my_tpool->ck_path_sz, NULL,
+		path) == NULL) {
+
+		WARN("Out of memory for the checkpoint, no more will be written");
+		__atomic_store_n(&ck_broken, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&my_tpool->ck_lock);
+}
+
+
+/*
+ * while stopping, put name in parent on the frontier instead of doing it
+ */
+ void
+ck_record(struct dnode *parent, const char *name)
+{
+	char *buf;
+	size_t sz;
+
+	buf = NULL;
+	sz = 0;
+	pthread_mutex_lock(&ck_list_lock);
+	if ((ck_path_of(&buf, &sz, parent, name) == NULL) ||
+		ck_list_add(&ck_list, &ck_nlist, &ck_list_sz, buf)) {
+
+		FERR("Out of memory for the checkpoint, lost track of '%s'", name);
+		__atomic_store_n(&ck_broken, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&ck_list_lock);
+	free(buf);
+}
+
+
+/*
+ * the job's over, one way or another.  if it was stopped, or --resume
+ * couldn't get to some of it, write out what's left.  if it finished, the
+ * checkpoint isn't needed any more, unless there were errors.
+ * returns 0, or 3 if there's more to do
+ */
+ int
+ck_done(int state)
+{
+	int err;
+
+	pthread_mutex_lock(&ck_write_lock);
+	__atomic_store_n(&ck_over, 1, __ATOMIC_SEQ_CST);
+	/* stopped with nothing left over is as good as finished */
+	if (((!ATOMIC_READ(ck_stopping)) ||
+		((ck_nlist == 0) && (state == JOB_DONE))) && (ck_nkept == 0)) {
+
+		if (ck_file && (state == JOB_DONE) &&
+			ATOMIC_READ(ck_job->errors)) {
+
+			WARN("Finished with errors, leaving checkpoint '%s'", ck_file);
+		} else if (ck_file && (state == JOB_DONE) && unlink(ck_file) &&
+			(errno != ENOENT)) {
+
+			WARN("Could not remove checkpoint '%s' errno %d", ck_file,
+				errno);
+		}
+		pthread_mutex_unlock(&ck_write_lock);
+		return 0;
+	}
+
+	if (ck_file == NULL) {
+		WARN("Stopped with %lu directories left, and no --checkpoint to "
+			"resume from", ck_nlist);
+	} else if (ATOMIC_READ(ck_broken)) {
+		FERR("Stopped with %lu directories left, but the checkpoint "
+			"couldn't be kept, '%s' is out of date", ck_nlist + ck_nkept,
+			ck_file);
+	} else if (state != JOB_DONE) {
+		FERR("Stopped with errors, '%s' is out of date", ck_file);
+	} else {
+		err = ck_write("stopped", ck_list, ck_nlist);
+		if (err) {
+			FERR("Could not write checkpoint '%s' errno %d", ck_file, err);
+		} else {
+			WARN("%lu directories left, --resume from '%s' to finish",
+				ck_nlist + ck_nkept, ck_file);
+		}
+	}
+	pthread_mutex_unlock(&ck_write_lock);
+
+	return 3;
+}
+
+
+/*
+ * the order the frontier is worked through on resume.  like strcmp, except
+ * that / comes before everything, so everything under a directory comes
+ * right after it
+ */
+ static int
+ck_cmp(const void *a, const void *b)
+{
+	const unsigned char *s;
+	const unsigned char *t;
+	int cs;
+	int ct;
+
+	s = *(const unsigned char * const *)a;
+	t = *(const unsigned char * const *)b;
+	for (;; s++, t++) {
+		cs = (*s == '/') ? 1 : (*s ? *s + 1 : 0);
+		ct = (*t == '/') ? 1 : (*t ? *t + 1 : 0);
+		if ((cs != ct) || (cs == 0)) {
+			return cs - ct;
+		}
+	}
+}
+
+
+/*
+ * make the dnode for name in parent, or for the top of the job if parent
+ * is NULL, and open it, the way mdpf would.
+ * returns the dnode, or NULL with errno set
+ */
+ struct dnode *
+ck_open(struct job_info *job, struct dnode *parent, char *name)
+{
+	struct dir_job dj;
+	struct dnode *dn;
+	struct stat st;
+	int serrno;
+
+	TZERO_DJ(&dj);
+	dj.parent = parent;
+	dj.name = name;
+	dj.ucred = job->ucred;
+	dj.job_id = job->job_id;
+	dj.job = job;
+	if (parent) {
+		dn_hold_child(parent);
+	}
+	dn = dn_open(&dj);
+	if (dn == NULL) {
+		serrno = errno;
+		dj_drop(&dj);
+		errno = serrno;
+		return NULL;
+	}
+	TS_ADD(syscalls, 1);
+	if ((dn->fd < 0) || fstat(dn->fd, &st)) {
+		serrno = errno;
+		dn_done(dn);
+		errno = serrno;
+		return NULL;
+	}
+	dn_set_fs(dn, st.st_dev);
+
+	return dn;
+}
+
+
+/*
+ * queue name in dn for the pool, the way job_submit does the top of a job.
+ * returns 0, or an errno
+ */
+ int
+ck_submit(struct job_info *job, struct dnode *dn, char *name)
+{
+	struct dir_job dj;
+	struct timespec tick;
+
+	/* a queued dir holds its parent's fd open, see enqueue */
+	tick.tv_sec = 0;
+	tick.tv_nsec = 1000000L;
+	while (ATOMIC_READ(dir_fds) >= fd_budget) {
+		nanosleep(&tick, NULL);
+	}
+
+	TZERO_DJ(&dj);
+	dj.parent = dn;
+	dj.name = slab_strdup(name);
+	if (dj.name == NULL) {
+		return errno;
+	}
+	dj.ucred = job->ucred;
+	dj.job_id = job->job_id;
+	dj.job = job;
+	dn_hold_child(dn);
+	__sync_add_and_fetch(&dj_outstanding, 1);
+	__sync_add_and_fetch(&job->outstanding, 1);
+	__sync_add_and_fetch(&job->queued, 1);
+	if (dq_push(&threads[0].dq, &dj)) {
+		__sync_sub_and_fetch(&job->queued, 1);
+		__sync_sub_and_fetch(&job->outstanding, 1);
+		__sync_sub_and_fetch(&dj_outstanding, 1);
+		dn_done(dn);
+		slab_free_str(dj.name);
+		return ENOMEM;
+	}
+	__sync_add_and_fetch(&dj_queued, 1);
+	wake_idle(0);
+
+	return 0;
+}
+
+
+/*
+ * read the frontier in ck_file into *list.
+ * returns 0, or -1 after saying why
+ */
+ static int
+ck_read(struct job_info *job, char ***list, size_t *n)
+{
+	FILE *fp;
+	char *line;
+	size_t lsz;
+	ssize_t len;
+	size_t sz;
+	unsigned long end;
+	unsigned int u;
+	unsigned int g;
+	int lineno;
+	int bad;
+
+	fp = fopen(ck_file, "r");
+	if (fp == NULL) {
+		FERR("Could not open checkpoint '%s' errno %d", ck_file, errno);
+		return -1;
+	}
+	line = NULL;
+	lsz = 0;
+	sz = 0;
+	end = ULONG_MAX;
+	bad = 0;
+	for (lineno = 1; (!bad) && (end == ULONG_MAX); lineno++) {
+		len = getline(&line, &lsz, fp);
+		if (len < 0) {
+			break;
+		}
+		if ((len > 0) && (line[len - 1] == '\n')) {
+			line[len - 1] = '\0';
+		}
+		if (lineno == 1) {
+			bad = strcmp(line, CK_MAGIC);
+		} else if (!strncmp(line, "dir ", 4)) {
+			ck_unescape(line + 4);
+			bad = ck_list_add(list, n, &sz, line + 4);
+		} else if (!strncmp(line, "path ", 5)) {
+			ck_unescape(line + 5);
+			if (strcmp(line + 5, job->path)) {
+				FERR("Checkpoint '%s' is for '%s', not '%s'", ck_file,
+					line + 5, job->path);
+				bad = 1;
+			}
+		} else if (sscanf(line, "owner %u %u", &u, &g) == 2) {
+			if ((u != job->ucred->u) || (g != job->ucred->g)) {
+				FERR("Checkpoint '%s' is for %u:%u, not %u:%u", ck_file,
+					u, g, job->ucred->u, job->ucred->g);
+				bad = 1;
+			}
+		} else if (sscanf(line, "end %lu", &end) == 1) {
+			bad = (end != *n);
+		} else if (strncmp(line, "state ", 6)) {
+			bad = 1;
+		}
+	}
+	free(line);
+	fclose(fp);
+	if ((!bad) && (end == ULONG_MAX)) {
+		bad = 1;                 /* cut short */
+	}
+	if (bad) {
+		FERR("Checkpoint '%s' is no good, at line %d", ck_file, lineno - 1);
+		ck_list_free(*list, *n);
+		*list = NULL;
+		*n = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * --resume couldn't get to the first len bytes of path, for a reason
+ * other than it's gone, so it's an error, and it goes in every checkpoint
+ * from now on
+ */
+ static void
+ck_keep(struct job_info *job, const char *path, size_t len, int err)
+{
+	char *p;
+
+	FERR("Could not get to '%.*s' errno %d, keeping it in the checkpoint",
+		(int)len, path, err);
+	job_err(job, err);
+	p = strndup(path, len);
+	pthread_mutex_lock(&ck_write_lock);
+	if ((p == NULL) || ck_list_add(&ck_kept, &ck_nkept, &ck_kept_sz, p)) {
+		FERR("Out of memory for the checkpoint, lost track of '%.*s'",
+			(int)len, path);
+		__atomic_store_n(&ck_broken, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&ck_write_lock);
+	free(p);
+}
+
+
+/*
+ * go through a list of paths under the top of job, whose dnode is top,
+ * calling fn with the dnode of the directory each one is in, and its name.
+ * the directories in between are opened from the top down, with openat
+ * and without following symlinks, the way mdpf would have, and kept on a
+ * stack while the paths under them are being gone through.  the list gets
+ * sorted so that everything under a directory comes right after it, and
+ * once fn says it's taken care of a path, whatever's under it is skipped,
+ * which also skips repeats.  fn returns 1 for taken care of, 0 for
+ * skipped, or an errno to give up.
+ * returns 0, or the errno fn gave up with
+ */
+ int
+ck_walk(struct job_info *job, struct dnode *top, char **list, size_t n,
+	int (*fn)(struct job_info *, struct dnode *, char *))
+{
+	struct dnode **stk;
+	struct dnode **nstk;
+	char **comps;
+	char **ncomps;
+	char *rel;
+	char *p;
+	char *skip;
+	size_t skiplen;
+	size_t toplen;
+	size_t ncomps_max;
+	size_t i;
+	int nstk_max;
+	int depth;
+	int k;
+	int d;
+	int j;
+	int err;
+	int rval;
+
+	qsort(list, n, sizeof(char *), ck_cmp);
+	nstk_max = 64;
+	stk = malloc((size_t)nstk_max * sizeof(struct dnode *));
+	ncomps_max = 64;
+	comps = malloc(ncomps_max * sizeof(char *));
+	if ((stk == NULL) || (comps == NULL)) {
+		free(stk);
+		free(comps);
+		return ENOMEM;
+	}
+	stk[0] = top;
+	depth = 1;
+	toplen = strlen(job->path);
+	rel = NULL;
+	skip = NULL;
+	skiplen = 0;
+	err = 0;
+	rval = 0;
+
+	for (i = 0; (i < n) && (!rval); i++) {
+		p = list[i];
+		if (strncmp(p, job->path, toplen) || (p[toplen] != '/')) {
+			WARN("'%s' isn't under '%s', skipping it", p, job->path);
+			continue;
+		}
+		if (skip && (!strncmp(p, skip, skiplen)) &&
+			((p[skiplen] == '/') || (p[skiplen] == '\0'))) {
+
+			continue;
+		}
+
+		/* split what's under the top into its components */
+		free(rel);
+		rel = strdup(p + toplen);
+		if ((rel == NULL) || (strlen(rel) > ncomps_max)) {
+			ncomps = rel ? realloc(comps, strlen(rel) * sizeof(char *)) : NULL;
+			if (ncomps == NULL) {
+				rval = ENOMEM;
+				break;
+			}
+			comps = ncomps;
+			ncomps_max = strlen(rel);
+		}
+		k = 0;
+		for (p = rel; *p; p++) {
+			if (*p == '/') {
+				*p = '\0';
+			} else if ((p == rel) || (p[-1] == '\0')) {
+				comps[k++] = p;
+			}
+		}
+		if (k == 0) {
+			continue;                /* the top itself */
+		}
+
+		/* keep what's on the stack that this one is under too */
+		for (d = 1; (d < depth) && (d < k) &&
+			(!strcmp(stk[d]->name, comps[d - 1])); d++) {
+			;
+		}
+		while (depth > d) {
+			dn_done(stk[--depth]);
+		}
+		for (j = d - 1; j < k - 1; j++) {
+			if (depth == nstk_max) {
+				nstk = realloc(stk, (size_t)nstk_max * 2 *
+					sizeof(struct dnode *));
+				if (nstk == NULL) {
+					rval = ENOMEM;
+					break;
+				}
+				stk = nstk;
+				nstk_max = nstk_max * 2;
+			}
+			stk[depth] = ck_open(job, stk[depth - 1], comps[j]);
+			if (stk[depth] == NULL) {
+				err = errno;
+				break;
+			}
+			depth++;
+		}
+		if (rval) {
+			break;
+		}
+		skip = list[i];
+		if (j < k - 1) {
+			/*
+			 * gone, or not a directory any more, is fine.  anything
+			 * else, it and everything under it has to be kept
+			 */
+			skiplen = toplen + (size_t)(comps[j] - rel) + strlen(comps[j]);
+			if ((err == ENOENT) || (err == ENOTDIR)) {
+				MBUG("Could not open '%s' in '%s' errno %d, skipping it",
+					comps[j], dn_path(stk[depth - 1]), err);
+			} else {
+				ck_keep(job, list[i], skiplen, err);
+			}
+			continue;
+		}
+		rval = fn(job, stk[depth - 1], comps[k - 1]);
+		if (rval == 0) {
+			skip = NULL;
+		}
+		rval = (rval == 1) ? 0 : rval;
+		skiplen = strlen(list[i]);
+	}
+
+	/* everything but the top */
+	while (depth > 1) {
+		dn_done(stk[--depth]);
+	}
+	free(rel);
+	free(stk);
+	free(comps);
+
+	return rval;
+}
+
+
+/*
+ * ck_walk's fn for a resume: queue the directory
+ */
+ static int
+ck_resume_one(struct job_info *job, struct dnode *dn, char *name)
+{
+	struct stat st;
+	char *buf;
+	size_t sz;
+	int err;
+
+	/* it might have gone away since */
+	TS_ADD(syscalls, 1);
+	if (fstatat(dn->fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+		err = errno;
+		if ((err != ENOENT) && (err != ENOTDIR)) {
+			buf = NULL;
+			sz = 0;
+			if (ck_path_of(&buf, &sz, dn, name) == NULL) {
+				return ENOMEM;
+			}
+			ck_keep(job, buf, strlen(buf), err);
+			free(buf);
+			return 0;
+		}
+		st.st_mode = 0;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		WARN("'%s' in '%s' isn't a directory any more, skipping it", name,
+			dn_path(dn));
+		return 0;
+	}
+
+	return ck_submit(job, dn, name) ? ENOMEM : 1;
+}
+
+
+/*
+ * pick the job up where the checkpoint left off.  once the frontier is
+ * queued, the top's dnode is let go of, so the job's done, see dn_put,
+ * when the last of the frontier is.
+ * returns 0 if the frontier's queued, 1 if the whole job needs doing
+ * after all, or -1 after saying why
+ */
+ int
+ck_load(struct job_info *job)
+{
+	struct dnode *top;
+	char **list;
+	char *p;
+	size_t toplen;
+	size_t n;
+	size_t i;
+	int rval;
+
+	if (access(ck_file, F_OK) && (errno == ENOENT)) {
+		WARN("No checkpoint '%s', starting from the top", ck_file);
+		return 1;
+	}
+	list = NULL;
+	n = 0;
+	if (ck_read(job, &list, &n)) {
+		return -1;
+	}
+	/* job->ucred is gone once the pool's done with it, see ck_start */
+	ck_job = job;
+	ck_uid = job->ucred->u;
+	ck_gid = job->ucred->g;
+
+	/* if the top is on the frontier, nothing got done */
+	toplen = strlen(job->path);
+	for (i = 0; i < n; i++) {
+		for (p = list[i] + toplen; *p == '/'; p++) {
+			;
+		}
+		if ((!strncmp(list[i], job->path, toplen)) && (*p == '\0')) {
+			ck_list_free(list, n);
+			return 1;
+		}
+	}
+
+	top = ck_open(job, NULL, job->path);
+	if (top == NULL) {
+		FERR("Could not open '%s' to resume errno %d", job->path, errno);
+		ck_list_free(list, n);
+		return -1;
+	}
+	rval = ck_walk(job, top, list, n, ck_resume_one);
+	if (rval) {
+		FERR("Failed to queue the checkpoint's frontier errno %d", rval);
+		job_fail(job, rval);
+	}
+	/* from here on, the job is done when the pool is done with it */
+	dn_done(top);
+	DBUG("resuming '%s' from the %lu dirs in the checkpoint", job->path, n);
+	ck_list_free(list, n);
+
+	return rval ? -1 : 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * the concurrency controller, for --auto-threads MIN:MAX.
+ *
+ * the right number of threads depends on the file system more than on the
+ * cpus.  on a local disk it's about the number of cores, on NFS every
+ * chown is a round trip, and 4 to 10 times that is usually better.  so
+ * the pool is started with MAX threads, and only the first thr_active of
+ * them work; the rest are parked on park_cv.  every CONC_TICK_MS the
+ * controller looks at how many entries got done, and hill climbs: keep
+ * going the same way while throughput goes up, turn around when it goes
+ * down, and when it's flat, back off, since fewer threads for the same
+ * work is better.
+ *
+ * when some of the active threads are idle, there isn't enough queued
+ * work to keep them busy, and the numbers don't say anything about the
+ * thread count, so it just waits.
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mchown.h"
+
+#define CONC_TICK_MS 250
+#define CONC_GAIN 1.05           /* better than this is better */
+#define CONC_LOSS 0.95           /* worse than this is worse */
+
+int thr_min;                     /* --auto-threads bounds, 0 if not adapting */
+int thr_max;
+int thr_active;                  /* pool threads allowed to work */
+
+static pthread_cond_t park_cv = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * what --auto-threads takes, MIN:MAX.  returns 0, or -1 if it's no good
+ */
+ int
+parse_auto_threads(const char *str)
+{
+	int min;
+	int max;
+
+	if ((sscanf(str, "%d:%d", &min, &max) != 2) || (min < 1) ||
+		(max < min) || (max > THREADS_MAX)) {
+
+		return -1;
+	}
+	thr_min = min;
+	thr_max = max;
+
+	return 0;
+}
+
+
+/*
+ * a pool thread past thr_active waits here until it's let back in
+ */
+ void
+conc_park(void)
+{
+	pthread_mutex_lock(&idle_lock);
+	while ((!ATOMIC_READ(shutdown_time)) &&
+		(my_tpool->thread_num > ATOMIC_READ(thr_active))) {
+
+		pthread_cond_wait(&park_cv, &idle_lock);
+	}
+	pthread_mutex_unlock(&idle_lock);
+}
+
+
+/*
+ * wake the parked threads, to look at thr_active or shutdown_time again.
+ * idle_lock must be held.  wake_idle(1) does this too
+ */
+ void
+conc_unpark(void)
+{
+	pthread_cond_broadcast(&park_cv);
+}
+
+
+/*
+ * entries done by all the threads so far
+ */
+ static uint64_t
+conc_ops(void)
+{
+	uint64_t ops;
+	int t;
+
+	ops = 0;
+	for (t = 0; t <= nthreads; t++) {
+		ops = ops + ATOMIC_READ(thr_stats[t].dirs_scanned) +
+			ATOMIC_READ(thr_stats[t].files_scanned) +
+			ATOMIC_READ(thr_stats[t].links_scanned);
+	}
+
+	return ops;
+}
+
+
+ static void *
+conc_thread(void *arg __attribute__ ((unused)))
+{
+	struct timespec tick;
+	struct timespec now;
+	struct timespec then;
+	uint64_t ops;
+	uint64_t last_ops;
+	double rate;
+	double last_rate;
+	double secs;
+	int dir;
+	int step;
+	int active;
+
+	tick.tv_sec = CONC_TICK_MS / 1000;
+	tick.tv_nsec = (CONC_TICK_MS % 1000) * 1000000L;
+	dir = 1;
+	last_rate = 0;
+	last_ops = conc_ops();
+	clock_gettime(CLOCK_MONOTONIC, &then);
+
+	while (!ATOMIC_READ(shutdown_time)) {
+		nanosleep(&tick, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ops = conc_ops();
+		secs = (double)(now.tv_sec - then.tv_sec) +
+			(double)(now.tv_nsec - then.tv_nsec) / 1e9;
+		rate = (double)(ops - last_ops) / secs;
+		last_ops = ops;
+		then = now;
+
+		active = ATOMIC_READ(thr_active);
+		if ((ATOMIC_READ(n_idle) > 0) || (rate == 0)) {
+			/* not enough work to go around, so nothing to learn */
+			last_rate = 0;
+			continue;
+		}
+		if (last_rate == 0) {
+			last_rate = rate;     /* the first look at this much work */
+			continue;
+		}
+		if (rate < last_rate * CONC_LOSS) {
+			dir = -dir;
+		} else if (rate < last_rate * CONC_GAIN) {
+			dir = -1;             /* flat, see if it can be done with less */
+		}
+		last_rate = rate;
+
+		step = active / 8;
+		if (step < 1) {
+			step = 1;
+		}
+		active = active + dir * step;
+		if (active > thr_max) {
+			active = thr_max;
+			dir = -1;
+		} else if (active < thr_min) {
+			active = thr_min;
+			dir = 1;
+		}
+		if (active == ATOMIC_READ(thr_active)) {
+			continue;
+		}
+		DBUG("conc: %.0f entries/sec, %d active threads", rate, active);
+		/* idle threads past the new limit need to go park */
+		__atomic_store_n(&thr_active, active, __ATOMIC_SEQ_CST);
+		wake_idle(1);
+		stats_hdr->active_threads = (uint64_t)active;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * start the controller, if --auto-threads asked for one.
+ * returns 0, or an errno
+ */
+ int
+conc_start(void)
+{
+	pthread_t tid;
+	pthread_attr_t attr;
+	int status;
+
+	stats_hdr->active_threads = (uint64_t)thr_active;
+	if (thr_max == 0) {
+		return 0;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	status = pthread_create(&tid, &attr, conc_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (status) {
+		FERR("Failed to start the concurrency controller.  errno=%d", status);
+	}
+
+	return status;
+}
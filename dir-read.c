@@ -0,0 +1,275 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * directory reading routines.  these call getdents64 straight into a big
+ * per-thread buffer and pick out the entries mdpf cares about in a single
+ * pass, instead of going through readdir one entry at a time with a fresh
+ * pair of dirents calloc'd for every directory.
+ *
+ * mdpf can recurse into a subdirectory while it's still in the middle of
+ * a buffer, so each thread keeps a stack of readers, one per level of
+ * in-loop recursion.  only the bottom one is full size, the others are
+ * DIRBUF_NESTED_SZ since deep recursion is almost always skinny.
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "mchown.h"
+
+size_t dirbuf_sz = DIRBUF_DEF_SZ;   /* size of the bottom reader's buffer */
+
+#define DR_ENT_BYTES 32          /* of a directory's st_size per entry, about */
+#define DR_SUBDIR_WEIGHT 64      /* entries a subdirectory is taken to be worth */
+#define DR_NLINK_MAX 65000       /* ext4 says 1 for more subdirs than this */
+
+struct dr_weight {
+	uint64_t w;
+	struct linux_dirent64 *de;
+};
+
+
+/*
+ * get the reader for this thread's current level of recursion, allocating
+ * it the first time that level is reached, and go down a level.
+ * returns NULL if it couldn't be allocated
+ */
+ struct dir_reader *
+dr_get(void)
+{
+	struct dir_reader **new_drs;
+	struct dir_reader *dr;
+	int depth;
+
+	depth = my_tpool->dr_depth;
+	if (depth >= my_tpool->ndrs) {
+		/* readers of the levels above are in use, so they mustn't move */
+		new_drs = realloc(my_tpool->drs,
+			(size_t)(depth + 1) * sizeof(struct dir_reader *));
+		if (new_drs == NULL) {
+			return NULL;
+		}
+		my_tpool->drs = new_drs;
+		dr = calloc(1, sizeof(struct dir_reader));
+		if (dr == NULL) {
+			return NULL;
+		}
+		dr->sz = (depth == 0) ? dirbuf_sz : DIRBUF_NESTED_SZ;
+		dr->buf = malloc(dr->sz);
+		/* every entry is at least 24 bytes, so this many is plenty */
+		dr->ents = malloc((dr->sz / 24 + 1) * sizeof(struct linux_dirent64 *));
+		if ((dr->buf == NULL) || (dr->ents == NULL)) {
+			free(dr->buf);
+			free(dr->ents);
+			free(dr);
+			return NULL;
+		}
+		my_tpool->drs[depth] = dr;
+		my_tpool->ndrs = depth + 1;
+		MBUG("dr_get: new dir reader at depth %d with %lu byte buffer", depth,
+			dr->sz);
+	}
+	dr = my_tpool->drs[depth];
+	dr->nents = 0;
+	my_tpool->dr_depth++;
+
+	return dr;
+}
+
+
+/*
+ * done with the reader from dr_get, go back up a level
+ */
+ void
+dr_put(void)
+{
+	my_tpool->dr_depth--;
+}
+
+
+/*
+ * fill the reader's buffer from the directory and pick out the entries
+ * that are regular files, directories or symlinks, other than . and ..
+ * entries of DT_UNKNOWN are kept too, for mdpf to stat, and with all, so
+ * is everything else, for a file system whose d_type can't be believed.
+ * keeps reading until there's at least one, or the end of the directory.
+ * returns the number of entries in dr->ents, 0 at end of directory, or -1
+ * with errno set
+ */
+ int
+dr_fill(struct dir_reader *dr, int fd, int all)
+{
+	struct linux_dirent64 *de;
+	long nread;
+	long pos;
+	char *nm;
+
+	dr->nents = 0;
+	while (dr->nents == 0) {
+		nread = syscall(SYS_getdents64, fd, dr->buf, dr->sz);
+		TS_ADD(syscalls, 1);
+		if (nread < 0) {
+			return -1;
+		}
+		if (nread == 0) {          /* normal EOD state */
+			return 0;
+		}
+		for (pos = 0; pos < nread; pos = pos + de->d_reclen) {
+			de = (struct linux_dirent64 *)(void *)(dr->buf + pos);
+			/* we only care about directories, regular files, and symlinks */
+			if ((!all) && (de->d_type != DT_DIR) && (de->d_type != DT_REG) &&
+				(de->d_type != DT_LNK) && (de->d_type != DT_UNKNOWN)) {
+
+				continue;
+			}
+			/* ignore "." and ".." entries */
+			nm = de->d_name;
+			if ((nm[0] == '.') &&
+				((nm[1] == '\0') || ((nm[1] == '.') && (nm[2] == '\0')))) {
+
+				continue;
+			}
+			dr->ents[dr->nents++] = de;
+		}
+	}
+
+	return dr->nents;
+}
+
+
+ static int
+dr_ino_cmp(const void *a, const void *b)
+{
+	const struct linux_dirent64 *x;
+	const struct linux_dirent64 *y;
+
+	x = *(struct linux_dirent64 * const *)a;
+	y = *(struct linux_dirent64 * const *)b;
+
+	return (x->d_ino > y->d_ino) - (x->d_ino < y->d_ino);
+}
+
+
+/*
+ * put the entries dr_fill picked out in inode number order.  on ext4 and
+ * xfs the order getdents64 gives is the name hash order, which is random
+ * with respect to where the inodes are, so stat'ing and chowning in that
+ * order on a cold cache is a seek per file on a spinning disk.  in inode
+ * order, it's a sweep across the inode tables, the way fts does it.  it's
+ * one buffer full at a time, so -b says how much gets sorted together.
+ *
+ * the subdirectories get queued in this order too, unless dr_weigh puts
+ * them in order of size after.  the thread that queued them pops them
+ * newest first, so it goes through them in descending order, which is
+ * still one sweep.
+ */
+ void
+dr_sort(struct dir_reader *dr)
+{
+	if (dr->nents > 1) {
+		qsort(dr->ents, (size_t)dr->nents, sizeof(struct linux_dirent64 *),
+			dr_ino_cmp);
+	}
+}
+
+
+/*
+ * about how much is under a directory, going by its stat.  a directory's
+ * size goes up with the number of entries in it, and its link count is 2
+ * plus the number of subdirectories, each of which has more under it.
+ * ext4 stops counting them at DR_NLINK_MAX and says 1, and btrfs always
+ * says 1, which just leaves the sizes to go by.
+ */
+ static uint64_t
+dr_weight(struct stat *st)
+{
+	uint64_t subdirs;
+
+	subdirs = (st->st_nlink < 2) ? DR_NLINK_MAX : (uint64_t)st->st_nlink - 2;
+
+	return (uint64_t)st->st_size / DR_ENT_BYTES + subdirs * DR_SUBDIR_WEIGHT;
+}
+
+
+ static int
+dr_weight_cmp(const void *a, const void *b)
+{
+	const struct dr_weight *x;
+	const struct dr_weight *y;
+
+	x = (const struct dr_weight *)a;
+	y = (const struct dr_weight *)b;
+
+	return (x->w < y->w) - (x->w > y->w);
+}
+
+
+/*
+ * largest subtree first.  the run isn't over until the last thread is
+ * done, so if the biggest subtree under a directory gets started last,
+ * it's done by a few threads while the rest sit idle at the end.  this
+ * moves the subdirectories among the entries dr_fill picked out after
+ * everything else, biggest first, going by dr_weight, which takes an
+ * fstatat of each.  mdpf then queues them in that order, so the thieves,
+ * who take the oldest, start on the big ones, and the thread that queued
+ * them pops the small ones with the cache still warm.  mdpf only does
+ * this for a directory with more subdirectories than there are threads,
+ * in the top WEIGH_DEPTH levels of a job, where the order they're taken
+ * in matters.
+ */
+ void
+dr_weigh(struct dir_reader *dr, int fd)
+{
+	struct linux_dirent64 *de;
+	struct stat st;
+	int ndirs;
+	int nother;
+	int i;
+
+	ndirs = 0;
+	for (i = 0; i < dr->nents; i++) {
+		ndirs = ndirs + (dr->ents[i]->d_type == DT_DIR);
+	}
+	if (ndirs < 2) {
+		return;
+	}
+	if (dr->wt == NULL) {
+		/* as many as dr->ents has room for, see dr_get */
+		dr->wt = malloc((dr->sz / 24 + 1) * sizeof(struct dr_weight));
+		if (dr->wt == NULL) {
+			return;
+		}
+	}
+
+	ndirs = nother = 0;
+	for (i = 0; i < dr->nents; i++) {
+		de = dr->ents[i];
+		if (de->d_type != DT_DIR) {
+			dr->ents[nother++] = de;
+			continue;
+		}
+		dr->wt[ndirs].de = de;
+		dr->wt[ndirs].w = 0;
+		TS_ADD(syscalls, 1);
+		if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			dr->wt[ndirs].w = dr_weight(&st);
+		}
+		ndirs++;
+	}
+	qsort(dr->wt, (size_t)ndirs, sizeof(struct dr_weight), dr_weight_cmp);
+	for (i = 0; i < ndirs; i++) {
+		dr->ents[nother + i] = dr->wt[i].de;
+	}
+}
@@ -0,0 +1,293 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * file system profiles.  what works best depends on the file system a
+ * directory is on: tmpfs and the local disk file systems are cpu bound and
+ * want about a thread per core, NFS waits on the network for every stat
+ * and chown and wants a lot more.  NFS can be let answer a stat out of its
+ * attribute cache (AT_STATX_DONT_SYNC) instead of going to the server to
+ * revalidate, with dontsync=1, but it's off by default, since a stale
+ * answer can skip a chown somebody else just undid, and then the tree
+ * isn't what it was asked to be.
+ * some FUSE file systems hand back a d_type that isn't worth much, so on
+ * those every entry gets stat'd to find out what it is.  on the local disk
+ * file systems that keep inodes in tables, ext4, xfs and btrfs, the
+ * entries of each getdents64 buffer get sorted by inode number before
+ * they're done, since hash order is random order on the disk, see
+ * dr_sort.  on those, and tmpfs, where a stat is cheap and a directory's
+ * size and link count say how much is in it, the subdirectories get
+ * queued biggest first, see dr_weigh.
+ *
+ * the top of each job gets fstatfs'd, and after that only a directory
+ * with a different st_dev than its parent, which is a mount being crossed.
+ * everything else just gets its parent's profile, see mdpf.
+ *
+ * --fs-profile NAME[,dtype=0|1][,dontsync=0|1][,inosort=0|1][,weigh=0|1]
+ * [,threads=PCT] forces one profile everywhere, or with auto for NAME,
+ * keeps the detection and just changes the profiles.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+
+#include "mchown.h"
+
+/*
+ * the generic one is first, it's for anything not in here.  the f_type
+ * values are the *_SUPER_MAGIC ones from linux/magic.h
+ */
+static struct fs_profile fs_profiles[] = {
+	/* name      f_type        threads% dtype dontsync inosort weigh */
+	{"generic",  0,            90,      1,    0,       0,      0,    0},
+	{"tmpfs",    0x01021994L,  90,      1,    0,       0,      1,    0},
+	{"ext4",     0xEF53L,      90,      1,    0,       1,      1,    0},
+	{"xfs",      0x58465342L,  90,      1,    0,       1,      1,    0},
+	{"btrfs",    0x9123683EL,  90,      1,    0,       1,      1,    0},
+	{"nfs",      0x6969L,      400,     1,    0,       0,      0,    0},
+	{"smb",      0xFE534D42L,  400,     1,    0,       0,      0,    0},
+	{"cifs",     0xFF534D42L,  400,     1,    0,       0,      0,    0},
+	{"fuse",     0x65735546L,  200,     0,    0,       0,      0,    0},
+};
+
+#define FS_NPROFILES (sizeof(fs_profiles) / sizeof(fs_profiles[0]))
+
+struct fs_profile *fs_root = &fs_profiles[0];   /* sizes the CLI's pool */
+static struct fs_profile *fs_forced;            /* from --fs-profile */
+
+
+/*
+ * what --fs-profile takes,
+ * NAME[,dtype=0|1][,dontsync=0|1][,inosort=0|1][,weigh=0|1][,threads=PCT]
+ * where NAME is one of the profiles, or auto.  returns 0, or -1 if it's
+ * no good
+ */
+ int
+parse_fs_profile(const char *str)
+{
+	struct fs_profile *fp;
+	char buf[128];
+	char *tok;
+	char *prog;
+	unsigned int i;
+	int dtype;
+	int dont_sync;
+	int ino_sort;
+	int weigh;
+	int pct;
+	int val;
+
+	if (strlen(str) >= sizeof(buf)) {
+		return -1;
+	}
+	strcpy(buf, str);
+	prog = strtok_r(buf, ",", &tok);
+	if (prog == NULL) {
+		return -1;
+	}
+	fp = NULL;
+	if (strcmp(prog, "auto")) {
+		for (i = 0; i < FS_NPROFILES; i++) {
+			if (!strcmp(prog, fs_profiles[i].name)) {
+				fp = &fs_profiles[i];
+			}
+		}
+		if (fp == NULL) {
+			return -1;
+		}
+	}
+
+	dtype = dont_sync = ino_sort = weigh = pct = -1;
+	for (prog = strtok_r(NULL, ",", &tok); prog;
+		prog = strtok_r(NULL, ",", &tok)) {
+
+		if ((sscanf(prog, "dtype=%d", &val) == 1) &&
+			((val == 0) || (val == 1))) {
+
+			dtype = val;
+		} else if ((sscanf(prog, "dontsync=%d", &val) == 1) &&
+			((val == 0) || (val == 1))) {
+
+			dont_sync = val;
+		} else if ((sscanf(prog, "inosort=%d", &val) == 1) &&
+			((val == 0) || (val == 1))) {
+
+			ino_sort = val;
+		} else if ((sscanf(prog, "weigh=%d", &val) == 1) &&
+			((val == 0) || (val == 1))) {
+
+			weigh = val;
+		} else if (sscanf(prog, "threads=%d", &val) == 1) {
+			if ((val < 1) || (val > 10000)) {
+				return -1;
+			}
+			pct = val;
+		} else {
+			return -1;
+		}
+	}
+
+	/* the changes go to the forced one, or with auto, to all of them */
+	for (i = 0; i < FS_NPROFILES; i++) {
+		if (fp && (fp != &fs_profiles[i])) {
+			continue;
+		}
+		if (dtype >= 0) {
+			fs_profiles[i].dtype = (unsigned char)dtype;
+		}
+		if (dont_sync >= 0) {
+			fs_profiles[i].dont_sync = (unsigned char)dont_sync;
+		}
+		if (ino_sort >= 0) {
+			fs_profiles[i].ino_sort = (unsigned char)ino_sort;
+		}
+		if (weigh >= 0) {
+			fs_profiles[i].weigh = (unsigned char)weigh;
+		}
+		if (pct > 0) {
+			fs_profiles[i].thr_pct = pct;
+		}
+	}
+	fs_forced = fp;
+	if (fp) {
+		fs_root = fp;
+	}
+
+	return 0;
+}
+
+
+ static struct fs_profile *
+fs_lookup(long f_type)
+{
+	unsigned int i;
+
+	if (fs_forced) {
+		return fs_forced;
+	}
+	for (i = 1; i < FS_NPROFILES; i++) {
+		if (fs_profiles[i].f_type == f_type) {
+			return &fs_profiles[i];
+		}
+	}
+
+	return &fs_profiles[0];
+}
+
+
+/*
+ * the profile for the file system fd is on, counting it as one more mount
+ * using it.  if fstatfs fails, it's the generic one.  sets *rdonly if the
+ * mount is read-only, see --skip-read-only
+ */
+ struct fs_profile *
+fs_profile_fd(int fd, unsigned char *rdonly)
+{
+	struct statfs sfs;
+	struct fs_profile *fp;
+
+	*rdonly = 0;
+	if (fs_forced && (!prune_ro)) {
+		fp = fs_forced;
+	} else {
+		TS_ADD(syscalls, 1);
+		if (fstatfs(fd, &sfs)) {
+			WARN("Could not fstatfs, errno %d, using the generic profile",
+				errno);
+			fp = &fs_profiles[0];
+		} else {
+			fp = fs_lookup((long)sfs.f_type);
+			*rdonly = (sfs.f_flags & ST_RDONLY) != 0;
+		}
+		if (fs_forced) {
+			fp = fs_forced;
+		}
+	}
+	__sync_add_and_fetch(&fp->mounts, 1);
+
+	return fp;
+}
+
+
+/*
+ * find the profile for the CLI's path before the pool is sized, which is
+ * all fs_root is for.  it doesn't count as a mount, the top of the job
+ * gets looked at again when it's opened
+ */
+ void
+fs_profile_root(const char *path)
+{
+	struct statfs sfs;
+
+	if ((fs_forced == NULL) && (statfs(path, &sfs) == 0)) {
+		fs_root = fs_lookup((long)sfs.f_type);
+	}
+	DBUG("'%s' gets the %s profile", path, fs_root->name);
+}
+
+
+/*
+ * stat a name in dir_fd without following symlinks, the way the profile
+ * says.  returns 0, or -1 with errno set
+ */
+ int
+fs_stat(int dir_fd, char *name, struct stat *st, struct fs_profile *fp)
+{
+	struct statx stx;
+
+	if (!fp->dont_sync) {
+		return fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW);
+	}
+	if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+		STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_NLINK |
+		STATX_INO, &stx)) {
+
+		return -1;
+	}
+	st->st_mode = stx.stx_mode;
+	st->st_uid = stx.stx_uid;
+	st->st_gid = stx.stx_gid;
+	st->st_nlink = stx.stx_nlink;
+	st->st_ino = stx.stx_ino;
+	st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+
+	return 0;
+}
+
+
+/*
+ * the profiles that got used, as a JSON array, for stats_json
+ */
+ void
+fs_profile_json(FILE *fp)
+{
+	unsigned int i;
+	int n;
+
+	fprintf(fp, "[");
+	for (i = 0, n = 0; i < FS_NPROFILES; i++) {
+		if (ATOMIC_READ(fs_profiles[i].mounts) == 0) {
+			continue;
+		}
+		fprintf(fp, "%s{\"name\": \"%s\", \"mounts\": %u, \"threads_pct\": %d, "
+			"\"dtype\": %d, \"dont_sync\": %d, \"ino_sort\": %d, "
+			"\"weigh\": %d}", n++ ? ", " : "", fs_profiles[i].name,
+			fs_profiles[i].mounts, fs_profiles[i].thr_pct, fs_profiles[i].dtype,
+			fs_profiles[i].dont_sync, fs_profiles[i].ino_sort,
+			fs_profiles[i].weigh);
+	}
+	fprintf(fp, "]");
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * uid/gid remapping, for moving a tree from one set of ids to another in
+ * one pass instead of one pass per id.
+ *
+ * --map FILE gives old to new tables for uids and gids.  instead of the
+ * job's one owner, each file gets the new ids for the ones it has, and an
+ * id that isn't in the table is left alone.  --from USER:GROUP only lets
+ * files that are owned by that be changed, with --map or without it.
+ * either way the current owner has to be known, so the job always stats.
+ *
+ * the tables are open addressed, with linear probing, and twice as many
+ * slots as ids at least, so a lookup is a multiply and a probe or two in
+ * a table that's a few KB for a few hundred ids.  they're built before
+ * the pool starts and never change after, so there's no locking.
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mchown.h"
+
+#define ID_NONE UINT32_MAX        /* an empty slot, not a valid id anyway */
+#define ID_TBL_MIN 64             /* slots */
+
+struct id_ent {
+	uint32_t old;
+	uint32_t new;
+};
+
+struct id_tbl {
+	struct id_ent *ents;
+	uint32_t mask;            /* slots - 1 */
+	uint32_t n;
+};
+
+struct id_map {
+	struct id_tbl u;
+	struct id_tbl g;
+	int remap;                /* have --map tables, not just --from */
+	uid_t from_u;             /* (uid_t)-1 for any */
+	gid_t from_g;
+};
+
+struct id_map *id_map;           /* the CLI's, from --map and --from */
+
+
+ static uint32_t
+idmap_hash(uint32_t id)
+{
+	return (id * 0x9E3779B1U) ^ (id >> 16);
+}
+
+
+/*
+ * the new id for id, or id if it isn't in the table
+ */
+ static uint32_t
+idmap_get(struct id_tbl *t, uint32_t id)
+{
+	uint32_t i;
+
+	if (t->n == 0) {
+		return id;
+	}
+	for (i = idmap_hash(id) & t->mask; t->ents[i].old != ID_NONE;
+		i = (i + 1) & t->mask) {
+
+		if (t->ents[i].old == id) {
+			return t->ents[i].new;
+		}
+	}
+
+	return id;
+}
+
+
+/*
+ * put old -> new in the table, growing it if it's half full.
+ * returns 0, EEXIST if old is already there going somewhere else, or
+ * ENOMEM
+ */
+ static int
+idmap_put(struct id_tbl *t, uint32_t old, uint32_t new)
+{
+	struct id_tbl nt;
+	uint32_t i;
+	uint32_t j;
+
+	if ((t->ents == NULL) || ((t->n + 1) * 2 > t->mask + 1)) {
+		nt.mask = t->ents ? (t->mask + 1) * 2 - 1 : ID_TBL_MIN - 1;
+		nt.n = 0;
+		nt.ents = malloc(((size_t)nt.mask + 1) * sizeof(struct id_ent));
+		if (nt.ents == NULL) {
+			return ENOMEM;
+		}
+		memset(nt.ents, 0xff, ((size_t)nt.mask + 1) * sizeof(struct id_ent));
+		for (j = 0; t->ents && (j <= t->mask); j++) {
+			if (t->ents[j].old != ID_NONE) {
+				(void)idmap_put(&nt, t->ents[j].old, t->ents[j].new);
+			}
+		}
+		free(t->ents);
+		*t = nt;
+	}
+
+	for (i = idmap_hash(old) & t->mask; t->ents[i].old != ID_NONE;
+		i = (i + 1) & t->mask) {
+
+		if (t->ents[i].old == old) {
+			return (t->ents[i].new == new) ? 0 : EEXIST;
+		}
+	}
+	t->ents[i].old = old;
+	t->ents[i].new = new;
+	t->n++;
+
+	return 0;
+}
+
+
+ static struct id_map *
+idmap_get_map(void)
+{
+	if (id_map == NULL) {
+		id_map = calloc(1, sizeof(struct id_map));
+		if (id_map) {
+			id_map->from_u = (uid_t)-1;
+			id_map->from_g = (gid_t)-1;
+		}
+	}
+
+	return id_map;
+}
+
+
+/*
+ * read the --map file.  each line is
+ *     user OLD NEW
+ * or
+ *     group OLD NEW
+ * with names or numbers for the ids.  blank lines and # comments are
+ * skipped.
+ * returns 0, or -1 after saying why
+ */
+ int
+idmap_load(char *file)
+{
+	struct id_map *map;
+	FILE *fp;
+	char line[1024];
+	char kind[16];
+	char old[256];
+	char new[256];
+	char *p;
+	uid_t ou, nu;
+	gid_t og, ng;
+	int lineno;
+	int err;
+
+	map = idmap_get_map();
+	if (map == NULL) {
+		FERR("No memory for the id map");
+		return -1;
+	}
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		FERR("Could not open the id map '%s' errno %d", file, errno);
+		return -1;
+	}
+	map->remap = 1;
+
+	err = 0;
+	lineno = 0;
+	while ((!err) && fgets(line, sizeof(line), fp)) {
+		lineno++;
+		p = strchr(line, '#');
+		if (p) {
+			*p = '\0';
+		}
+		for (p = line; isspace((unsigned char)*p); p++) {
+			;
+		}
+		if (*p == '\0') {
+			continue;
+		}
+		if (sscanf(p, "%15s %255s %255s", kind, old, new) != 3) {
+			FERR("%s:%d: expected 'user|group OLD NEW'", file, lineno);
+			err = -1;
+		} else if (!strcmp(kind, "user")) {
+			if (parse_uid(old, &ou) || parse_uid(new, &nu) ||
+				(ou == (uid_t)-1) || (nu == (uid_t)-1)) {
+
+				FERR("%s:%d: bad user '%s' or '%s'", file, lineno, old, new);
+				err = -1;
+			} else {
+				err = idmap_put(&map->u, ou, nu);
+			}
+		} else if (!strcmp(kind, "group")) {
+			if (parse_gid(old, &og) || parse_gid(new, &ng) ||
+				(og == (gid_t)-1) || (ng == (gid_t)-1)) {
+
+				FERR("%s:%d: bad group '%s' or '%s'", file, lineno, old, new);
+				err = -1;
+			} else {
+				err = idmap_put(&map->g, og, ng);
+			}
+		} else {
+			FERR("%s:%d: '%s' isn't user or group", file, lineno, kind);
+			err = -1;
+		}
+		if (err > 0) {
+			FERR("%s:%d: %s", file, lineno, (err == EEXIST) ?
+				"already mapped to something else" : "no memory");
+			err = -1;
+		}
+	}
+	if ((!err) && ferror(fp)) {
+		FERR("Could not read the id map '%s' errno %d", file, errno);
+		err = -1;
+	}
+	fclose(fp);
+	DBUG("id map '%s': %u uids, %u gids", file, map->u.n, map->g.n);
+
+	return err;
+}
+
+
+/*
+ * set the --from filter from USER:GROUP, where either can be left out,
+ * as with chown --from.
+ * returns 0, or -1 if it doesn't parse
+ */
+ int
+idmap_from(char *spec)
+{
+	struct id_map *map;
+	char *colon;
+	int rval;
+
+	map = idmap_get_map();
+	if (map == NULL) {
+		return -1;
+	}
+	rval = 0;
+	colon = strchr(spec, ':');
+	if (colon) {
+		*colon = '\0';
+		if (colon[1] && parse_gid(colon + 1, &map->from_g)) {
+			rval = -1;
+		}
+	}
+	if (spec[0] && parse_uid(spec, &map->from_u)) {
+		rval = -1;
+	}
+	if (colon) {
+		*colon = ':';
+	}
+
+	return rval;
+}
+
+
+/*
+ * whether the --map tables are in use, so there's no <user> <group>
+ */
+ int
+idmap_remap(void)
+{
+	return id_map && id_map->remap;
+}
+
+
+/*
+ * work out the owner a file with stat st should have.  *u and *g come in
+ * as the job's, and get the mapped ids with --map.
+ * returns 0, or -1 if --from says leave it alone
+ */
+ int
+idmap_owner(struct id_map *map, struct stat *st, uid_t *u, gid_t *g)
+{
+	if (((map->from_u != (uid_t)-1) && (st->st_uid != map->from_u)) ||
+		((map->from_g != (gid_t)-1) && (st->st_gid != map->from_g))) {
+
+		return -1;
+	}
+	if (map->remap) {
+		*u = idmap_get(&map->u, st->st_uid);
+		*g = idmap_get(&map->g, st->st_gid);
+	}
+
+	return 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * io_uring submission engine.  talks to the kernel with the raw syscalls
+ * so there's no liburing dependency.  each pool thread gets its own ring,
+ * so there's no locking in here at all.
+ *
+ * the only thing it does right now is statx a whole batch of directory
+ * entries at a time, which keeps dozens of lookups in flight per thread
+ * instead of one.  that matters on NFS, where every one is a round trip.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "mchown.h"
+
+struct mring {
+	int fd;
+	unsigned int entries;
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* for unmapping */
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	int lost;                 /* statx's that might still write to stx */
+	struct statx stx[STAT_BATCH_SZ];
+};
+
+
+ static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+ static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, NULL, 0);
+}
+
+
+ static int
+sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+	unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/*
+ * tear down a ring made by mring_init.  if mring_stat_batch couldn't wait
+ * for all of a batch, the kernel may still write results into r->stx, so
+ * r itself is left allocated
+ */
+ void
+mring_fini(struct mring *r)
+{
+	if (r == NULL) {
+		return;
+	}
+	if (r->sqes) {
+		munmap(r->sqes, r->sqes_sz);
+	}
+	if (r->cq_ring && (r->cq_ring != r->sq_ring)) {
+		munmap(r->cq_ring, r->cq_ring_sz);
+	}
+	if (r->sq_ring) {
+		munmap(r->sq_ring, r->sq_ring_sz);
+	}
+	if (r->fd >= 0) {
+		close(r->fd);
+	}
+	if (r->lost) {
+		WARN("io_uring: %d stats never completed, leaving their buffer",
+			r->lost);
+		return;
+	}
+	free(r);
+}
+
+
+/*
+ * set up a ring big enough for a full stat batch.
+ * returns the new ring, or NULL with errno set
+ */
+ struct mring *
+mring_init(void)
+{
+	struct mring *r;
+	struct io_uring_params p;
+	char *sq;
+	char *cq;
+	int serrno;
+
+	r = calloc(1, sizeof(struct mring));
+	if (r == NULL) {
+		return NULL;
+	}
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_io_uring_setup(STAT_BATCH_SZ, &p);
+	if (r->fd < 0) {
+		serrno = errno;
+		free(r);
+		errno = serrno;
+		return NULL;
+	}
+	r->entries = p.sq_entries;
+
+	r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_sz > r->sq_ring_sz) {
+			r->sq_ring_sz = r->cq_ring_sz;
+		}
+		r->cq_ring_sz = r->sq_ring_sz;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		goto mring_init_fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			goto mring_init_fail;
+		}
+	}
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto mring_init_fail;
+	}
+
+	sq = (char *)r->sq_ring;
+	cq = (char *)r->cq_ring;
+	r->sq_head = (unsigned int *)(void *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(void *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(void *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(void *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(void *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(void *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(void *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+
+	return r;
+
+mring_init_fail:
+	serrno = errno;
+	mring_fini(r);
+	errno = serrno;
+	return NULL;
+}
+
+
+/*
+ * find out if this kernel can do io_uring at all, and statx through it in
+ * particular (5.6 and later).  called once from main to pick the backend.
+ * returns 1 if it can, else 0
+ */
+ int
+mring_probe(void)
+{
+	struct mring *r;
+	struct io_uring_probe *probe;
+	size_t psz;
+	int ok;
+
+	r = mring_init();
+	if (r == NULL) {
+		DBUG("mring_probe: io_uring_setup failed errno %d", errno);
+		return 0;
+	}
+	psz = sizeof(struct io_uring_probe) +
+		256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, psz);
+	if (probe == NULL) {
+		mring_fini(r);
+		return 0;
+	}
+	ok = 0;
+	if (sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+		if ((probe->last_op >= IORING_OP_STATX) &&
+			(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED)) {
+
+			ok = 1;
+		}
+	}
+	DBUG("mring_probe: io_uring statx %s", ok ? "supported" : "not supported");
+	free(probe);
+	mring_fini(r);
+
+	return ok;
+}
+
+
+/*
+ * wait for the n statx's of a batch that are still in flight, after
+ * io_uring_enter failed, and throw their results away.  any it can't wait
+ * for are left in r->lost, see mring_fini
+ */
+ static void
+mring_drain(struct mring *r, int n)
+{
+	unsigned int head;
+	int ret;
+
+	while (n > 0) {
+		ret = sys_io_uring_enter(r->fd, 0, (unsigned int)n,
+			IORING_ENTER_GETEVENTS);
+		TS_ADD(syscalls, 1);
+		if ((ret < 0) && (errno != EINTR)) {
+			r->lost = n;
+			return;
+		}
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			head++;
+			n--;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+
+/*
+ * statx every name in the batch relative to dir_fd, all in flight at once.
+ * the results are stuffed into the struct stat fields that chown_stated
+ * looks at, with sb->err[x] set to the errno of any that failed.
+ * returns 0, or the errno if the ring itself failed.  the ring can't be
+ * used after that, what was in flight has been waited for, but what never
+ * got submitted is still in the submission queue; see chown_batch
+ */
+ int
+mring_stat_batch(struct mring *r, int dir_fd, struct stat_batch *sb)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct statx *stx;
+	unsigned int tail;
+	unsigned int head;
+	unsigned int idx;
+	unsigned int to_submit;
+	int x;
+	int done;
+	int ret;
+
+	/* fill in one sqe per entry */
+	tail = *r->sq_tail;
+	for (x = 0; x < sb->n; x++) {
+		idx = tail & *r->sq_mask;
+		sqe = &r->sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = dir_fd;
+		sqe->addr = (uint64_t)(uintptr_t)sb->names[x];
+		sqe->len = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID |
+			STATX_NLINK | STATX_INO;
+		sqe->off = (uint64_t)(uintptr_t)&r->stx[x];
+		sqe->statx_flags = (uint32_t)(AT_SYMLINK_NOFOLLOW | sb->at_flags);
+		sqe->user_data = (uint64_t)(unsigned int)x;
+		r->sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+	TS_ADD(uring_ops, (uint64_t)sb->n);
+
+	done = 0;
+	to_submit = (unsigned int)sb->n;
+	while (done < sb->n) {
+		ret = sys_io_uring_enter(r->fd, to_submit,
+			(unsigned int)(sb->n - done), IORING_ENTER_GETEVENTS);
+		TS_ADD(syscalls, 1);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = errno;
+			mring_drain(r, sb->n - (int)to_submit - done);
+			return ret;
+		}
+		to_submit = to_submit - (unsigned int)ret;
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			x = (int)cqe->user_data;
+			if (cqe->res < 0) {
+				sb->err[x] = -cqe->res;
+			} else {
+				stx = &r->stx[x];
+				sb->err[x] = 0;
+				sb->st[x].st_mode = stx->stx_mode;
+				sb->st[x].st_uid = stx->stx_uid;
+				sb->st[x].st_gid = stx->stx_gid;
+				sb->st[x].st_nlink = stx->stx_nlink;
+				sb->st[x].st_ino = stx->stx_ino;
+				sb->st[x].st_dev = makedev(stx->stx_dev_major,
+					stx->stx_dev_minor);
+			}
+			head++;
+			done++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * hard link dedup.  a backup snapshot tree can have files with dozens of
+ * links, and without this every link gets stat'd, and blind, chowned.
+ *
+ * each job gets a set of the (dev, ino) of every file it has stat'd that
+ * has more than one link, made the first time it sees one.  after that,
+ * mdpf looks up each file's d_ino from getdents64 before doing anything
+ * with it, and a file that's in the set is skipped without a syscall.
+ * chown_stated adds to the set, and if the inode turns out to be in there
+ * already, some other thread got to another link of it first, and it
+ * skips the chown.
+ *
+ * the set is open addressed, and never has anything taken out, so finding
+ * is lock free, and adding is a compare and swap on the slot's ino,
+ * followed by storing its dev + 1.  a finder that sees the ino but not the
+ * dev yet waits for it.  it's a fixed size, --link-mem MB for the CLI's one
+ * job, and an eighth of that for each of mchownd's, never more than
+ * --link-mem all together.  a set that fills up (3/4 full, to keep the
+ * probes short) just stops adding, and the links after that get done the
+ * usual way.  a job that can't have a set does without.  the set goes away
+ * when the job's done.
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mchown.h"
+
+#define LINK_PROBES 64            /* slots to look at before giving up */
+#define LINK_SET_MIN (64 * 1024)  /* smaller than this isn't worth it, bytes */
+#if defined(DAEMON_MODE)
+# define LINK_SET_SHARE 8         /* each job gets this fraction */
+#else
+# define LINK_SET_SHARE 1
+#endif
+
+struct link_ent {
+	uint64_t ino;             /* 0 for an empty slot */
+	uint64_t dev;             /* dev + 1, 0 until the ino's been claimed */
+};
+
+struct link_set {
+	struct link_ent *ents;
+	uint64_t mask;            /* slots - 1 */
+	uint64_t used;
+	uint64_t max_used;        /* full at this many */
+	uint64_t dropped;         /* couldn't be added */
+	size_t bytes;
+};
+
+unsigned int link_mem = LINK_MEM_DEF;   /* MB, from --link-mem */
+static uint64_t link_bytes;             /* in all the sets right now */
+
+
+ static uint64_t
+link_hash(uint64_t dev, uint64_t ino)
+{
+	uint64_t h;
+
+	h = (ino ^ (dev << 29) ^ (dev >> 3)) * 0x9E3779B97F4A7C15UL;
+
+	return h ^ (h >> 32);
+}
+
+
+/*
+ * get the job a set, if there's room in the budget.  sets job->links to
+ * LINKS_NONE if there isn't, so it's only tried once.
+ * returns the set, or LINKS_NONE
+ */
+ static struct link_set *
+link_set_new(struct job_info *job)
+{
+	struct link_set *ls;
+	size_t bytes;
+	uint64_t budget;
+	uint64_t in_use;
+	uint64_t slots;
+
+	budget = (uint64_t)link_mem * 1024 * 1024;
+	in_use = ATOMIC_READ(link_bytes);
+	bytes = (size_t)(budget / LINK_SET_SHARE);
+	if (bytes > budget - in_use) {
+		bytes = (in_use < budget) ? (size_t)(budget - in_use) : 0;
+	}
+	for (slots = 1; slots * 2 * sizeof(struct link_ent) <= bytes;
+		slots = slots * 2) {
+		;
+	}
+	bytes = (size_t)slots * sizeof(struct link_ent);
+
+	ls = NULL;
+	if (bytes >= LINK_SET_MIN) {
+		if (__sync_add_and_fetch(&link_bytes, bytes) <= budget) {
+			ls = calloc(1, sizeof(struct link_set));
+		}
+		if (ls) {
+			/* big enough to be mmap'd, so the pages come as they're used */
+			ls->ents = calloc(slots, sizeof(struct link_ent));
+			if (ls->ents == NULL) {
+				free(ls);
+				ls = NULL;
+			}
+		}
+		if (ls == NULL) {
+			__sync_sub_and_fetch(&link_bytes, bytes);
+		}
+	}
+	if (ls == NULL) {
+		MBUG("job %lu doesn't get a hard link set", job->job_id);
+		(void)__sync_bool_compare_and_swap(&job->links, NULL, LINKS_NONE);
+		return ATOMIC_READ(job->links);
+	}
+	ls->mask = slots - 1;
+	ls->max_used = slots - slots / 4;
+	ls->bytes = bytes;
+
+	/* some other thread might have beaten us to it */
+	if (!__sync_bool_compare_and_swap(&job->links, NULL, ls)) {
+		free(ls->ents);
+		free(ls);
+		__sync_sub_and_fetch(&link_bytes, bytes);
+		return ATOMIC_READ(job->links);
+	}
+	MBUG("job %lu hard link set of %lu slots", job->job_id, slots);
+
+	return ls;
+}
+
+
+/*
+ * is (dev, ino) in the job's set?  returns 1 if it is
+ */
+ int
+link_find(struct job_info *job, dev_t dev, uint64_t ino)
+{
+	struct link_set *ls;
+	struct link_ent *le;
+	uint64_t h;
+	uint64_t i;
+	uint64_t d;
+	uint64_t s;
+
+	ls = ATOMIC_READ(job->links);
+	if ((ls == NULL) || (ls == LINKS_NONE)) {
+		return 0;
+	}
+	h = link_hash((uint64_t)dev, ino);
+	for (i = 0; i < LINK_PROBES; i++) {
+		le = &ls->ents[(h + i) & ls->mask];
+		s = __atomic_load_n(&le->ino, __ATOMIC_ACQUIRE);
+		if (s == 0) {
+			return 0;
+		}
+		if (s != ino) {
+			continue;
+		}
+		while ((d = __atomic_load_n(&le->dev, __ATOMIC_ACQUIRE)) == 0) {
+			;                     /* it's only a store away */
+		}
+		if (d == (uint64_t)dev + 1) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * put (dev, ino) in the job's set, making the set if need be.
+ * returns 1 if it went in, 0 if it was already there, or -1 if there's
+ * no set or no room in it
+ */
+ int
+link_add(struct job_info *job, dev_t dev, uint64_t ino)
+{
+	struct link_set *ls;
+	struct link_ent *le;
+	uint64_t h;
+	uint64_t i;
+	uint64_t d;
+	uint64_t s;
+
+	ls = ATOMIC_READ(job->links);
+	if (ls == NULL) {
+		ls = link_set_new(job);
+	}
+	if ((ls == LINKS_NONE) || (ino == 0)) {
+		return -1;
+	}
+	if (ATOMIC_READ(ls->used) >= ls->max_used) {
+		__sync_add_and_fetch(&ls->dropped, 1);
+		return -1;
+	}
+	h = link_hash((uint64_t)dev, ino);
+	for (i = 0; i < LINK_PROBES; i++) {
+		le = &ls->ents[(h + i) & ls->mask];
+		s = __atomic_load_n(&le->ino, __ATOMIC_ACQUIRE);
+		if ((s == 0) && __sync_bool_compare_and_swap(&le->ino, 0, ino)) {
+			__atomic_store_n(&le->dev, (uint64_t)dev + 1, __ATOMIC_RELEASE);
+			__sync_add_and_fetch(&ls->used, 1);
+			return 1;
+		}
+		/* lost the slot to someone, see who it was */
+		s = __atomic_load_n(&le->ino, __ATOMIC_ACQUIRE);
+		if (s != ino) {
+			continue;
+		}
+		while ((d = __atomic_load_n(&le->dev, __ATOMIC_ACQUIRE)) == 0) {
+			;
+		}
+		if (d == (uint64_t)dev + 1) {
+			return 0;
+		}
+	}
+	__sync_add_and_fetch(&ls->dropped, 1);
+
+	return -1;
+}
+
+
+/*
+ * the job's done, so let go of its set, remembering how it went.
+ * jobs_lock must be held
+ */
+ void
+link_set_free(struct job_info *job)
+{
+	struct link_set *ls;
+
+	ls = job->links;
+	job->links = LINKS_NONE;
+	if ((ls == NULL) || (ls == LINKS_NONE)) {
+		return;
+	}
+	job->links_tracked = ls->used;
+	job->links_dropped = ls->dropped;
+	job->links_bytes = ls->bytes;
+	free(ls->ents);
+	__sync_sub_and_fetch(&link_bytes, ls->bytes);
+	free(ls);
+}
+
+
+/*
+ * how the job's set went, for stats_json, as JSON members.  jobs_lock
+ * must be held
+ */
+ void
+link_json(FILE *fp, struct job_info *job)
+{
+	struct link_set *ls;
+	uint64_t tracked;
+	uint64_t dropped;
+	uint64_t bytes;
+
+	ls = ATOMIC_READ(job->links);
+	if ((ls == NULL) || (ls == LINKS_NONE)) {
+		tracked = job->links_tracked;
+		dropped = job->links_dropped;
+		bytes = job->links_bytes;
+	} else {
+		tracked = ATOMIC_READ(ls->used);
+		dropped = ATOMIC_READ(ls->dropped);
+		bytes = ls->bytes;
+	}
+	fprintf(fp, "\"hardlinks_tracked\": %lu, \"hardlinks_dropped\": %lu, "
+		"\"hardlink_set_bytes\": %lu", tracked, dropped, bytes);
+}
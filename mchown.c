@@ -17,94 +17,44 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <pwd.h>
 #include <grp.h>
+#include <getopt.h>
+#include <time.h>
 
 #include "mchown.h"
 #ifdef MDEBUG
 int debug = MDEBUG;
 #endif
 
-struct dir_job *dir_jobs;        /* array of dir_jobs of size nthreads+1 */
-struct dir_job *dj_freelist;     /* pointer to top of list of free dirjobs */
-pthread_mutex_t queue_lock;
-pthread_cond_t queue_cv;
+pthread_mutex_t idle_lock;       /* covers parking, see conc_park */
+unsigned int n_idle;             /* threads parked in idle_wait */
+unsigned int dj_queued;          /* dir_jobs sitting on all the deques */
+unsigned int dj_outstanding;     /* dir_jobs queued or being worked on */
+unsigned int dir_fds;            /* directory fds open right now */
+unsigned int fd_budget;          /* no more queueing past this many dir_fds */
+unsigned int dj_max;             /* dir_jobs outstanding high-water mark */
+unsigned int split_ents = SPLIT_DEF;  /* --split-dirs, 0 for never */
 
 int nthreads;                    /* the number of pool threads we have */
-//int n_avail_threads;            /* number of sleeping threads - queue_lock */
-int dname_max;                   /* the size to allocate for dirent struct */
-uint64_t files_chowned;
-uint64_t dirs_chowned;
+int use_uring;                   /* batch stat calls through io_uring */
+int stat_mode = STAT_ADAPT;      /* stat before chown: always, never, or
+                                  * whatever seems to be working */
 
-int enqueue(char *dpath, char *name, struct creds *creds, uint64_t dj_id);
-
-#define SYS_CPU_FILE "/sys/devices/system/cpu/online"
-#define DJ_PATH_SZ 2048          /* the number of bytes to allocate for the
-                                  * string pointed to by dirjob->path */
-
- int
-get_core_count(void)
-{
-	int fd;
-	char online[512];
-	int c_hores;
-	int chars_read;
-	char *tok;           /* token pointer */
-	char *prog;          /* progress pointer */
-	int begin_cpu;       /* the cpu num at the beginning of a range */
-	int end_cpu;         /* the cpu num at the end of a range */
-
-	online[0] = '\0';
-	c_hores = 0;       /* we know there has to be at least one ... */
-
-	fd = open(SYS_CPU_FILE, O_RDONLY);
-	if (fd < 0) {
-		FERR("Problem opening %s for core count.  errno = %d", SYS_CPU_FILE,
-			errno);
-		return 0;
-	}
-
-	chars_read = read(fd, &online[0], sizeof(online) - 1);
-	if (chars_read < 1) {
-		FERR("Problem reading %s for core count.  errno = %d", SYS_CPU_FILE,
-			errno);
-		return 0;
-	}
-	online[chars_read] = '\0';
-
-	/*
-	 * what a holey pain in the
-	 */
-	prog = &online[0];
-	while ((tok = strpbrk(prog, ",-")) != NULL) {
-		if (*tok == ',') {
-			c_hores++;
-		} else if (*tok == '-') {
-			*tok = '\0';
-			sscanf(prog, "%d", &begin_cpu);
-			prog = tok + 1;
-			tok = strpbrk(prog, ",");
-			if (tok) {
-				*tok = '\0';
-			}
-			sscanf(prog, "%d", &end_cpu);
-			c_hores = c_hores + (end_cpu - begin_cpu + 1);
-			if (tok == NULL) {
-				prog = tok;
-				break;
-			}
-		}
-		prog = tok + 1;
-	}
-	if (prog && sscanf(prog, "%d", &end_cpu) == 1) {
-		c_hores++;
-	}
-
-	return c_hores;
-}
+int enqueue(struct dnode *dn, char *name, struct name_batch *nb,
+	struct creds *creds, uint64_t dj_id);
+void sched_help(struct job_info *mine);
 
+#define SCHED_HELP_TICK 64       /* entries between looks at sched_help */
+#ifndef O_NOATIME
+# define O_NOATIME 01000000      /* linux, only visible with _GNU_SOURCE */
+#endif
+#ifndef AT_STATX_DONT_SYNC
+# define AT_STATX_DONT_SYNC 0x4000  /* same */
+#endif
 
 /*
  * create the dirid for a path/credential set
@@ -121,25 +71,27 @@ mk_dirid(char *path __attribute__ ((unused)),
 }
 
 
-struct creds {
-	uid_t u;
-	gid_t g;
-} *cred_tbl;
+struct creds *cred_tbl;
+int ncreds;              /* number of slots in cred_tbl */
+pthread_mutex_t cred_lock;
 
 /*
- * find an unused slot in creds array
+ * find the slot in the creds array for this uid/gid, or an unused one
  */
  struct creds *
 get_cred(uid_t uid, gid_t gid)
 {
 	int i;
 
-	MBUG(" get_cred nthreads=%d, cred_tbl=%p, uid=%d, gid=%d", nthreads,
+	MBUG(" get_cred ncreds=%d, cred_tbl=%p, uid=%d, gid=%d", ncreds,
 		cred_tbl, uid, gid);
-	for (i = 0; i <= nthreads; i++) {
+	pthread_mutex_lock(&cred_lock);
+	for (i = 0; i < ncreds; i++) {
 		if ((cred_tbl[i].u == uid) && (cred_tbl[i].g == gid)) {
 			MBUG(" matching ids cred slot found @ %p index %d", &cred_tbl[i],
 				i);
+			cred_tbl[i].refs++;
+			pthread_mutex_unlock(&cred_lock);
 			return &cred_tbl[i];
 		}
 	}
@@ -147,20 +99,21 @@ get_cred(uid_t uid, gid_t gid)
 	/*
      * this is a credential set we don't already have, so find a slot for it
 	 */
-	for (i = 0; i <= nthreads; i++) {
+	for (i = 0; i < ncreds; i++) {
 		if ((cred_tbl[i].u == (uid_t)-1) && (cred_tbl[i].g == (gid_t)-1)) {
 			cred_tbl[i].u = uid;
 			cred_tbl[i].g = gid;
+			cred_tbl[i].refs = 1;
 			MBUG(" empty cred slot found @ %p index %d", &cred_tbl[i], i);
+			pthread_mutex_unlock(&cred_lock);
 			return &cred_tbl[i];
 		}
-		MBUG(" cred_tbl[%d].u=%d, cred_tbl[%d].g=%d", i, cred_tbl[i].u, i,
-			cred_tbl[i].g);
-		break;
 	}
+	pthread_mutex_unlock(&cred_lock);
 
 	/*
-	 * this should never be reached
+	 * only happens when mchownd has more distinct uid/gids in flight
+	 * than there are slots
 	 */
 	MBUG(" no cred slot found");
 	return NULL;
@@ -168,562 +121,1789 @@ get_cred(uid_t uid, gid_t gid)
 
 
 /*
- * return a cred slot back to unused status
+ * let go of a cred slot, returning it to unused status if nobody else
+ * is using it
  */
  void
 rel_cred(struct creds *cr)
 {
-	cr->u = (uid_t)-1;
-	cr->g = (gid_t)-1;
+	pthread_mutex_lock(&cred_lock);
+	if (--cr->refs == 0) {
+		cr->u = (uid_t)-1;
+		cr->g = (gid_t)-1;
+	}
+	pthread_mutex_unlock(&cred_lock);
 }
 
 
-#define is_dir(DENTRY) (DENTRY->d_type == DT_DIR)
-#define is_reg(DENTRY) (DENTRY->d_type == DT_REG)
-#define is_lnk(DENTRY) (DENTRY->d_type == DT_LNK)
-#define is_dir_or_reg(DENTRY) ((is_dir(DENTRY) || is_reg(DENTRY) || \
-	is_lnk(DENTRY)))
+/*
+ * job routines.
+ *
+ * a job is one hierarchy/credential pair.  mchown only ever has the one,
+ * mchownd has as many as have been submitted.  a job is done when the
+ * dnode for its top directory goes away, since that only happens when
+ * everything under it is done.  see dn_put.
+ */
+struct job_info *job_list;       /* newest first */
+pthread_mutex_t jobs_lock;       /* covers job_list and job state changes */
+pthread_cond_t jobs_cv;          /* broadcast whenever a job finishes */
+struct job_info *active_jobs;    /* the running ones, also under jobs_lock */
+unsigned int sched_weight;       /* total weight of the running jobs */
+int sched_multi;                 /* more than one job running, be fair */
 
 
 /*
- * change the uid/gid for a regular file
- *
- * possibly inline this, or just make it a macro
+ * turn a user name or a numeric uid into a uid.
+ * returns 0, or -1 if it's neither
  */
  int
-chown_reg(int dir_fd, char *dname, struct stat *statbuf, struct creds *cred)
+parse_uid(char *str, uid_t *uid)
 {
-	int rval;
-
-	rval = 0;
-
-	/* should not get here if file is symlink ... */
-	rval = fstatat(dir_fd, dname, statbuf, AT_SYMLINK_NOFOLLOW);
-		/* must define __USE_GNU before include fcntl.h to use
-		 * AT_NO_AUTOMOUNT flag
-		 * AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT */
-	if (rval) {
-		return -1;
+	struct passwd pw;
+	struct passwd *res;
+	char buf[1024];
+	char *end;
+	unsigned long v;
+
+	v = strtoul(str, &end, 10);
+	if ((*str != '\0') && (*end == '\0')) {
+		*uid = (uid_t)v;
+		return 0;
 	}
-	if ((statbuf->st_uid != cred->u) || (statbuf->st_gid != cred->g)) {
-		rval = fchownat(dir_fd, dname, cred->u, cred->g, AT_SYMLINK_NOFOLLOW);
-		if (rval) {
-			return -2;
-		}
-	} else {
-		return -3;
+	if (getpwnam_r(str, &pw, buf, sizeof(buf), &res) || (res == NULL)) {
+		return -1;
 	}
+	*uid = res->pw_uid;
 
-	return rval;
+	return 0;
 }
 
 
 /*
- * build a new dir_job structure
- */
-#define MK_DIRJOB(DJ, MDJ, BPATH, DENTRY) {                                 \
-				DJ = *MDJ;                                                  \
-				(DJ).path = BPATH;                                          \
-				strncpy((DJ).path, MDJ->path, DJ_PATH_SZ - 1);              \
-				strncat((DJ).path, "/", 2);                                 \
-				strncat((DJ).path, DENTRY->d_name, DJ_PATH_SZ - 1);}
-
-
-/*
- * main directory processing function
+ * turn a group name or a numeric gid into a gid.
+ * returns 0, or -1 if it's neither
  */
  int
-mdpf(struct dir_job *my_dirjob)
+parse_gid(char *str, gid_t *gid)
 {
-	DIR *dirptr;
-	struct creds *creds;
-	char bpath[DJ_PATH_SZ];	/* used for constructing file names for use in
-							 * the NEXT call to mdpf */
-	char m_err_str[128];
-	int myfd;
-	struct dirent *dentry;
-	struct dirent *res_dentry;
-	struct dirent *s_dentry;
-	struct stat statbuf;
-	int rd_status;
-	int rval;
-	int dirs_queued;
-	int reg_procd;
-	int dir_procd;
-	int lnk_procd;
-	int ndentries;				/* the number of directory entries that we
-								 * find interesting */
-	struct dir_job s_dir_job;   /* for single threaded operation */
-	struct dir_job *ldjob;      /* for single threaded operation */
-
-
-	dirs_queued = reg_procd = lnk_procd = dir_procd = 0;
-	creds = my_dirjob->ucred;   /* just cache this as we use it a lot */
-
-	MBUG(" mdpf called with my_dirjob=%p path '%s' uid %d gid %d", my_dirjob,
-		my_dirjob->path, creds->u, creds->g);
-
-	/* open the dir and start reading the entries */
-	dirptr = opendir(my_dirjob->path);
-	if (dirptr == NULL) {
-		rval = errno;
-		strerror_r(rval, m_err_str, 128);
-		FERR("[%02d] mdpf: opendir failed on called dir '%s' errno %d - %s",
-			my_tpool->thread_num, my_dirjob->path, rval, m_err_str);
-		shutdown_time++;
-		//sleep(10);
-		return -1;
-	}
-
-	/* get the fd from the DIR* */
-	myfd = dirfd(dirptr);
-
-	/* allocate the dirent for dentry and save_dentry structures */
-	dentry = calloc(1, (size_t)dname_max);
-	if (dentry == NULL) {
-		FERR("[%02d] Failed allocating dentry errno = %d", my_tpool->thread_num,
-			errno);
-		closedir(dirptr);
-		return -1;
-	}
-	s_dentry = calloc(1, (size_t)dname_max);
-	if (s_dentry == NULL) {
-		FERR("[%02d] Failed allocating s_dentry errno = %d",
-			my_tpool->thread_num, errno);
-		free(dentry);
-		closedir(dirptr);
-		return -1;
+	struct group gr;
+	struct group *res;
+	char buf[1024];
+	char *end;
+	unsigned long v;
+
+	v = strtoul(str, &end, 10);
+	if ((*str != '\0') && (*end == '\0')) {
+		*gid = (gid_t)v;
+		return 0;
 	}
-	MBUG("dentry and s_dentry allocated with size %d bytes", dname_max);
-
-	/*
-	 * process this directory
-	 */
-	if(fstat(myfd, &statbuf)) {
-		FERR("Failed to stat '%s' errno %d", my_dirjob->path, errno);
-		closedir(dirptr);
-		free(dentry);
-		free(s_dentry);
+	if (getgrnam_r(str, &gr, buf, sizeof(buf), &res) || (res == NULL)) {
 		return -1;
 	}
-	if ((statbuf.st_uid != creds->u) || (statbuf.st_gid != creds->g)) {
-		if(fchown(myfd, creds->u, creds->g)) {
-			FERR("Failed to process this '%s' dir errno %d", my_dirjob->path,
-				errno);
-			closedir(dirptr);
-			free(dentry);
-			free(s_dentry);
-			return -1;
-		}
-		dir_procd++;
-		MBUG("processed this '%s' dir", my_dirjob->path);
-	} else {
-		MBUG("this '%s' dir already the desired owner", my_dirjob->path);
-	}
+	*gid = res->gr_gid;
 
-	/*
-	 * process the files in this directory
-	 */
-	ndentries = 0;
-	rval = 0;
-	while ((!shutdown_time) && (!rval)) { /* stop loop if shutdown */
-		rd_status = readdir_r(dirptr, dentry, &res_dentry);
+	return 0;
+}
 
-		if (rd_status != 0) {
-			rval = errno;
-			strerror_r(rval, m_err_str, 128);
-			FERR("readdir_r returned %d errno %d - %s", rd_status, rval,
-				m_err_str);
-			break;
-		}
-		if (res_dentry == NULL) { /* normal EOD state */
-			break;
-		}
 
-		/* we only care about directories, regular files, and symlinks */
-		if (!is_dir_or_reg(dentry)) {
-			continue;
-		}
-		/* ignore "." and ".." entries */
-		if ((!strncmp(dentry->d_name, ".", 2)) ||
-			(!strncmp(dentry->d_name, "..", 3))) {
+/*
+ * make a new job and put it on the job list
+ * returns the job, or NULL with errno set
+ */
+ struct job_info *
+job_new(char *path, uid_t uid, gid_t gid)
+{
+	struct job_info *job;
 
-			continue;
-		}
+	job = calloc(1, sizeof(struct job_info));
+	if (job == NULL) {
+		return NULL;
+	}
+	job->path = strdup(path);
+	if (job->path == NULL) {
+		free(job);
+		return NULL;
+	}
+	job->ucred = get_cred(uid, gid);
+	if (job->ucred == NULL) {
+		free(job->path);
+		free(job);
+		errno = EAGAIN;
+		return NULL;
+	}
+	job->stat_mode = stat_mode;
+	job->map = id_map;
+	job->state = JOB_RUNNING;
+	job->weight = 1;
+	clock_gettime(CLOCK_REALTIME, &job->start);
+
+	pthread_mutex_lock(&jobs_lock);
+	job->job_id = mk_dirid(job->path, job->ucred);
+	job->next = job_list;
+	job_list = job;
+	job->active_next = active_jobs;
+	active_jobs = job;
+	sched_weight = sched_weight + job->weight;
+	sched_multi = (job->active_next != NULL);
+	pthread_mutex_unlock(&jobs_lock);
+	MBUG("job_new: job %lu for '%s'", job->job_id, job->path);
+
+	return job;
+}
 
-		ndentries = ndentries + 1;
 
-		if (is_reg(dentry) || is_lnk(dentry)) {
-			if (is_reg(dentry)) {
-				MBUG("chowning reg file '%s'", dentry->d_name);
-			} else {
-				MBUG("chowning lnk file '%s'", dentry->d_name);
-			}
-			rval = chown_reg(myfd, dentry->d_name, &statbuf, creds);
-			switch (rval) {
-				case -1:
-					rval = errno;
-					FERR("Failed stat of '%s' errno = %d", dentry->d_name,
-						errno);
-					break;
-				case -2:
-					rval = errno;
-					FERR("Failed chown of '%s' errno = %d", dentry->d_name,
-						errno);
-					break;
-				case -3:
-					rval = 0;
-					MBUG(" reg file '%s' already the desired owner",
-						dentry->d_name);
-					break;
-				case 0:
-					if (is_reg(dentry)) {
-						reg_procd++;
-					} else {
-						lnk_procd++;
-					}
-					break;
-			}
-		} else if (is_dir(dentry)) {
-			/* process the first directory outside the loop ... */
-			if (ndentries == 1) {
-				MBUG("mdpf - delay processing of %s/%s", my_dirjob->path,
-					dentry->d_name);
-				*s_dentry = *dentry;  /* this is a structure copy */
-				continue;
-			}
+/*
+ * note an error in a job.  keeps the errno of the first one
+ */
+ void
+job_err(struct job_info *job, int err)
+{
+	TS_ADD(errors, 1);
+	__sync_add_and_fetch(&job->errors, 1);
+	(void)__sync_bool_compare_and_swap(&job->err, 0, err);
+}
 
-			/* process a directory in the normal loop path */
-			MBUG("calling in-loop enqueue with path '%s' dentry '%s'",
-				my_dirjob->path, dentry->d_name);
-			if (!enqueue(my_dirjob->path, &dentry->d_name[0], creds,
-				my_dirjob->job_id)) {
 
-				/*
-				 * this block is the in-loop single-thread path
-				 */
+/*
+ * something happened that means the rest of the job can't be done.
+ * mchown gives up on everything, mchownd just lets the rest of this job's
+ * dir_jobs drain away without doing anything.
+ */
+ void
+job_fail(struct job_info *job, int err)
+{
+	job_err(job, err);
+	job->failed = 1;
+#if !defined(DAEMON_MODE)
+	/* job_wait has to hear about this, nothing queued is getting done */
+	pthread_mutex_lock(&jobs_lock);
+	shutdown_time++;
+	pthread_cond_broadcast(&jobs_cv);
+	pthread_mutex_unlock(&jobs_lock);
+#endif
+}
 
-				/* if in shutdown, avoid calling mdpf again */
-				if (shutdown_time) {
-					MBUG(" enqueue returned nak - in shutdown state");
-					break;
-				}
 
-				MBUG(" enqueue nak, dropping to single thread");
-				MK_DIRJOB(s_dir_job, my_dirjob, bpath, dentry);
-				rval = mdpf(&s_dir_job);
-				TZERO_DJ(&s_dir_job);
-			} else {
-				dirs_queued++;
-			}
+/*
+ * the last of a job's directories is done
+ */
+ void
+job_done(struct job_info *job)
+{
+	struct job_info **jp;
+
+	pthread_mutex_lock(&jobs_lock);
+	clock_gettime(CLOCK_REALTIME, &job->end);
+	job->state = job->failed ? JOB_FAILED : JOB_DONE;
+	for (jp = &active_jobs; *jp; jp = &(*jp)->active_next) {
+		if (*jp == job) {
+			*jp = job->active_next;
+			break;
 		}
 	}
+	sched_weight = sched_weight - job->weight;
+	sched_multi = (active_jobs != NULL) && (active_jobs->active_next != NULL);
+	link_set_free(job);
+	pthread_cond_broadcast(&jobs_cv);
+	pthread_mutex_unlock(&jobs_lock);
+	rel_cred(job->ucred);
+	MBUG("job_done: job %lu '%s' %s", job->job_id, job->path,
+		job->failed ? "failed" : "done");
+#if defined(DAEMON_MODE)
+	INFO("job %lu: '%s' %s, %lu files %lu dirs chowned, %u errors",
+		job->job_id, job->path, job->failed ? "failed" : "done",
+		job->files_chowned, job->dirs_chowned, job->errors);
+#endif
+}
 
-	closedir(dirptr);
 
-	if (shutdown_time) {
-		MBUG(" mdpf - shutdown_time set %d", shutdown_time);
+/*
+ * wait for a job to be done, which is exactly when the last dnode under
+ * it goes away, see dn_put.  in mchown a failed job means shutdown, and
+ * the pool threads stop taking dir_jobs, so quit waiting then too.
+ * returns the job's state, JOB_RUNNING if it was cut short
+ */
+ int
+job_wait(struct job_info *job)
+{
+	int state;
+
+	pthread_mutex_lock(&jobs_lock);
+	while ((job->state == JOB_RUNNING) && (!shutdown_time)) {
+		pthread_cond_wait(&jobs_cv, &jobs_lock);
 	}
+	state = job->state;
+	pthread_mutex_unlock(&jobs_lock);
 
-	if ((rd_status == 0) && (res_dentry == NULL) && (!shutdown_time) &&
-		(!rval)) {
+	return state;
+}
 
-		if (is_dir(s_dentry)) {
-			if (ndentries > 1) {
-				/* process the first directory in the out-of-loop path */
-				if (enqueue(my_dirjob->path, &s_dentry->d_name[0], creds,
-					my_dirjob->job_id)) {
 
-					dirs_queued++;
-					goto mdpf_exit; /* if last dir is queued, then done */
-				} else {
-					MBUG(" mdpf - enqueue nak, dropping to single thread");
-				}
-			} else { /* ndentries == 1 */
-				/* recurse into the 1-and-only directory */
-				MBUG("delayed single entry directory '%s', recursing into '%s'",
-					my_dirjob->path, s_dentry->d_name);
-			}
+/*
+ * find a job by its id.  jobs_lock must be held
+ */
+ struct job_info *
+job_find(uint64_t job_id)
+{
+	struct job_info *job;
 
-			/*
-			 * here we recurse into the last/only directory, either because
-			 * it's the only processable file in the directory, or because
-			 * enqueue above failed
-			 */
-			MBUG("strlen my_djob->path = %lu", strlen(my_dirjob->path));
-			MBUG("strlen s_dentry->d_name = %lu", strlen(s_dentry->d_name));
-			MK_DIRJOB(s_dir_job, my_dirjob, bpath, s_dentry);
-			MBUG("calling mdpf with path '%s'", s_dir_job.path);
-			rval = mdpf(&s_dir_job);
+	for (job = job_list; job; job = job->next) {
+		if (job->job_id == job_id) {
+			break;
 		}
 	}
 
-mdpf_exit:
-
-	free(dentry);
-	free(s_dentry);
-
-	MBUG("%s: files processed: %d, links processed: %d, dirs processed: %d, dirs queued: %d",
-		my_dirjob->path, reg_procd, lnk_procd, dir_procd, dirs_queued);
-
-	__sync_add_and_fetch(&files_chowned, reg_procd + lnk_procd, NULL);
-	__sync_add_and_fetch(&dirs_chowned, dir_procd, NULL);
-
-	MBUG("mdpf returning rval=%d", rval);
-	return rval;
+	return job;
 }
 
 
 /*
- * initialize a dir_jobs array into a free list
+ * forget about all but the newest keep finished jobs, so a long running
+ * mchownd doesn't grow forever.  jobs_lock must be held
  */
  void
-dj_freelist_init(struct dir_job *dj_array)
+job_trim(int keep)
 {
-	int x;
-
-	dj_freelist = &dj_array[1];
-	for (x = 2; x <= nthreads; x++) {
-		dj_array[x].forward = &dj_array[x - 1];
-		dj_array[x - 1].back = &dj_array[x];
+	struct job_info **jp;
+	struct job_info *job;
+	int n;
+
+	n = 0;
+	jp = &job_list;
+	while (*jp) {
+		job = *jp;
+		/* a thread may still be on its way out of the job's last mdpf */
+		if ((job->state == JOB_RUNNING) || ATOMIC_READ(job->running)) {
+			jp = &job->next;
+			continue;
+		}
+		if (++n <= keep) {
+			jp = &job->next;
+			continue;
+		}
+		*jp = job->next;
+		free(job->path);
+		free(job);
 	}
-	DBUG("dj_freelist_init: initialized dir_jobs array @ %p with %d elements",
-		dj_array, x);
 }
 
 
 /*
- * get an unused dir_job slot from dir_jobs array
- *
- * the plan is to have our own set of allocation routines and allocate
- * dir_jobs from the array that is malloc'd at the start.  this is much, much
- * faster than using malloc and free, and has the nice extra benefit
- * (n_avail_threads variable would no longer be needed) of telling us
- * when we're out of worker threads.
- *
- * queue_lock must be held
+ * give a job a bigger or smaller piece of the pool than the others, and
+ * optionally limit it to cap dir_jobs at once, which is also about how
+ * many threads it can have.  see job_share
  */
- struct dir_job *
-dj_calloc(void)
+ void
+job_set_share(struct job_info *job, unsigned int weight, unsigned int cap)
 {
-	struct dir_job *new_dj;
-
-	new_dj = dj_freelist;
-	if (dj_freelist) {
-		dj_freelist = dj_freelist->back;
-	} else {
-		return new_dj;
+	if (weight < 1) {
+		weight = 1;
 	}
-	if (dj_freelist) {
-		dj_freelist->forward = NULL;
+	pthread_mutex_lock(&jobs_lock);
+	if (job->state == JOB_RUNNING) {
+		sched_weight = sched_weight - job->weight + weight;
 	}
-
-	new_dj->forward = new_dj->back = NULL;
-
-	return new_dj;
-	//return malloc(sizeof(struct dir_job));
+	job->weight = weight;
+	job->cap = cap;
+	pthread_mutex_unlock(&jobs_lock);
 }
 
 
 /*
- * clear out the dir_job entry in the dir_jobs array.
- * queue_lock must be held by caller.
+ * how many dir_jobs a job may have queued or in progress at once.  the
+ * dj_max that there's room for are split between the running jobs by
+ * weight, and everybody gets at least one.  with a single job that's all
+ * of them.
  */
- void
-dj_free(struct dir_job *rel_dj)
+ unsigned int
+job_share(struct job_info *job)
 {
-	TZERO_DJ(rel_dj);
-	if (dj_freelist) {
-		dj_freelist->forward = rel_dj;
-		rel_dj->back = dj_freelist;
+	unsigned int share;
+	unsigned int tw;
+
+	share = dj_max;
+	tw = ATOMIC_READ(sched_weight);
+	if (tw > job->weight) {
+		share = (unsigned int)((uint64_t)share * job->weight / tw);
+	}
+	if (share < 1) {
+		share = 1;
+	}
+	if (job->cap && (share > job->cap)) {
+		share = job->cap;
 	}
 
-	dj_freelist = rel_dj;
-	//memset((void *)del_dj, 0, sizeof(struct dir_job));
+	return share;
 }
 
 
 /*
- * queue list data structure and routines.
- * these routines manage the double-linked list queue_list which is
- * used to keep track of the dir_jobs that need doing.
- *
- * queue_lock must be held by caller of all ql_ and dequeue functions
+ * hand the top directory of a job to the pool.  this is how mchownd starts
+ * a job; it's pushed on the main thread's deque, where the pool threads
+ * steal it from.  it doesn't count against the outstanding dir_job limit,
+ * since there's nobody to fall back to recursing if it's refused.
+ * returns 0, or an errno
  */
-struct queue_list {
-	struct queue_list *up;
-	struct queue_list *down;
-	struct dir_job *djob;
-} *qlist, *qlist_tail;
+ int
+job_submit(struct job_info *job)
+{
+	struct dir_job dj;
 
+	TZERO_DJ(&dj);
+	dj.name = slab_strdup(job->path);
+	if (dj.name == NULL) {
+		return errno;
+	}
+	dj.ucred = job->ucred;
+	dj.job_id = job->job_id;
+	dj.job = job;
+	__sync_add_and_fetch(&dj_outstanding, 1);
+	__sync_add_and_fetch(&job->outstanding, 1);
+	__sync_add_and_fetch(&job->queued, 1);
+	if (dq_push(&threads[0].dq, &dj)) {
+		__sync_sub_and_fetch(&job->queued, 1);
+		__sync_sub_and_fetch(&job->outstanding, 1);
+		__sync_sub_and_fetch(&dj_outstanding, 1);
+		slab_free_str(dj.name);
+		return ENOMEM;
+	}
+	__sync_add_and_fetch(&dj_queued, 1);
+	wake_idle(0);
 
-/*
- * grab an unused qlist struct from the array
- *
- * see comments for get_dj_slot() for a glimpse of the future of this function
- */
- struct queue_list *
-ql_get_item(void)
-{
-	return calloc(1, sizeof(struct queue_list));
+	return 0;
 }
 
 
+#define is_dir(D_TYPE) ((D_TYPE) == DT_DIR)
+#define is_reg(D_TYPE) ((D_TYPE) == DT_REG)
+#define is_lnk(D_TYPE) ((D_TYPE) == DT_LNK)
+
+
 /*
- * release a qlist struct to the free list
+ * work out the owner a file with this stat should have, the job's cred, or
+ * what --map says it should be.
+ * returns 1 if it needs changing to *u, *g
  */
- void
-ql_rel_item(struct queue_list *ql_item)
+ static int
+chown_want(struct job_info *job, struct stat *statbuf, struct creds *cred,
+	uid_t *u, gid_t *g)
 {
-	//memset(ql_item, 0, sizeof(struct queue_list));
-	free(ql_item);
+	*u = cred->u;
+	*g = cred->g;
+	if (job->map && idmap_owner(job->map, statbuf, u, g)) {
+		return 0;
+	}
+
+	return (statbuf->st_uid != *u) || (statbuf->st_gid != *g);
 }
 
 
 /*
- * get a count of items in the queue
+ * change the uid/gid for a file that has already been stat'd, if needed.
+ * a file with more than one link is only done for the first link of it
+ * the job comes across, see links.c
  */
  int
-size_of_qlist(void)
+chown_stated(struct job_info *job, int dir_fd, char *dname,
+	struct stat *statbuf, struct creds *cred)
 {
-	int qsize;
-	struct queue_list *ql_item;
+	uid_t u;
+	gid_t g;
+	uint64_t t;
+	int rval;
+
+	rval = 0;
 
-	qsize = 0;
-	ql_item = qlist;
-	while (ql_item) {
-		qsize++;
-		ql_item = ql_item->down;
+	if ((statbuf->st_nlink > 1) && (!S_ISDIR(statbuf->st_mode)) &&
+		(link_add(job, statbuf->st_dev, statbuf->st_ino) == 0)) {
+
+		return -4;
+	}
+	if (chown_want(job, statbuf, cred, &u, &g)) {
+		TR_START(t);
+		rval = fchownat(dir_fd, dname, u, g, AT_SYMLINK_NOFOLLOW);
+		TR_STOP(chown_ns, t);
+		TS_ADD(syscalls, 1);
+		if (rval) {
+			return -2;
+		}
+	} else {
+		return -3;
 	}
 
-	return qsize;
+	return rval;
 }
 
 
 /*
- * remove a dirjob from the queue, and return a pointer to it
+ * change the uid/gid for a regular file
+ *
+ * possibly inline this, or just make it a macro
  */
- struct queue_list *
-ql_get_top(void)
+ int
+chown_reg(struct job_info *job, int dir_fd, char *dname, struct stat *statbuf,
+	struct creds *cred, struct fs_profile *fs)
 {
-	struct queue_list *top_item;
+	uint64_t t;
+	int rval;
 
-	top_item = qlist;
-	if (qlist) {
-		qlist = qlist->down;
-	} else {
-		return top_item;
-	}
-	if (qlist) {
-		qlist->up = NULL;
-	} else {
-		qlist_tail = qlist;
+	/* should not get here if file is symlink ... */
+	TR_START(t);
+	rval = fs_stat(dir_fd, dname, statbuf, fs);
+	TR_STOP(stat_ns, t);
+	TS_ADD(syscalls, 1);
+		/* must define __USE_GNU before include fcntl.h to use
+		 * AT_NO_AUTOMOUNT flag
+		 * AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT */
+	if (rval) {
+		return -1;
 	}
 
-	return top_item;
+	return chown_stated(job, dir_fd, dname, statbuf, cred);
 }
 
 
 /*
- * add a new dir job to the tail of the queue
+ * change the uid/gid for a file without looking at it first.  when nearly
+ * every file needs changing anyway, the stat is just a wasted syscall.
  */
  int
-ql_add(struct dir_job *new_dir_job)
+chown_blind(int dir_fd, char *dname, struct creds *cred)
 {
-	struct queue_list *new_ql_item;
-	int serrno;
-
-	new_ql_item = ql_get_item();
-	if (new_ql_item == NULL) {
-		serrno = errno;
-		MBUG(" ql_add - malloc of new_ql_item failed");
-		return serrno;
-	}
+	uint64_t t;
+	int rval;
 
-	new_ql_item->djob = new_dir_job;
-	new_ql_item->up = qlist_tail;
-	if (qlist_tail) {
-		qlist_tail->down = new_ql_item;
-	} else {
-		qlist = new_ql_item;
+	TS_ADD(syscalls, 1);
+	TR_START(t);
+	rval = fchownat(dir_fd, dname, cred->u, cred->g, AT_SYMLINK_NOFOLLOW);
+	TR_STOP(chown_ns, t);
+	if (rval) {
+		return -2;
 	}
-	qlist_tail = new_ql_item;
 
 	return 0;
 }
 
 
 /*
- * wait for the threads associated with a particular dirid
+ * adaptive stat-first vs. blind chown.
+ *
+ * stat-first costs two syscalls for every file that needs changing, but
+ * only one for every file that's already right.  so keep track of how
+ * many of the files stat'd were already the desired owner.  when hardly
+ * any are, stop stat'ing and chown everything.  while blind, still stat
+ * every ADAPT_PROBE'th file, and go back to stat-first if enough of those
+ * turn out to already be right.  a directory starts out the way its
+ * parent was going when it was opened.
  */
+#define ADAPT_WINDOW 32          /* stat'd files per decision */
+#define ADAPT_PROBE 16           /* while blind, stat one file in this many */
+#define ADAPT_PROBE_WINDOW 4     /* probes per decision while blind */
+
  int
-thread_pool_wait(uint64_t did)
+adapt_blind(struct adapt *ad)
 {
-	int iter;
-	int x;
-	useconds_t sleep_dur;
+	if (ad->mode != STAT_ADAPT) {
+		return ad->mode == STAT_NEVER;
+	}
+	if (!ad->blind) {
+		return 0;
+	}
+	ad->count++;
+	if (ad->count >= ADAPT_PROBE) {
+		ad->count = 0;
+		return 0;          /* probe this one */
+	}
+
+	return 1;
+}
+
+
+/*
+ * note whether a file that was stat'd was already the desired owner,
+ * and change course if the last window's worth says to
+ */
+ void
+adapt_note(struct adapt *ad, int hit)
+{
+	ad->seen++;
+	ad->hits = ad->hits + hit;
+	if (ad->seen < (ad->blind ? ADAPT_PROBE_WINDOW : ADAPT_WINDOW)) {
+		return;
+	}
+	if ((!ad->blind) && (ad->hits * 8 <= ad->seen)) {
+		MBUG(" adapt - %d of %d already owned, going blind", ad->hits,
+			ad->seen);
+		ad->blind = 1;
+		ad->count = 0;
+	} else if (ad->blind && (ad->hits * 4 >= ad->seen)) {
+		MBUG(" adapt - %d of %d probes already owned, stat'ing again",
+			ad->hits, ad->seen);
+		ad->blind = 0;
+	}
+	ad->seen = ad->hits = 0;
+}
+
+
+/*
+ * sort out the return value of chown_reg/chown_stated, and count it
+ * returns 0, or the errno if the chown or stat failed
+ */
+ int
+chown_tally(struct job_info *job, int rval, char *dname, unsigned char d_type,
+	int *reg_procd, int *lnk_procd)
+{
+	switch (rval) {
+		case -1:
+			rval = errno;
+			FERR("Failed stat of '%s' errno = %d", dname, errno);
+			job_err(job, rval);
+			break;
+		case -2:
+			rval = errno;
+			FERR("Failed chown of '%s' errno = %d", dname, errno);
+			job_err(job, rval);
+			break;
+		case -3:
+			rval = 0;
+			MBUG(" reg file '%s' already the desired owner", dname);
+			break;
+		case -4:
+			rval = 0;
+			TS_ADD(hardlinks_skipped, 1);
+			MBUG(" '%s' is a link to an inode already done", dname);
+			break;
+		case 0:
+			if (d_type == DT_REG) {
+				(*reg_procd)++;
+			} else {
+				(*lnk_procd)++;
+			}
+			break;
+	}
+
+	return rval;
+}
+
+
+/*
+ * stat a batch of files through io_uring, then chown the ones that need it.
+ * if the ring fails, it's torn down and this thread goes on with the plain
+ * syscalls, starting with this batch.  empties the batch.
+ * returns 0, or the errno of the first failure
+ */
+ int
+chown_batch(struct job_info *job, int dir_fd, struct stat_batch *sb,
+	struct creds *cred, struct adapt *ad, int *reg_procd, int *lnk_procd)
+{
+	uint64_t t;
+	int x;
+	int rval;
+
+	MBUG("stat batch of %d entries", sb->n);
+	if (my_tpool->ring) {
+		TR_START(t);
+		rval = mring_stat_batch(my_tpool->ring, dir_fd, sb);
+		TR_STOP(stat_ns, t);
+		if (rval) {
+			WARN("[%02d] io_uring stat batch failed errno %d, using plain "
+				"syscalls", my_tpool->thread_num, rval);
+			mring_fini(my_tpool->ring);
+			my_tpool->ring = NULL;
+		}
+	}
+	rval = 0;
+	for (x = 0; (x < sb->n) && (!rval); x++) {
+		if (my_tpool->ring == NULL) {
+			rval = chown_reg(job, dir_fd, sb->names[x], &sb->st[x], cred,
+				sb->fs);
+			if (rval != -1) {
+				adapt_note(ad, (rval == -3) || (rval == -4));
+			}
+		} else if (sb->err[x]) {
+			errno = sb->err[x];
+			rval = -1;
+		} else {
+			rval = chown_stated(job, dir_fd, sb->names[x], &sb->st[x], cred);
+			adapt_note(ad, (rval == -3) || (rval == -4));
+		}
+		rval = chown_tally(job, rval, sb->names[x], sb->types[x], reg_procd,
+			lnk_procd);
+	}
+	sb->n = 0;
+
+	return rval;
+}
+
+
+/*
+ * get this thread's io_uring and stat batch, setting them up the first
+ * time through.  if the ring can't be had, this thread just goes on with
+ * the plain syscalls.
+ * returns the stat batch, or NULL if not using io_uring
+ */
+ struct stat_batch *
+get_stat_batch(void)
+{
+	if ((!use_uring) || (my_tpool->sb)) {
+		/* no ring after it's failed, see chown_batch */
+		return my_tpool->ring ? my_tpool->sb : NULL;
+	}
+
+	my_tpool->sb = calloc(1, sizeof(struct stat_batch));
+	if (my_tpool->sb == NULL) {
+		return NULL;
+	}
+	my_tpool->ring = mring_init();
+	if (my_tpool->ring == NULL) {
+		WARN("[%02d] io_uring setup failed errno %d, using plain syscalls",
+			my_tpool->thread_num, errno);
+		free(my_tpool->sb);
+		my_tpool->sb = NULL;
+		return NULL;
+	}
+
+	return my_tpool->sb;
+}
+
+
+/*
+ * stash a file in the stat batch, to be stat'd with the rest of it when
+ * it's full.  the first one sets the flags for the lot.
+ * returns 1 if it's full now
+ */
+ static int
+sb_add(struct stat_batch *sb, char *name, unsigned char d_type,
+	struct fs_profile *fs)
+{
+	if (sb->n == 0) {
+		sb->at_flags = fs->dont_sync ? AT_STATX_DONT_SYNC : 0;
+		sb->fs = fs;
+	}
+	strcpy(sb->nbuf[sb->n], name);
+	sb->names[sb->n] = sb->nbuf[sb->n];
+	sb->types[sb->n] = d_type;
+	sb->n++;
+
+	return sb->n == STAT_BATCH_SZ;
+}
+
+
+/*
+ * splitting up huge directories.
+ *
+ * the pool only goes as wide as the tree, so one directory with millions
+ * of files in it would be done by the one thread that opened it.  once
+ * mdpf has come across split_ents entries in a directory, the rest of its
+ * files go into name batches instead of being done on the spot, and each
+ * full batch is pushed on the thread's deque as a dir_job of its own, for
+ * the parent dnode with nb set, which holds the directory's fd open like a
+ * subdirectory's dir_job does.  whoever steals it chowns those names
+ * relative to that fd.  a batch is only pushed while the deque has fewer
+ * than NB_QUEUED_MAX on it, which means the other threads are taking them
+ * as fast as they come; when they aren't, they're busy with something
+ * else, and the reader does the batch itself.  so a directory of any size
+ * never has more than a couple of batches waiting.
+ */
+
+/*
+ * name batches are too big for the slab, so they get their own free
+ * lists: a few on each thread, and the rest in a depot.  like the slab's
+ * objects, they're mostly freed by some other thread than the one that
+ * made them, so without the depot the reader would be mallocing a new one
+ * every time.  there's never more of them than were out at once, which
+ * NB_QUEUED_MAX keeps down to a few per thread.
+ */
+static pthread_mutex_t nb_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct name_batch *nb_depot;
+
+
+/*
+ * get an empty name batch.  returns NULL if there's no memory for one
+ */
+ static struct name_batch *
+nb_get(void)
+{
+	struct name_batch *nb;
+
+	if (my_tpool && my_tpool->nb_free) {
+		nb = my_tpool->nb_free;
+		my_tpool->nb_free = nb->next;
+		my_tpool->nb_nfree--;
+	} else {
+		nb = NULL;
+		if (ATOMIC_READ(nb_depot)) {
+			pthread_mutex_lock(&nb_lock);
+			nb = nb_depot;
+			if (nb) {
+				nb_depot = nb->next;
+			}
+			pthread_mutex_unlock(&nb_lock);
+		}
+		if (nb == NULL) {
+			nb = malloc(sizeof(struct name_batch));
+			if (nb == NULL) {
+				return NULL;
+			}
+		}
+	}
+	nb->n = 0;
+	nb->used = 0;
+
+	return nb;
+}
+
+
+/*
+ * done with a name batch, from whichever thread
+ */
+ static void
+nb_put(struct name_batch *nb)
+{
+	if (my_tpool && (my_tpool->nb_nfree < NB_FREE_MAX)) {
+		nb->next = my_tpool->nb_free;
+		my_tpool->nb_free = nb;
+		my_tpool->nb_nfree++;
+		return;
+	}
+	pthread_mutex_lock(&nb_lock);
+	nb->next = nb_depot;
+	nb_depot = nb;
+	pthread_mutex_unlock(&nb_lock);
+}
+
+
+/*
+ * add a file to a name batch, getting one if need be.
+ * returns 1 if it's full now, 0 if not, -1 if there's no memory for it
+ */
+ static int
+nb_add(struct name_batch **nbp, char *name, unsigned char d_type)
+{
+	struct name_batch *nb;
+	size_t len;
+
+	nb = *nbp;
+	if (nb == NULL) {
+		nb = nb_get();
+		if (nb == NULL) {
+			return -1;
+		}
+		*nbp = nb;
+	}
+	len = strlen(name) + 1;
+	nb->off[nb->n] = (unsigned short)nb->used;
+	nb->types[nb->n] = d_type;
+	memcpy(nb->buf + nb->used, name, len);
+	nb->used = nb->used + (unsigned int)len;
+	nb->n++;
+
+	/* full when the next name might not fit */
+	return (nb->n == NB_ENTS) || (nb->used + NAME_MAX + 1 > NB_BUF);
+}
+
+
+/*
+ * hand a name batch of dn's to the pool, if there's anybody to take it.
+ * *nbp is theirs now, and NULL, if it was.
+ * returns 1 if it was queued, 0 if it's still the caller's to do
+ */
+ static int
+nb_publish(struct dnode *dn, struct name_batch **nbp, struct creds *creds,
+	uint64_t dj_id)
+{
+	if (my_tpool->dq.tail - my_tpool->dq.head >= NB_QUEUED_MAX) {
+		return 0;
+	}
+	if (!enqueue(dn, NULL, *nbp, creds, dj_id)) {
+		return 0;
+	}
+	*nbp = NULL;
+
+	return 1;
+}
+
+
+/*
+ * chown the files in a name batch of dn's, and empty it.  goes about it
+ * the same way mdpf does, starting out blind or not the way dn was going.
+ * returns 0, or the errno of the first failure
+ */
+ static int
+nb_chown(struct job_info *job, struct dnode *dn, struct name_batch *nb,
+	struct creds *creds, int *reg_procd, int *lnk_procd)
+{
+	struct stat_batch *sb;
+	struct adapt ad;
+	struct stat statbuf;
+	char *name;
+	int i;
+	int rval;
+
+	sb = get_stat_batch();
+	memset(&ad, 0, sizeof(ad));
+	ad.blind = dn->blind;
+	ad.mode = job->stat_mode;
+	rval = 0;
+	for (i = 0; (i < nb->n) && (!rval) && (!JOB_STOPPING(job)); i++) {
+		name = nb->buf + nb->off[i];
+		if (adapt_blind(&ad)) {
+			rval = chown_blind(dn->fd, name, creds);
+		} else if (sb) {
+			if (sb_add(sb, name, nb->types[i], dn->prof)) {
+				rval = chown_batch(job, dn->fd, sb, creds, &ad, reg_procd,
+					lnk_procd);
+			}
+			continue;
+		} else {
+			rval = chown_reg(job, dn->fd, name, &statbuf, creds, dn->prof);
+			if (rval != -1) {
+				adapt_note(&ad, (rval == -3) || (rval == -4));
+			}
+		}
+		rval = chown_tally(job, rval, name, nb->types[i], reg_procd,
+			lnk_procd);
+	}
+	if (sb && sb->n) {
+		if (!rval && !JOB_STOPPING(job)) {
+			rval = chown_batch(job, dn->fd, sb, creds, &ad, reg_procd,
+				lnk_procd);
+		}
+		sb->n = 0;
+	}
+	dn->blind = (unsigned char)ad.blind;    /* for the next batch */
+	nb->n = 0;
+	nb->used = 0;
+
+	return rval;
+}
+
+
+/*
+ * do a name batch that came off a deque, and let go of it and its dnode
+ */
+ void
+nb_run(struct dir_job *dj)
+{
+	struct job_info *job;
+	struct dnode *dn;
+	struct trace_span span;
+	int reg_procd;
+	int lnk_procd;
+	int n;
+
+	job = dj->job;
+	dn = dj->parent;
+	reg_procd = lnk_procd = 0;
+	n = dj->nb->n;
+	if (!JOB_STOPPING(job)) {
+		MBUG(" nb_run - %d files in '%s'", n, dn_path(dn));
+		if (trace_on) {
+			trace_begin(&span);
+		}
+		(void)nb_chown(job, dn, dj->nb, dj->ucred, &reg_procd, &lnk_procd);
+		if (trace_on) {
+			trace_end(&span, dn, n, reg_procd + lnk_procd);
+		}
+		__sync_add_and_fetch(&job->files_chowned, reg_procd + lnk_procd, NULL);
+		TS_ADD(files_changed, (uint64_t)reg_procd);
+		TS_ADD(links_changed, (uint64_t)lnk_procd);
+		TS_ADD(batches, 1);
+	}
+	nb_put(dj->nb);
+	dj->nb = NULL;
+	dj_drop(dj);
+}
+
+
+/*
+ * build a new dir_job structure for a subdirectory of DN
+ */
+#define MK_DIRJOB(DJ, MDJ, DN, NAME) {                                      \
+				DJ = *MDJ;                                                  \
+				(DJ).parent = DN;                                           \
+				(DJ).name = NAME;                                           \
+				(DJ).nb = NULL;                                             \
+				dn_hold_child(DN);}
+
+
+/*
+ * directory node routines.
+ *
+ * every directory being worked on has a dnode.  a dnode holds the open fd
+ * of its directory so that subdirectories can be opened relative to it
+ * with openat, and the name of the directory so that a full path can be
+ * put together when one is needed for a message.  the top dnode of a job
+ * holds the invocation path as its name.
+ *
+ * fd_refs counts the users of the fd: mdpf while it's processing the
+ * directory, plus every subdirectory that has been queued or recursed
+ * into but not opened yet.  whoever drops it to 0 closes the fd.
+ *
+ * refs counts mdpf processing the directory, plus every child dnode that
+ * still exists, so a dnode lives until everything under it is done.
+ */
+
+
+/*
+ * hold a dnode's fd open, and the dnode itself, on behalf of a
+ * subdirectory that is about to be queued or recursed into
+ */
+ void
+dn_hold_child(struct dnode *dn)
+{
+	__sync_add_and_fetch(&dn->refs, 1);
+	__sync_add_and_fetch(&dn->fd_refs, 1);
+}
+
+
+/*
+ * done with a dnode's fd, close it if nobody else needs it
+ */
+ void
+dn_fd_put(struct dnode *dn)
+{
+	if (__sync_sub_and_fetch(&dn->fd_refs, 1) == 0) {
+		if (dn->fd >= 0) {
+			close(dn->fd);
+			TS_ADD(syscalls, 1);
+			__sync_sub_and_fetch(&dir_fds, 1);
+		}
+		dn->fd = -1;
+	}
+}
+
+
+/*
+ * drop a reference on a dnode.  when the last one goes, the whole subtree
+ * under it is done, so free it and drop the reference it had on its parent
+ */
+ void
+dn_put(struct dnode *dn)
+{
+	struct dnode *parent;
+
+	while (dn && (__sync_sub_and_fetch(&dn->refs, 1) == 0)) {
+		parent = dn->parent;
+		MBUG(" dn_put - subtree done for '%s'", dn->name);
+		if (parent == NULL) {
+			job_done(dn->job);     /* the top of the job */
+		}
+		slab_free(dn, sizeof(struct dnode) + strlen(dn->name) + 1);
+		dn = parent;
+	}
+}
+
+
+/*
+ * put together the full path of a dnode, for messages.
+ * returns a pointer to a per-thread buffer that is good until the next call
+ */
+ char *
+dn_path(struct dnode *dn)
+{
+	struct dnode *d;
+	size_t len;
+	size_t nlen;
+	char *p;
+	char *newbuf;
+
+	len = 0;
+	for (d = dn; d; d = d->parent) {
+		len = len + strlen(d->name) + 1;
+	}
+	if (len > my_tpool->pathbuf_sz) {
+		newbuf = realloc(my_tpool->pathbuf, len);
+		if (newbuf == NULL) {
+			return dn->name;    /* better than nothing */
+		}
+		my_tpool->pathbuf = newbuf;
+		my_tpool->pathbuf_sz = len;
+	}
+	p = my_tpool->pathbuf + len - 1;
+	*p = '\0';
+	for (d = dn; d; d = d->parent) {
+		nlen = strlen(d->name);
+		p = p - nlen;
+		memcpy(p, d->name, nlen);
+		if (d->parent) {
+			*(--p) = '/';
+		}
+	}
+
+	return my_tpool->pathbuf;
+}
+
+
+/*
+ * let go of a dir_job that isn't going to be processed, along with what it
+ * holds on its parent.  a job's top dir_job holds the job itself.
+ */
+ void
+dj_drop(struct dir_job *dj)
+{
+	if (dj->parent) {
+		dn_fd_put(dj->parent);
+		dn_put(dj->parent);
+	} else {
+		job_done(dj->job);
+	}
+}
+
+
+/*
+ * make the dnode for a dir_job and open its directory, relative to the
+ * parent dnode's fd, without following symlinks and without updating the
+ * atime.  the top dir of a job is opened by path, and is allowed to be a
+ * symlink.  the dir_job's hold on the parent's fd is let go either way,
+ * once there's a dnode.
+ * returns the new dnode, with fd -1 and errno set if the open failed,
+ * or NULL if it couldn't be allocated, and the dir_job is still the
+ * caller's to dj_drop
+ */
+ struct dnode *
+dn_open(struct dir_job *dj)
+{
+	struct dnode *dn;
+	size_t nlen;
+	int oflags;
+	int serrno;
+
+	nlen = strlen(dj->name);
+	dn = slab_alloc(sizeof(struct dnode) + nlen + 1);
+	if (dn == NULL) {
+		return NULL;
+	}
+	memcpy(dn->name, dj->name, nlen + 1);
+	dn->parent = dj->parent;    /* the dir_job's ref on parent is now ours */
+	dn->job = dj->job;
+	dn->blind = dj->parent ? dj->parent->blind : 0;
+	dn->refs = 1;
+	dn->fd_refs = 1;
+
+	oflags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOATIME;
+	if (dj->parent) {
+		oflags = oflags | O_NOFOLLOW;
+		dn->fd = openat(dj->parent->fd, dj->name, oflags);
+		TS_ADD(syscalls, 1);
+		if ((dn->fd < 0) && (errno == EPERM)) {
+			/* O_NOATIME is only allowed for the owner, or root */
+			dn->fd = openat(dj->parent->fd, dj->name, oflags & ~O_NOATIME);
+			TS_ADD(syscalls, 1);
+		}
+		serrno = errno;
+		dn_fd_put(dj->parent);
+	} else {
+		dn->fd = open(dj->name, oflags);
+		TS_ADD(syscalls, 1);
+		if ((dn->fd < 0) && (errno == EPERM)) {
+			dn->fd = open(dj->name, oflags & ~O_NOATIME);
+			TS_ADD(syscalls, 1);
+		}
+		serrno = errno;
+	}
+	if (dn->fd >= 0) {
+		__sync_add_and_fetch(&dir_fds, 1);
+	}
+	errno = serrno;
+
+	return dn;
+}
+
+
+/*
+ * note the file system an open dnode is on.  the same file system as the
+ * parent gets the same profile, anything else is a mount, and gets looked
+ * at.  see fsprof.c
+ */
+ void
+dn_set_fs(struct dnode *dn, dev_t dev)
+{
+	if ((dn->parent == NULL) || (dev != dn->parent->dev)) {
+		dn->prof = fs_profile_fd(dn->fd, &dn->rdonly);
+		MBUG("'%s' is on a %s file system", dn_path(dn), dn->prof->name);
+		if (dn->parent == NULL) {
+			dn->job->fs_name = dn->prof->name;
+		}
+	} else {
+		dn->prof = dn->parent->prof;
+		dn->rdonly = dn->parent->rdonly;
+	}
+	dn->dev = dev;
+}
+
+
+/*
+ * done processing a dnode's directory
+ */
+ void
+dn_done(struct dnode *dn)
+{
+	dn_fd_put(dn);
+	dn_put(dn);
+}
+
+
+/*
+ * main directory processing function
+ */
+ int
+mdpf(struct dir_job *my_dirjob)
+{
+	struct creds *creds;
+	char m_err_str[128];
+	int myfd;
+	struct dnode *dn;
+	struct linux_dirent64 *dentry;
+	char s_name[NAME_MAX + 1];  /* first dir found, processed after the loop */
+	struct stat statbuf;
+	struct dir_reader *dr;
+	int eod;                    /* reached the end of the directory */
+	int nents;
+	int x;
+	int rval;
+	int dirs_queued;
+	int reg_procd;
+	int dir_procd;
+	int lnk_procd;
+	int ndentries;				/* the number of directory entries that we
+								 * find interesting */
+	struct dir_job s_dir_job;   /* for single threaded operation */
+	struct dir_job t_dir_job;   /* the last dir, done by going round again */
+	struct stat_batch *sb;      /* NULL if not batching through io_uring */
+	struct adapt ad;            /* stat-first or blind, see adapt_blind */
+	struct job_info *job;
+	struct fs_profile *fs;
+	unsigned char d_type;
+	int stated;                 /* statbuf is the entry's, to find d_type */
+	uid_t new_u;                /* what this dir's owner should be */
+	gid_t new_g;
+	struct trace_span span;     /* with --trace, see trace.c */
+	uint64_t t;
+	struct name_batch *nb;      /* files for the pool, see nb_publish */
+	int split;                  /* this one's big enough to split */
+	int full;
+	int weigh;                  /* queue subdirs biggest first, dr_weigh */
+	struct dnode *d;
+
+
+mdpf_top:
+	dirs_queued = reg_procd = lnk_procd = dir_procd = 0;
+	creds = my_dirjob->ucred;   /* just cache this as we use it a lot */
+	job = my_dirjob->job;
+	sb = get_stat_batch();
+
+	/* a job that's given up just drains what it had queued */
+	if (JOB_STOPPING(job)) {
+		MBUG(" mdpf - job %lu stopping, dropping '%s'", job->job_id,
+			my_dirjob->name);
+		dj_drop(my_dirjob);
+		return -1;
+	}
 
-	iter = 0;
-	sleep_dur = 150000;  /* initial sleep duration 250 msecs */
+	/* stopping to resume later, this one's for next time, see ckpt.c */
+	if (ATOMIC_READ(ck_stopping)) {
+		ck_record(my_dirjob->parent, my_dirjob->name);
+		dj_drop(my_dirjob);
+		return 0;
+	}
 
-	if (shutdown_time) {
-		join_pool();
+	MBUG(" mdpf called with my_dirjob=%p name '%s' uid %d gid %d", my_dirjob,
+		my_dirjob->name, creds->u, creds->g);
+
+	/* open the dir and start reading the entries */
+	dn = dn_open(my_dirjob);
+	if (dn == NULL) {
+		rval = errno;
+		FERR("[%02d] Failed allocating dnode errno = %d", my_tpool->thread_num,
+			rval);
+		/* before the drop, which can be what finishes the job */
+		job_fail(job, rval);
+		dj_drop(my_dirjob);
+		return -1;
+	}
+	if (dn->fd < 0) {
+		rval = errno;
+		if (job->watch && dn->parent && (rval == ENOENT)) {
+			MBUG(" mdpf - '%s' came and went", dn_path(dn));
+			dn_done(dn);
+			return 0;
+		}
+		strerror_r(rval, m_err_str, 128);
+		FERR("[%02d] mdpf: open failed on called dir '%s' errno %d - %s",
+			my_tpool->thread_num, dn_path(dn), rval, m_err_str);
+		job_fail(job, rval);
+		//sleep(10);
+		dn_done(dn);
+		return -1;
+	}
+	myfd = dn->fd;
+	if (watch_inotify) {
+		watch_dir(dn);         /* before it's read, so nothing's missed */
+	}
+	TS_ADD(dirs_scanned, 1);
+	if (stats_live) {
+		stats_set_path(dn_path(dn));
+	}
+	memset(&ad, 0, sizeof(ad));
+	ad.blind = dn->blind;
+	ad.mode = job->stat_mode;
+
+	/*
+	 * process this directory
+	 */
+	TS_ADD(syscalls, 1);
+	if(fstat(myfd, &statbuf)) {
+		FERR("Failed to stat '%s' errno %d", dn_path(dn), errno);
+		job_err(job, errno);
+		dn_done(dn);
+		return -1;
+	}
+
+	dn_set_fs(dn, statbuf.st_dev);
+	fs = dn->prof;
+	if (prune_on && prune_dir(dn, &statbuf)) {
+		TS_ADD(pruned, 1);
+		dn_done(dn);
 		return 0;
 	}
+	if (trace_on) {
+		trace_begin(&span);
+	}
+
+	if (chown_want(job, &statbuf, creds, &new_u, &new_g)) {
+		TS_ADD(syscalls, 1);
+		TR_START(t);
+		rval = fchown(myfd, new_u, new_g);
+		TR_STOP(chown_ns, t);
+		if (rval) {
+			FERR("Failed to process this '%s' dir errno %d", dn_path(dn),
+				errno);
+			job_err(job, errno);
+			if (trace_on) {
+				trace_end(&span, dn, 0, 0);
+			}
+			dn_done(dn);
+			return -1;
+		}
+		dir_procd++;
+		MBUG("processed this '%s' dir", dn_path(dn));
+	} else {
+		MBUG("this '%s' dir already the desired owner", dn_path(dn));
+	}
+
+	dr = dr_get();
+	if (dr == NULL) {
+		FERR("[%02d] Failed allocating dir reader errno = %d",
+			my_tpool->thread_num, errno);
+		job_err(job, errno);
+		if (trace_on) {
+			trace_end(&span, dn, 0, dir_procd);
+		}
+		dn_done(dn);
+		return -1;
+	}
+
+	/*
+	 * process the files in this directory, a buffer full at a time
+	 */
+	s_name[0] = '\0';
+	ndentries = 0;
+	eod = 0;
+	rval = 0;
+	nb = NULL;
+	split = 0;
+	/*
+	 * the order subdirs are taken in only matters when there are more of
+	 * them than threads (1 is more than ext4 can count, or btrfs, which
+	 * doesn't), and near the top, where the subtrees are big enough to
+	 * make a difference to how long the run takes
+	 */
+	weigh = fs->weigh && ((statbuf.st_nlink < 2) ||
+		(statbuf.st_nlink > (nlink_t)nthreads + 2));
+	for (x = 0, d = dn->parent; weigh && d; d = d->parent) {
+		weigh = (++x < WEIGH_DEPTH);
+	}
+	while ((!JOB_STOPPING(job)) && (!rval)) { /* stop loop if shutdown */
+		TR_START(t);
+		nents = dr_fill(dr, myfd, !fs->dtype);
+		TR_STOP(rd_ns, t);
+
+		if (nents < 0) {
+			rval = errno;
+			strerror_r(rval, m_err_str, 128);
+			FERR("getdents64 on '%s' failed errno %d - %s", dn_path(dn),
+				rval, m_err_str);
+			job_err(job, rval);
+			break;
+		}
+		if (nents == 0) { /* normal EOD state */
+			eod = 1;
+			break;
+		}
+		if (fs->ino_sort) {
+			dr_sort(dr);
+		}
+		if (weigh) {
+			TR_START(t);
+			dr_weigh(dr, myfd);
+			TR_STOP(stat_ns, t);
+		}
+
+		for (x = 0; (x < nents) && (!JOB_STOPPING(job)) && (!rval); x++) {
+			dentry = dr->ents[x];
+			ndentries = ndentries + 1;
+
+			/* see if another job needs a hand, see sched_help */
+			if (ATOMIC_READ(sched_multi) && (!my_tpool->helping) &&
+				(++my_tpool->help_tick >= SCHED_HELP_TICK)) {
+
+				my_tpool->help_tick = 0;
+				if (sb && sb->n) {
+					rval = chown_batch(job, myfd, sb, creds, &ad, &reg_procd,
+						&lnk_procd);
+					if (rval) {
+						break;
+					}
+				}
+				sched_help(job);
+				if (stats_live) {
+					stats_set_path(dn_path(dn));
+				}
+			}
+
+			/*
+			 * when the file system didn't say what it is, or can't be
+			 * believed, it takes a stat to find out
+			 */
+			d_type = dentry->d_type;
+			stated = 0;
+			if ((d_type == DT_UNKNOWN) || (!fs->dtype)) {
+				TS_ADD(syscalls, 1);
+				TR_START(t);
+				rval = fs_stat(myfd, dentry->d_name, &statbuf, fs);
+				TR_STOP(stat_ns, t);
+				if (rval) {
+					rval = chown_tally(job, -1, dentry->d_name, d_type,
+						&reg_procd, &lnk_procd);
+					continue;
+				}
+				d_type = (unsigned char)IFTODT(statbuf.st_mode);
+				stated = 1;
+			}
+
+			/* --exclude and the like, see prune.c */
+			if (prune_on && prune_entry(dn, dentry->d_name, d_type,
+				stated ? &statbuf : NULL)) {
+
+				TS_ADD(pruned, 1);
+				ndentries--;
+				continue;
+			}
+
+			if (is_reg(d_type) || is_lnk(d_type)) {
+				if (is_reg(d_type)) {
+					TS_ADD(files_scanned, 1);
+				} else {
+					TS_ADD(links_scanned, 1);
+				}
+				/* another link to something that's been done already */
+				if (link_find(job, dn->dev, dentry->d_ino)) {
+					TS_ADD(hardlinks_skipped, 1);
+					MBUG("'%s' is a link to an inode already done",
+						dentry->d_name);
+					continue;
+				}
+				if (stated) {
+					rval = chown_stated(job, myfd, dentry->d_name, &statbuf,
+						creds);
+					adapt_note(&ad, (rval == -3) || (rval == -4));
+					rval = chown_tally(job, rval, dentry->d_name, d_type,
+						&reg_procd, &lnk_procd);
+					continue;
+				}
+				/* too big for one thread, hand the rest out in batches */
+				if ((!split) && split_ents && (ndentries > (int)split_ents)) {
+					MBUG(" mdpf - splitting '%s'", dn_path(dn));
+					dn->blind = (unsigned char)ad.blind;
+					split = 1;
+				}
+				if (split) {
+					full = nb_add(&nb, dentry->d_name, d_type);
+					if ((full > 0) &&
+						(!nb_publish(dn, &nb, creds, my_dirjob->job_id))) {
+
+						rval = nb_chown(job, dn, nb, creds, &reg_procd,
+							&lnk_procd);
+					}
+					if (full >= 0) {
+						continue;      /* else no memory, do it here */
+					}
+				}
+				if (adapt_blind(&ad)) {
+					MBUG("blind chowning '%s'", dentry->d_name);
+					rval = chown_blind(myfd, dentry->d_name, creds);
+					rval = chown_tally(job, rval, dentry->d_name, d_type,
+						&reg_procd, &lnk_procd);
+					continue;
+				}
+				if (sb) {
+					/* stash it, and stat the whole batch at once when full */
+					if (sb_add(sb, dentry->d_name, d_type, fs)) {
+						rval = chown_batch(job, myfd, sb, creds, &ad, &reg_procd,
+							&lnk_procd);
+					}
+					continue;
+				}
+				if (is_reg(d_type)) {
+					MBUG("chowning reg file '%s'", dentry->d_name);
+				} else {
+					MBUG("chowning lnk file '%s'", dentry->d_name);
+				}
+				rval = chown_reg(job, myfd, dentry->d_name, &statbuf, creds,
+					fs);
+				if (rval != -1) {
+					adapt_note(&ad, (rval == -3) || (rval == -4));
+				}
+				rval = chown_tally(job, rval, dentry->d_name, d_type,
+					&reg_procd, &lnk_procd);
+			} else if (is_dir(d_type)) {
+				/*
+				 * process the first directory outside the loop ... unless
+				 * it's the biggest of several, which should go to a thief
+				 */
+				if ((ndentries == 1) && (!(weigh && (nents > 1)))) {
+					MBUG("mdpf - delay processing of %s/%s", dn_path(dn),
+						dentry->d_name);
+					strcpy(s_name, dentry->d_name);
+					continue;
+				}
+
+				if (ATOMIC_READ(ck_stopping)) {
+					ck_record(dn, dentry->d_name);
+					continue;
+				}
+
+				/* process a directory in the normal loop path */
+				MBUG("calling in-loop enqueue with path '%s' dentry '%s'",
+					dn_path(dn), dentry->d_name);
+				dn->blind = (unsigned char)ad.blind;  /* subdirs start here */
+				if (!enqueue(dn, &dentry->d_name[0], NULL, creds,
+					my_dirjob->job_id)) {
+
+					/*
+					 * this block is the in-loop single-thread path
+					 */
+
+					/* if in shutdown, avoid calling mdpf again */
+					if (JOB_STOPPING(job)) {
+						MBUG(" enqueue returned nak - in shutdown state");
+						break;
+					}
+
+					/* enqueue doesn't say no to one this deep, see there */
+					if (my_tpool->dr_depth > MDPF_DEPTH_MAX) {
+						FERR("[%02d] No memory to queue '%s/%s'",
+							my_tpool->thread_num, dn_path(dn), dentry->d_name);
+						job_err(job, ENOMEM);
+						continue;
+					}
+
+					MBUG(" enqueue nak, dropping to single thread");
+					/* the batch is per-thread, so empty it before recursing */
+					if (sb && sb->n) {
+						rval = chown_batch(job, myfd, sb, creds, &ad, &reg_procd,
+							&lnk_procd);
+						if (rval) {
+							break;
+						}
+					}
+					MK_DIRJOB(s_dir_job, my_dirjob, dn, dentry->d_name);
+					rval = mdpf(&s_dir_job);
+					TZERO_DJ(&s_dir_job);
+					if (stats_live) {
+						stats_set_path(dn_path(dn));
+					}
+				} else {
+					dirs_queued++;
+				}
+			}
+		}
+	}
+
+	/* the last of a split directory's files */
+	if (nb) {
+		if (nb->n && (!rval) && (!JOB_STOPPING(job)) &&
+			(!nb_publish(dn, &nb, creds, my_dirjob->job_id))) {
+
+			rval = nb_chown(job, dn, nb, creds, &reg_procd, &lnk_procd);
+		}
+		if (nb) {               /* it's somebody else's if it was published */
+			nb_put(nb);
+		}
+	}
+
+	/* whatever is left in the batch */
+	if (sb && sb->n) {
+		if (!rval && !JOB_STOPPING(job)) {
+			rval = chown_batch(job, myfd, sb, creds, &ad, &reg_procd,
+				&lnk_procd);
+		}
+		sb->n = 0;
+	}
+
+	dr_put();
+
+	if (JOB_STOPPING(job)) {
+		MBUG(" mdpf - shutdown_time %d, job failed %d", shutdown_time,
+			job->failed);
+	}
+
+	TZERO_DJ(&s_dir_job);
+	dn->blind = (unsigned char)ad.blind;
+	if (eod && (!JOB_STOPPING(job)) && (!rval)) {
+
+		if ((s_name[0] != '\0') && ATOMIC_READ(ck_stopping)) {
+			ck_record(dn, s_name);
+			goto mdpf_exit;
+		}
+		if (s_name[0] != '\0') {
+			if (ndentries > 1) {
+				/* process the first directory in the out-of-loop path */
+				if (enqueue(dn, s_name, NULL, creds, my_dirjob->job_id)) {
+					dirs_queued++;
+					goto mdpf_exit; /* if last dir is queued, then done */
+				} else {
+					MBUG(" mdpf - enqueue nak, dropping to single thread");
+				}
+			} else { /* ndentries == 1 */
+				/* recurse into the 1-and-only directory */
+				MBUG("delayed single entry directory '%s', recursing into '%s'",
+					dn_path(dn), s_name);
+			}
+
+			/*
+			 * here we recurse into the last/only directory, either because
+			 * it's the only processable file in the directory, or because
+			 * enqueue above failed.  that's done after letting go of our
+			 * own hold on the fd, so a long skinny chain of directories
+			 * doesn't pile up open fds.
+			 */
+			MK_DIRJOB(s_dir_job, my_dirjob, dn, s_name);
+		}
+	}
+
+mdpf_exit:
+
+	MBUG("%s: files processed: %d, links processed: %d, dirs processed: %d, dirs queued: %d",
+		dn_path(dn), reg_procd, lnk_procd, dir_procd, dirs_queued);
+
+	__sync_add_and_fetch(&job->files_chowned, reg_procd + lnk_procd, NULL);
+	__sync_add_and_fetch(&job->dirs_chowned, dir_procd, NULL);
+	TS_ADD(files_changed, (uint64_t)reg_procd);
+	TS_ADD(links_changed, (uint64_t)lnk_procd);
+	TS_ADD(dirs_changed, (uint64_t)dir_procd);
+	if (trace_on) {
+		trace_end(&span, dn, ndentries, reg_procd + lnk_procd + dir_procd);
+	}
+	if (++my_tpool->st->pub_tick >= STATS_PUB_EVERY) {
+		my_tpool->st->pub_tick = 0;
+		stats_publish();
+	}
+
+	dn_fd_put(dn);
+	dn_put(dn);                 /* s_dir_job has its own hold on it */
+	if (s_dir_job.name) {
+		/*
+		 * rather than recursing, which a chain of directories thousands
+		 * deep would run off the end of the stack with, go round again.
+		 * it's a copy, since s_dir_job gets reused
+		 */
+		MBUG("going round again with name '%s'", s_dir_job.name);
+		t_dir_job = s_dir_job;
+		my_dirjob = &t_dir_job;
+		goto mdpf_top;
+	}
+
+	MBUG("mdpf returning rval=%d", rval);
+	return rval;
+}
+
+/*
+ * the setup mchown and mchownd have in common: size the thread pool, raise
+ * the rlimits, and start the threads.  cred_slots is how many different
+ * uid/gid pairs can be in use at once, 0 for one per thread.
+ * returns 0, or -1 after saying why
+ */
+ int
+mchown_init(int user_thr_cnt, int cred_slots)
+{
+	int ncores;
+	int i;
+	struct rlimit limits;
+
+	/*
+	 * count the online logical cores of the CPU(s), or just the physical
+	 * cores with --cores-only
+	 */
+	ncores = topo_init();
+
+	/*
+	 * nthreads is what the file system's profile says, which is roughly 90%
+	 * of the available logical cores, except on the network file systems.
+	 * mchownd doesn't know what it's going to get, so it's generic
+	 */
+	nthreads = ncores * fs_root->thr_pct / 100;
+	if (nthreads < 1) {
+		nthreads = 1;    /* a single core box still gets a worker */
+	}
+	DBUG("calculated nthreads of %d from %d cores, %s profile", nthreads,
+		ncores, fs_root->name);
+
+	/*
+	 * -n is the word, even if it's more than there are cores.  on NFS,
+	 * where every chown waits on the network, that's usually better
+	 */
+	if (user_thr_cnt > 0) {
+		nthreads = user_thr_cnt;
+	}
+
+	/*
+	 * with --auto-threads, that's just where the controller starts.  the
+	 * pool gets the most it can ever use, see conc.c
+	 */
+	thr_active = nthreads;
+	if (thr_max) {
+		if (thr_active < thr_min) {
+			thr_active = thr_min;
+		} else if (thr_active > thr_max) {
+			thr_active = thr_max;
+		}
+		nthreads = thr_max;
+	}
+	DBUG("nthreads set at %d, %d active", nthreads, thr_active);
+
+	/*
+	 * the dir_jobs high-water mark.  anything less than a dir_job for
+	 * every thread, and some would have to sit idle
+	 */
+	if (dj_max == 0) {
+		dj_max = DJ_MAX_DEF;
+	}
+	if (dj_max < (unsigned int)nthreads + 1) {
+		dj_max = (unsigned int)nthreads + 1;
+	}
+	DBUG("dj_max set at %u", dj_max);
+
+	/*
+	 * look at some rlimits and set them if necessary
+	 */
+	/* open file descriptors */
+	if (getrlimit(RLIMIT_NOFILE, &limits) == -1) {
+		FERR("getrlimit(OPEN_FILES) returned -1, errno = %d", errno);
+	}
+	DBUG("invoked open file descriptors: %lu", limits.rlim_max);
+	if ((int)limits.rlim_max < (nthreads * 100)) {
+		limits.rlim_max = (unsigned long)(nthreads * 100);
+		setrlimit(RLIMIT_NOFILE, &limits);
+		DBUG("open file descriptors set: %lu", limits.rlim_max);
+	}
+	/* and use all of it */
+	if (limits.rlim_cur < limits.rlim_max) {
+		limits.rlim_cur = limits.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limits);
+		getrlimit(RLIMIT_NOFILE, &limits);
+	}
+	/*
+	 * every queued dir keeps its parent's fd open until it gets opened
+	 * itself.  leave a quarter of the fds for in-loop recursion, which
+	 * keeps one open per level, and everything else.
+	 */
+	if (limits.rlim_cur > UINT_MAX) {
+		limits.rlim_cur = UINT_MAX;
+	}
+	fd_budget = (unsigned int)(limits.rlim_cur - limits.rlim_cur / 4);
+	DBUG("soft open file descriptors: %lu, dir fd budget %u",
+		limits.rlim_cur, fd_budget);
+
+	/* max stack size */
+	if (getrlimit(RLIMIT_STACK, &limits) == -1) {
+		FERR("getrlimit(STACKSIZE) returned -1, errno = %d", errno);
+	}
+	DBUG("invoked max stack size: %ld", (long int)limits.rlim_max);
+	DBUG("invoked soft stack size: %ld", (long int)limits.rlim_cur);
+	/* 8MB per thread, as an rlim_t, since THREADS_MAX of them is > 2GB */
+	if (limits.rlim_max < (rlim_t)nthreads * 8 * 1024 * 1024) {
+		limits.rlim_max = (rlim_t)nthreads * 8 * 1024 * 1024;
+		setrlimit(RLIMIT_STACK, &limits);
+		DBUG("max stack size set: %lu", limits.rlim_max);
+	}
+
+
+	/* fall back to plain syscalls if this kernel can't do io_uring statx */
+	if (use_uring && (!mring_probe())) {
+		WARN("io_uring statx not available, using plain syscalls");
+		use_uring = 0;
+	}
+	DBUG("use_uring is %d", use_uring);
+
+	/* initialize idle mutex and condition variable */
+	pthread_mutex_init(&idle_lock, NULL);
+	DBUG("idle_lock initialized");
+	pthread_mutex_init(&jobs_lock, NULL);
+	pthread_cond_init(&jobs_cv, NULL);
+	pthread_mutex_init(&cred_lock, NULL);
+
+	/*
+	 * allocate cred_table array
+	 */
+	ncreds = (cred_slots > 0) ? cred_slots : nthreads + 1;
+	cred_tbl = calloc((size_t)ncreds, sizeof(struct creds));
+	if (cred_tbl == NULL) {
+		FERR("Failed to allocate memory for cred_tbl, errno = %d", errno);
+		return -1;
+	}
+	DBUG("cred_tbl array allocated size %d bytes",
+		(int)sizeof(struct creds) * ncreds);
+
+	/*
+	 * seed the cred_tbl with -1 because that's how we know that slot is unused
+	 */
+	for (i = 0; i < ncreds; i++) {
+		cred_tbl[i].u = (uid_t)-1;
+		cred_tbl[i].g = (gid_t)-1;
+	}
+
+	/* every thread's counters, including the main thread's */
+	if (stats_init(nthreads + 1)) {
+		return -1;
+	}
+	if (trace_path) {
+		trace_init();
+	}
+
 	/*
-	 * since we're not aquiring the lock covering threads, assume
-	 * that a race condition could cause new threads to show up after
-	 * not finding any the first time through.  multiple iterations
-	 * should cover it, but testing will show the validity of that.
+	 * create the pool of threads
+	 * the threads struct is created with one slot more than nthreads
+	 * in order to store thread_num in slot 0 for the main thread
 	 *
-	 * we don't care about false positives due to race conditions since
-	 * we will be iterating again in a moment.
+	 * create_pool rarely fails, but issues it's own error msg when it does
 	 */
-	while (iter < 2) {
-		x = size_of_qlist();
-		if ((x > 0) && (!shutdown_time)) {
-			//pthread_mutex_lock(&queue_lock);
-			pthread_cond_broadcast(&queue_cv);
-			//pthread_mutex_unlock(&queue_lock);
-		}
-		/* a lot can happen after signalling a cv */
-		if (shutdown_time) {
-			join_pool();
-			return 0;
-		}
-		MBUG(" _pool_wait: queue size = %d", x);
-		/* sleep for slightly longer each iteration */
-		while (usleep(sleep_dur + (useconds_t)(iter * 20000)) == -1) {
-			if (errno == EINTR) {
-				/* just continue if sleep interrupted */
-				WARN("thread_pool_wait: usleep interrupted");
-				continue;
-			} else {
-				FERR("thread_pool_wait: usleep failed with errno %d",
-					errno);
-				return -1;
-			}
-		}
-		for (x = 1; x <= nthreads; x++) {
-			/* check for threads with the did */
-			if (threads[x].job_id == did) {
-				MBUG("found thread %02d with job_id %lu", x, did);
-				iter = iter - 1;
-				break;
-			}
-		}
-		if (x > nthreads) {
-			MBUG("no threads found with job_id %lu", did);
-		}
+	if (create_pool(nthreads)) {
+		return -1;
+	}
+	DBUG("thread pool successfully created");
+	my_tpool = &threads[0];
 
-		/* 3 times through with none found: assume no more are coming */
-		iter = iter + 1;
+	if (conc_start()) {
+		return -1;
 	}
 
 	return 0;
 }
 
 
+#if !defined(DAEMON_MODE)
  void
 usage(char *prog_name)
 {
@@ -736,50 +1916,149 @@ usage(char *prog_name)
 	} else {
 		basename = prog_name;
 	}
-	fmt = "\nusage:\n%s [-h] [-n N]" 
+	fmt = "\nusage:\n%s [-h] [-u] [-n N] [--auto-threads MIN:MAX] [-b KB] [-q N]"
+		" [--split-dirs N] [--always-stat|--never-stat] [--pin none|core|node]"
+		" [--cores-only] [--fs-profile PROFILE] [--link-mem MB] [--checkpoint FILE"
+		" [--checkpoint-secs N] [--resume]] [--time-budget SECS] [--watch]"
+		" [--from USER:GROUP] [--one-file-system] [--skip-read-only]"
+		" [--exclude PATTERN] [--exclude-from FILE] [--stats FILE]"
+		" [--json FILE] [--trace FILE [--trace-sample N]]"
 #ifdef MDEBUG
 		" [-d]" 
 #endif
-		" <path> <user> <group>\n";
+		" {<path> <user> <group> | --map FILE <path>}\n";
 	printf(fmt, basename);
 	printf("\twhere path is the FQ path of the heirarchy to process, and\n");
 	printf("\tuser/group is either the user/group name or the numeric\n");
 	printf("user/group id to set as the new owner/group of the files\n");
 	printf("\tin the specified path\n");
 	printf("\t-h\thelp message\n");
+	printf("\t-u\tbatch the stat calls through io_uring, if the kernel\n");
+	printf("\t\tsupports it.  mostly a win on NFS and other high latency\n");
+	printf("\t\tfile systems\n");
 #ifdef MDEBUG
 	printf("\t-d\ttoggle debugging output\n");
 #endif
-	printf("\t-n N\tuse a thread pool with N threads, which must be less\n");
-	printf("\t\tthan the calculated number of threads or it will be ignored\n");
+	printf("\t-n N\tuse a thread pool with N threads, instead of what the\n");
+	printf("\t\tfile system's profile says, which is 90%% of the cores\n");
+	printf("\t\texcept on NFS and SMB.  more than there are cores is fine\n");
+	printf("\t--auto-threads MIN:MAX\tkeep adjusting the number of working\n");
+	printf("\t\tthreads between MIN and MAX, by how fast it's going\n");
+	printf("\t-b KB\tsize in KB of each thread's directory read buffer,\n");
+	printf("\t\t%d to %d, default %d\n", DIRBUF_MIN_KB, DIRBUF_MAX_KB,
+		DIRBUF_DEF_SZ / 1024);
+	printf("\t-q N\tmost directories queued up for the threads at once,\n");
+	printf("\t\tdefault %d.  past that, threads recurse instead\n",
+		DJ_MAX_DEF);
+	printf("\t--split-dirs N\tonce a directory has more than N entries,\n");
+	printf("\t\thand the rest of its files to the other threads in\n");
+	printf("\t\tbatches, default %d, 0 for never\n", SPLIT_DEF);
+	printf("\t--always-stat\tstat every file before chowning it\n");
+	printf("\t--never-stat\tchown every file without stat'ing it first\n");
+	printf("\t\tthe default is to switch between the two in each directory\n");
+	printf("\t\tdepending on how many files already have the right owner\n");
+	printf("\t--pin MODE\tpin each thread to a cpu of its own (core), or to\n");
+	printf("\t\tthe cpus of one NUMA node (node).  pinned threads steal\n");
+	printf("\t\twork on their own node first.  the default is none\n");
+	printf("\t--cores-only\tone thread per physical core, instead of one per\n");
+	printf("\t\thyperthread\n");
+	printf("\t--fs-profile NAME[,dtype=0|1][,dontsync=0|1][,inosort=0|1]\n");
+	printf("\t\t[,weigh=0|1][,threads=PCT]\n");
+	printf("\t\tuse the NAME profile instead of the one for each file\n");
+	printf("\t\tsystem, or with auto, change the settings of all of them.\n");
+	printf("\t\tthe profiles are generic, tmpfs, ext4, xfs, btrfs, nfs,\n");
+	printf("\t\tsmb, cifs and fuse\n");
+	printf("\t--link-mem MB\tmemory for remembering files with more than one\n");
+	printf("\t\tlink, so each is only done once, default %d, 0 for none\n",
+		LINK_MEM_DEF);
+	printf("\t--checkpoint FILE\tkeep what's left to do in FILE, every\n");
+	printf("\t\t--checkpoint-secs, default %d, and when stopped by\n",
+		CK_SECS_DEF);
+	printf("\t\tSIGINT, SIGTERM or --time-budget.  exits with 3 then\n");
+	printf("\t--resume\tcarry on from the --checkpoint FILE, with the\n");
+	printf("\t\tsame path, user and group\n");
+	printf("\t--time-budget SECS\tstop after SECS seconds\n");
+	printf("\t--watch\tonce the tree's done, keep chowning what gets created\n");
+	printf("\t\tin it, until SIGINT or SIGTERM.  uses fanotify if it can,\n");
+	printf("\t\tinotify if not\n");
+	printf("\t--map FILE\tinstead of one user and group, change each\n");
+	printf("\t\tfile's ids to the new ones for them in FILE, which has\n");
+	printf("\t\tlines of 'user OLD NEW' and 'group OLD NEW'.  ids that\n");
+	printf("\t\taren't in FILE are left alone\n");
+	printf("\t--from USER:GROUP\tonly change files owned by USER and\n");
+	printf("\t\tGROUP, either of which can be left out\n");
+	printf("\t--one-file-system\tdon't go into directories on other\n");
+	printf("\t\tfile systems\n");
+	printf("\t--skip-read-only\tdon't go into directories on read-only\n");
+	printf("\t\tmounts\n");
+	printf("\t--exclude PATTERN\tleave out files and directories whose\n");
+	printf("\t\tname matches the glob PATTERN, or with a '/' in it,\n");
+	printf("\t\tdirectories whose path does.  can be given more than once\n");
+	printf("\t--exclude-from FILE\tan --exclude for each line of FILE\n");
+	printf("\t--stats FILE\tkeep live per-thread counters in FILE, which is\n");
+	printf("\t\tmmap'd, see struct stats_hdr in mchown.h\n");
+	printf("\t--json FILE\twrite a JSON summary to FILE at the end, - for\n");
+	printf("\t\tstdout\n");
+	printf("\t--trace FILE\twrite what each thread did when to FILE at\n");
+	printf("\t\tthe end, as Chrome trace JSON for chrome://tracing or\n");
+	printf("\t\tPerfetto.  the last 8192 spans of each thread are kept\n");
+	printf("\t--trace-sample N\tonly time one directory in N, default 1\n");
 }
 
-
  void
 main(int argc, char **argv)
 {
-	int ncores;
 	uid_t uid;
 	gid_t gid;
-	uint64_t dirid;
 	int i;
-	char optret;
+	int optret;
 	int m;                 /* return value saver */
 	int argcnt;
 	int user_thr_cnt;
-	struct rlimit limits;
+	int state;
 	extern char *optarg;
 	extern int optind, opterr, optopt;
-	char user_name[64];
-	char group_name[64];
-	struct passwd *pw_entry;
-	struct group *gr_entry;
+	char *path;
+	struct job_info *job;
+	struct dir_job inv_job;      /* the invocation dir, done by main thread */
+	int watched;                 /* job is the watching's, see watch_run */
+	uint64_t first_pass;         /* files done before the watching */
+	static struct option long_opts[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"threads", required_argument, NULL, 'n'},
+		{"buffer-kb", required_argument, NULL, 'b'},
+		{"uring", no_argument, NULL, 'u'},
+		{"always-stat", no_argument, NULL, OPT_ALWAYS_STAT},
+		{"never-stat", no_argument, NULL, OPT_NEVER_STAT},
+		{"max-queued", required_argument, NULL, 'q'},
+		{"split-dirs", required_argument, NULL, OPT_SPLIT_DIRS},
+		{"stats", required_argument, NULL, OPT_STATS},
+		{"json", required_argument, NULL, OPT_JSON},
+		{"pin", required_argument, NULL, OPT_PIN},
+		{"cores-only", no_argument, NULL, OPT_CORES_ONLY},
+		{"auto-threads", required_argument, NULL, OPT_AUTO_THREADS},
+		{"fs-profile", required_argument, NULL, OPT_FS_PROFILE},
+		{"link-mem", required_argument, NULL, OPT_LINK_MEM},
+		{"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+		{"checkpoint-secs", required_argument, NULL, OPT_CHECKPOINT_SECS},
+		{"time-budget", required_argument, NULL, OPT_TIME_BUDGET},
+		{"resume", no_argument, NULL, OPT_RESUME},
+		{"watch", no_argument, NULL, OPT_WATCH},
+		{"map", required_argument, NULL, OPT_MAP},
+		{"from", required_argument, NULL, OPT_FROM},
+		{"one-file-system", no_argument, NULL, OPT_ONE_FS},
+		{"skip-read-only", no_argument, NULL, OPT_SKIP_RO},
+		{"exclude", required_argument, NULL, OPT_EXCLUDE},
+		{"exclude-from", required_argument, NULL, OPT_EXCLUDE_FROM},
+		{"trace", required_argument, NULL, OPT_TRACE},
+		{"trace-sample", required_argument, NULL, OPT_TRACE_SAMPLE},
+		{NULL, 0, NULL, 0}
+	};
 
 	user_thr_cnt = 0;
 
-#define OPTSTR "hdn:"
-	argcnt = argc - 1;
-	optret = getopt(argc, argv, OPTSTR);
+#define OPTSTR "hdun:b:q:"
+	optret = getopt_long(argc, argv, OPTSTR, long_opts, NULL);
 	while ((optret != -1) && (optret != '?')) {
 		switch (optret) {
 			case ':':
@@ -791,7 +2070,6 @@ main(int argc, char **argv)
 			case 'd':     /* turn on debug messages */
 #ifdef MDEBUG
 				debug ^= debug;
-				argcnt--;
 #else
 				usage(argv[0]);
 				printf("\n-d option not available - not compiled with debug\n");
@@ -800,7 +2078,7 @@ main(int argc, char **argv)
 				break;
 			case 'n':
 				i = sscanf(optarg, "%d", &m);
-				if (i != 1) {
+				if ((i != 1) || (m > THREADS_MAX)) {
 					usage(argv[0]);
 					printf("\nCould not process '%s' as a thread count\n",
 						optarg);
@@ -809,317 +2087,564 @@ main(int argc, char **argv)
 				if (m > 0) {
 					user_thr_cnt = m;
 				}
-				argcnt = argcnt - 2;
+				break;
+			case OPT_AUTO_THREADS:
+				if (parse_auto_threads(optarg)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as MIN:MAX threads, "
+						"1 to %d\n", optarg, THREADS_MAX);
+					exit(1);
+				}
+				break;
+			case 'b':     /* directory read buffer size */
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < DIRBUF_MIN_KB) || (m > DIRBUF_MAX_KB)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a buffer size\n",
+						optarg);
+					exit(1);
+				}
+				dirbuf_sz = (size_t)m * 1024;
+				break;
+			case 'q':     /* dir_jobs high-water mark */
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 1) || (m > DJ_MAX_MAX)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a queue limit\n",
+						optarg);
+					exit(1);
+				}
+				dj_max = (unsigned int)m;
+				break;
+			case 'u':     /* use io_uring if we can */
+				use_uring = 1;
+				break;
+			case OPT_ALWAYS_STAT:
+				stat_mode = STAT_ALWAYS;
+				break;
+			case OPT_NEVER_STAT:
+				stat_mode = STAT_NEVER;
+				break;
+			case OPT_PIN:
+				pin_mode = parse_pin(optarg);
+				if (pin_mode < 0) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as none, core or node\n",
+						optarg);
+					exit(1);
+				}
+				break;
+			case OPT_CORES_ONLY:
+				cores_only = 1;
+				break;
+			case OPT_FS_PROFILE:
+				if (parse_fs_profile(optarg)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a file system "
+						"profile\n", optarg);
+					exit(1);
+				}
+				break;
+			case OPT_LINK_MEM:
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 0) || (m > LINK_MEM_MAX)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as MB for the hard "
+						"link sets\n", optarg);
+					exit(1);
+				}
+				link_mem = (unsigned int)m;
+				break;
+			case OPT_CHECKPOINT:
+				ck_file = optarg;
+				break;
+			case OPT_CHECKPOINT_SECS:
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 1)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as seconds between "
+						"checkpoints\n", optarg);
+					exit(1);
+				}
+				ck_secs = (unsigned int)m;
+				break;
+			case OPT_TIME_BUDGET:
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 1)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a time budget\n",
+						optarg);
+					exit(1);
+				}
+				time_budget = (unsigned int)m;
+				break;
+			case OPT_RESUME:
+				ck_resume = 1;
+				break;
+			case OPT_WATCH:
+				watching = 1;
+				break;
+			case OPT_MAP:
+				if (idmap_load(optarg)) {
+					exit(1);
+				}
+				break;
+			case OPT_FROM:
+				if (idmap_from(optarg)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as USER:GROUP\n",
+						optarg);
+					exit(1);
+				}
+				break;
+			case OPT_ONE_FS:
+				prune_xdev = 1;
+				prune_on = 1;
+				break;
+			case OPT_SKIP_RO:
+				prune_ro = 1;
+				prune_on = 1;
+				break;
+			case OPT_EXCLUDE:
+				if (prune_add(optarg)) {
+					exit(1);
+				}
+				break;
+			case OPT_EXCLUDE_FROM:
+				if (prune_add_file(optarg)) {
+					exit(1);
+				}
+				break;
+			case OPT_STATS:
+				stats_path = optarg;
+				break;
+			case OPT_JSON:
+				json_path = optarg;
+				break;
+			case OPT_TRACE:
+				trace_path = optarg;
+				break;
+			case OPT_SPLIT_DIRS:
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 0)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a number of entries\n",
+						optarg);
+					exit(1);
+				}
+				split_ents = (unsigned int)m;
+				break;
+			case OPT_TRACE_SAMPLE:
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 1)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a sample rate\n",
+						optarg);
+					exit(1);
+				}
+				trace_sample = (unsigned int)m;
 				break;
 		}
-		optret = getopt(argc, argv, OPTSTR);
+		optret = getopt_long(argc, argv, OPTSTR, long_opts, NULL);
 	}
 	if (optret == '?') {
 		usage(argv[0]);
 		exit(1);
 	}
-
-	/*
-	 * count the online logical cores of the CPU(s)
-	 */
-	ncores = get_core_count();
-
-	/*
-	 * nthreads is roughly 90% of the available logical cores
-	 */
-	nthreads = (int)((float)ncores * .9);
-	DBUG("calculated nthreads of %d from %d cores", nthreads, ncores);
-
-	/* this could be cleaner, or clearer */
-	if (user_thr_cnt > 0) {
-		if (user_thr_cnt < nthreads) {
-			nthreads = user_thr_cnt;
-		} else {
-			WARN("specified thread count of %d is greater than nthreads (%d).  "
-				"ignoring...", user_thr_cnt, nthreads);
-		}
+	if (ck_resume && (ck_file == NULL)) {
+		usage(argv[0]);
+		printf("\n--resume needs the --checkpoint FILE to resume from\n");
+		exit(1);
 	}
-	DBUG("nthreads set at %d", nthreads);
-
-	/* allocate dir_jobs array */
-	dir_jobs = calloc((size_t)(nthreads + 1), sizeof(struct dir_job));
-	if (dir_jobs == NULL) {
-		FERR("Failed to allocate memory for dir_jobs, errno = %d", errno);
+	if (id_map && (stat_mode == STAT_NEVER)) {
+		usage(argv[0]);
+		printf("\n--map and --from need to see the owner, not --never-stat\n");
 		exit(1);
 	}
-	DBUG("dir_jobs array allocated @ %p size %d entries %d bytes", dir_jobs,
-		nthreads + 1, ((int)sizeof(struct dir_job) * (nthreads + 1)));
-	DBUG("sizeof struct dir_job %#lx bytes", sizeof(struct dir_job));
-	dj_freelist_init(dir_jobs);
-
-	if (argcnt != 3) {
+	argcnt = argc - optind;
+	if (argcnt != (idmap_remap() ? 1 : 3)) {
 		usage(argv[0]);
 		printf("\n%d - wrong number of arguments\n", argc);
 		exit(1);
 	}
 
-	/* this should be higher up, and, it needs to be able to use
-	 * user names as well as numeric uid, AND, it needs to check them
-	 * for validity.  although not the u/gids, I guess
-	 */
-
 	/* set the directory head from the invocation argument */
-	dir_jobs[0].path = argv[optind++];
-	i = sscanf(argv[optind], "%u", &uid);
-	if (i != 1) {
-		i = sscanf(argv[optind], "%62s", user_name);
-		user_name[62] = '\0';
-		if (i != 1) {
-			usage(argv[0]);
-			printf("\nCould not input '%s' as a numeric UID or user name\n",
-				argv[optind]);
-			exit(1);
-		}
-		pw_entry = getpwnam((const char *)user_name);
-		if (pw_entry == NULL) {
-			usage(argv[0]);
-			printf("\nCould not process '%s' as a user name, errno '%d'\n",
-				argv[optind], errno);
-			exit(1);
-		}
-		uid = pw_entry->pw_uid;
-	}
-	optind++;
-	i = sscanf(argv[optind], "%u", &gid);
-	if (i != 1) {
-		i = sscanf(argv[optind], "%62s", group_name);
-		group_name[62] = '\0';
-		if (i != 1) {
+	path = argv[optind++];
+	if (idmap_remap()) {
+		/* the owners come from the map, -1 leaves an id as it is */
+		uid = (uid_t)-1;
+		gid = (gid_t)-1;
+	} else {
+		if (parse_uid(argv[optind], &uid)) {
 			usage(argv[0]);
-			printf("\nCould not input '%s' as a numeric GID or group name\n",
-				argv[optind]);
+			printf("\nCould not process '%s' as a numeric UID or user "
+				"name\n", argv[optind]);
 			exit(1);
 		}
-		gr_entry = getgrnam((const char *)group_name);
-		if (gr_entry == NULL) {
+		optind++;
+		if (parse_gid(argv[optind], &gid)) {
 			usage(argv[0]);
-			printf("\nCould not process '%s' as a group name, errno '%d'\n",
-				argv[optind], errno);
+			printf("\nCould not process '%s' as a numeric GID or group "
+				"name\n", argv[optind]);
 			exit(1);
 		}
-		gid = gr_entry->gr_gid;
-	}
-	optind++;
-	DBUG("mchown invoked with path '%s' uid %d gid %d", dir_jobs[0].path, uid,
-		gid);
-
-	/*
-	 * look at some rlimits and set them if necessary
-	 */
-	/* open file descriptors */
-	if (getrlimit(RLIMIT_NOFILE, &limits) == -1) {
-		FERR("getrlimit(OPEN_FILES) returned -1, errno = %d", errno);
-	}
-	DBUG("invoked open file descriptors: %lu", limits.rlim_max);
-	if ((int)limits.rlim_max < (nthreads * 100)) {
-		limits.rlim_max = (unsigned long)(nthreads * 100);
-		setrlimit(RLIMIT_NOFILE, &limits);
-		DBUG("open file descriptors set: %lu", limits.rlim_max);
-	}
-
-	/* max stack size */
-	if (getrlimit(RLIMIT_STACK, &limits) == -1) {
-		FERR("getrlimit(STACKSIZE) returned -1, errno = %d", errno);
+		optind++;
 	}
-	DBUG("invoked max stack size: %ld", (long int)limits.rlim_max);
-	DBUG("invoked soft stack size: %ld", (long int)limits.rlim_cur);
-	if (limits.rlim_max < (unsigned long)(nthreads * (8192 * 1024))) {
-		/* 8MB per thread */
-		limits.rlim_max = (unsigned long)(nthreads * (8192 * 1024));
-		setrlimit(RLIMIT_STACK, &limits);
-		DBUG("max stack size set: %lu", limits.rlim_max);
+	if (id_map) {
+		stat_mode = STAT_ALWAYS;    /* the owner decides what to do */
 	}
+	DBUG("mchown invoked with path '%s' uid %d gid %d", path, uid, gid);
 
-
-	/* allocate queue_list array  - not currently used in this version */
-	/*
-	queue_list = calloc(nthreads, sizeof(struct queue_list));
-	if (queue_list == NULL) {
-		FERR("Failed to allocate memory for queue_list, errno = %d", errno);
+	fs_profile_root(path);    /* before the pool gets sized */
+	if (mchown_init(user_thr_cnt, 0)) {
 		exit(1);
 	}
-	DBUG("queue_list array allocated size %lu bytes",
-		(sizeof(struct queue_list) * nthreads));
-	 */
-
-	/* initialize queue mutext and condition variables */
-	pthread_mutex_init(&queue_lock, NULL);
-	pthread_cond_init(&queue_cv, NULL);
-	DBUG("queue_lock and queue_cv initialized");
+	topo_pin_self(0);    /* the main thread works on the job too */
 
 	/*
-	 * create the pool of threads
-	 * the threads struct is created with one slot more than nthreads
-	 * in order to store thread_num in slot 0 for the main thread
-	 *
-	 * create_pool rarely fails, but issues it's own error msg when it does
+	 * the one and only job, done starting with the main thread
 	 */
-	if (create_pool(nthreads)) {
+	job = job_new(path, uid, gid);
+	if (job == NULL) {
+		FERR("Failed to set up the job for '%s', errno = %d", path, errno);
+		exit(1);
+	}
+	TZERO_DJ(&inv_job);
+	inv_job.name = job->path;
+	inv_job.ucred = job->ucred;
+	inv_job.job_id = job->job_id;
+	inv_job.job = job;
+	MBUG("invocation dirjob created with job_id %lu", inv_job.job_id);
+
+	/* with --watch, the watching starts before the first pass, see watch.c */
+	if (watching && watch_init(job->path)) {
 		exit(1);
 	}
-	DBUG("thread pool successfully created");
-	my_tpool = &threads[0];
 
 	/*
-	 * allocate cred_table array
+	 * with --resume, the pool gets the frontier from the checkpoint and
+	 * the main thread just waits, unless it turns out the whole thing
+	 * needs doing.  see ckpt.c
 	 */
-	/* not really used in this phase 1 version, but will be used in daemon */
-	cred_tbl = calloc((size_t)(nthreads + 1), sizeof(struct creds));
-	if (cred_tbl == NULL) {
-		FERR("Failed to allocate memory for cred_tbl, errno = %d", errno);
+	m = 1;
+	if (ck_resume) {
+		m = ck_load(job);
+		if (m < 0) {
+			exit(1);
+		}
+	}
+	if (m) {
+		ck_working(job->path);
+	}
+	if (ck_start(job)) {
 		exit(1);
 	}
-	MBUG("cred_tbl array allocated size %d bytes",
-		(int)sizeof(struct creds) * (nthreads + 1));
 
 	/*
-	 * seed the cred_tbl with -1 because that's how we know that slot is unused
+	 * start processing of directories with the invocation dir
 	 */
-	for (i = 0; i <= nthreads; i++) {
-		cred_tbl[i].u = (uid_t)-1;
-		cred_tbl[i].g = (gid_t)-1;
+	if (m) {
+		m = mdpf(&inv_job);
+		if (m != 0) {
+			FERR("main invo mdpf returned %d", m);
+			//exit(1);
+		}
+		ck_working(NULL);
 	}
 
 	/*
-	 * dir_jobs[0] is used for main thread with invocation path
+	 * wait for the rest of the job, if the pool threads have any of it
 	 */
-	dir_jobs[0].ucred = get_cred(uid, gid);
-	if (dir_jobs[0].ucred == NULL) {
-		exit(1);
+	state = job_wait(job);
+	watched = 0;
+	first_pass = 0;
+	if (watching && (state == JOB_DONE) && (!ATOMIC_READ(ck_stopping))) {
+		first_pass = job->files_chowned + job->dirs_chowned;
+		watched = 1;
+		job = watch_run(path, uid, gid);
+		if (job == NULL) {
+			exit(1);
+		}
+		state = job_wait(job);
 	}
-	/* create the dirid for this invocation */
-	dir_jobs[0].job_id = mk_dirid(dir_jobs[0].path, dir_jobs[0].ucred);
-	MBUG("invocation dirjob created with job_id %lu", dir_jobs[0].job_id);
-
-	/* all this to allocate the dirent structure */
-	dname_max = pathconf(dir_jobs[0].path, _PC_NAME_MAX);
-	if (dname_max == -1) {         /* not defined or error */
-		dname_max = 255;           /* guess */
+	if (state == JOB_RUNNING) {
+		/* shutting down, the threads are only finishing what they have */
+		wake_idle(1);
+		join_pool();
 	}
-	MBUG("pathconf returned %d bytes", dname_max);
-	dname_max = (int)offsetof(struct dirent, d_name) + dname_max + 1;
+	m = ck_done(state);
 
-	/*
-	 * start processing of directories with the invocation dir
-	 */
-	m = mdpf(&dir_jobs[0]);
-	if (m != 0) {
-		FERR("main invo mdpf returned %d", m);
-		//exit(1);
+	if (watched) {
+		/* the watch job is a job of its own, after the first pass's */
+		printf("files processed: %lu, %lu of them while watching\n",
+			first_pass + job->files_chowned + job->dirs_chowned,
+			job->files_chowned + job->dirs_chowned);
+	} else {
+		printf("files processed: %lu\n", job->files_chowned +
+			job->dirs_chowned);
 	}
+	stats_publish();
+	stats_json("mchown");
+	trace_dump("mchown");
+#ifdef ALLOC_COUNT
+	alloc_report();
+#endif
+	exit(m);             /* 3 if it stopped early, with more to do */
+}
+#endif /* !DAEMON_MODE */
 
-	/*
-	 * try to wait until there are no more threads working on this job_id
-	 */
-	thread_pool_wait(dir_jobs[0].job_id);
+/*
+ * queue handling functions
+ */
 
-	/*
-	 * put the cred slot for this job_id back to unused state
-	 */
-	rel_cred(dir_jobs[0].ucred);
 
-	printf("files processed: %lu\n", files_chowned + dirs_chowned);
-}
+/*
+ * fair share scheduling between jobs.
+ *
+ * the deques don't care which job a dir_job belongs to, so with more than
+ * one job running, a thread looking for work first picks the job that has
+ * the fewest threads on it for its weight, and then looks for one of that
+ * job's dir_jobs: the newest on its own deque, or the oldest on somebody
+ * else's.  together with job_share that keeps the threads split between
+ * the jobs by weight as they come free.
+ *
+ * threads don't come free very often on a big tree though, since most of
+ * the work gets done recursing inside mdpf.  so mdpf also stops every
+ * SCHED_HELP_TICK entries to see if some other job is getting less than
+ * its share, and if so, does one of its dir_jobs right there before
+ * carrying on.  that's what gets a small job going in a hurry while a huge
+ * one has every thread tied up.
+ */
 
 
 /*
- * queue handling functions
+ * the job with queued dir_jobs that has the fewest threads working on it
+ * for its weight.  if mine is given, only a job that's getting less than
+ * mine is, other than mine.  jobs_lock must be held
  */
+ struct job_info *
+sched_pick(struct job_info *mine)
+{
+	struct job_info *job;
+	struct job_info *pick;
+
+	pick = mine;
+	for (job = active_jobs; job; job = job->active_next) {
+		if ((job == mine) || (ATOMIC_READ(job->queued) == 0)) {
+			continue;
+		}
+		if ((pick == NULL) || (ATOMIC_READ(job->running) * pick->weight <
+			ATOMIC_READ(pick->running) * job->weight)) {
+
+			pick = job;
+		}
+	}
+
+	return (pick == mine) ? NULL : pick;
+}
 
 
 /*
- * remove a dir job from the queue, and return a pointer to it
- * queue_lock must be held by caller.
+ * find one of job's dir_jobs, on our own deque or somebody else's.
+ * returns 1 and fills in dj if there was one, else 0
  */
- struct dir_job *
-dequeue(void)
+ int
+sched_take(struct job_info *job, struct dir_job *dj)
 {
-	struct queue_list *top_item;
-	struct dir_job *top_dj;
-
-	top_dj = NULL;
-	top_item = ql_get_top();  /* pop the top item off the queue */
-	if (top_item) {
-		top_dj = top_item->djob;
-		MBUG(" dequeue - retrieved djob %p path '%s'", top_dj, top_dj->path);
-		ql_rel_item(top_item);
-	} else {
-		MBUG(" dequeue - queue empty");
+	int v;
+	int x;
+	unsigned int r;
+
+	if (dq_take_job(&my_tpool->dq, job, dj, 0)) {
+		__sync_sub_and_fetch(&dj_queued, 1);
+		__sync_sub_and_fetch(&job->queued, 1);
+		my_tpool->st->qdepth = my_tpool->dq.tail - my_tpool->dq.head;
+		return 1;
+	}
+	my_tpool->rseed = my_tpool->rseed * 1103515245U + 12345U;
+	r = my_tpool->rseed >> 16;
+	for (x = 0; x < nthreads; x++) {
+		v = steal_victim(x, r);
+		if (dq_take_job(&threads[v].dq, job, dj, 1)) {
+			__sync_sub_and_fetch(&dj_queued, 1);
+			__sync_sub_and_fetch(&job->queued, 1);
+			return 1;
+		}
 	}
 
-	return top_dj;
+	return 0;
+}
+
+
+/*
+ * called from mdpf every so often while more than one job is running.
+ * if another job is getting less of the pool than ours, do one of its
+ * dir_jobs now.
+ */
+ void
+sched_help(struct job_info *mine)
+{
+	struct job_info *pick;
+	struct dir_job dj;
+
+	pthread_mutex_lock(&jobs_lock);
+	pick = sched_pick(mine);
+	pthread_mutex_unlock(&jobs_lock);
+	if ((pick == NULL) || (!sched_take(pick, &dj))) {
+		return;
+	}
+	MBUG(" sched_help - job %lu helping job %lu with '%s'", mine->job_id,
+		pick->job_id, dj.name);
+	my_tpool->helping = 1;
+	run_dir_job(&dj);
+	my_tpool->helping = 0;
 }
 
 
 /*
- * add a job to the queue
- * queue_lock must NOT be held by caller
+ * get the next dir job for this thread: the newest one off our own deque,
+ * or failing that, the oldest one off somebody else's.  victims are
+ * scanned starting at a random thread so the thieves spread out.  when
+ * there's more than one job, which job comes first, see sched_pick.
+ * returns 1 and fills in dj if there was one, else 0
  */
  int
-enqueue(char *dpath, char *name, struct creds *creds, uint64_t dj_id)
+dequeue(struct dir_job *dj)
 {
-	int add_status;
-	struct dir_job *dj_ent;
-	char *npath;
+	struct job_info *pick;
+	int v;
+	int x;
+	unsigned int r;
+
+	if (ATOMIC_READ(sched_multi)) {
+		pthread_mutex_lock(&jobs_lock);
+		pick = sched_pick(NULL);
+		pthread_mutex_unlock(&jobs_lock);
+		if (pick && sched_take(pick, dj)) {
+			MBUG(" dequeue - took djob name '%s' for job %lu", dj->name,
+				pick->job_id);
+			return 1;
+		}
+	}
 
-	MBUG(" enqueue - called with '%s/%s'", dpath, name);
+	if (dq_pop(&my_tpool->dq, dj)) {
+		__sync_sub_and_fetch(&dj_queued, 1);
+		__sync_sub_and_fetch(&dj->job->queued, 1);
+		my_tpool->st->qdepth = my_tpool->dq.tail - my_tpool->dq.head;
+		MBUG(" dequeue - popped djob name '%s'", dj->name);
+		return 1;
+	}
 
-	if ((strlen(dpath) + strlen(name)) > (DJ_PATH_SZ - 2)) {
-		FERR("[%02d] Fail: size of path/name (%lu) in enqueue exceeds "
-			"DJ_PATH_SZ (%d)", my_tpool->thread_num,
-			strlen(dpath) + strlen(name), DJ_PATH_SZ);
-			return 0;
+	/* the main thread has a deque too, so there are nthreads others */
+	my_tpool->rseed = my_tpool->rseed * 1103515245U + 12345U;
+	r = my_tpool->rseed >> 16;
+	for (x = 0; x < nthreads; x++) {
+		v = steal_victim(x, r);
+		if (dq_steal(&threads[v].dq, dj)) {
+			__sync_sub_and_fetch(&dj_queued, 1);
+			__sync_sub_and_fetch(&dj->job->queued, 1);
+			MBUG(" dequeue - stole djob name '%s' from %02d", dj->name, v);
+			return 1;
+		}
 	}
+	MBUG(" dequeue - nothing to pop or steal");
+
+	return 0;
+}
+
+
+/*
+ * add a job to the calling thread's deque for subdirectory name of dn,
+ * or with name NULL, for the name batch nb of dn's files
+ */
+ int
+enqueue(struct dnode *dn, char *name, struct name_batch *nb,
+	struct creds *creds, uint64_t dj_id)
+{
+	struct dir_job dj_ent;
+	struct job_info *job;
+	char *nname;
+	uint64_t t;
+	int deep;
+
+	MBUG(" enqueue - called with '%s/%s'", dn_path(dn), name ? name : "*");
 
-	if (shutdown_time) {
+	if (JOB_STOPPING(dn->job)) {
 		MBUG(" enqueue returning nak - shutdown is set");
 		return 0;
 	}
 
-	npath = malloc(DJ_PATH_SZ);
-	if (npath == NULL) {
-		FERR("[%02d] Failed allocating memory for path in enqueue errno = %d",
-			my_tpool->thread_num, errno);
+	/*
+	 * a caller that's MDPF_DEPTH_MAX levels down can't recurse any deeper,
+	 * so its subdirectories get queued no matter what.  a queued one holds
+	 * no more than recursing into it would
+	 */
+	deep = name && (my_tpool->dr_depth > MDPF_DEPTH_MAX);
+
+	/* a queued dir holds its parent's fd open, so don't run out of them */
+	if ((!deep) && (ATOMIC_READ(dir_fds) >= fd_budget)) {
+		MBUG(" enqueue - dir fd budget of %u used up", fd_budget);
 		return 0;
 	}
-	strncpy(npath, dpath, DJ_PATH_SZ - 1);
-	npath[DJ_PATH_SZ - 1] = '\0';
-	/* if strlen(npath) >= DJ_PATH_SZ at this point, we're screwed */
-	strncat(npath, "/", 2);
-	strncat(npath, name, DJ_PATH_SZ - 1);
 
-	pthread_mutex_lock(&queue_lock);
+	/*
+	 * no more than dj_max dir_jobs may be queued or in progress at once,
+	 * past that the caller just recurses.  the deques grow as needed, so
+	 * that's only there to keep a huge bushy tree from queueing up all the
+	 * memory there is.  when there's more than one job, each only gets its
+	 * share of those, so a big one can't crowd out a small one.
+	 */
+	job = dn->job;
+	if ((__sync_add_and_fetch(&job->outstanding, 1) > job_share(job)) &&
+		(!deep)) {
 
-/*
-	if (n_avail_threads == 0) {
-		pthread_mutex_unlock(&queue_lock);
-		free(npath);
-		MBUG(" enqueue - no avail threads");
+		__sync_sub_and_fetch(&job->outstanding, 1);
+		MBUG(" enqueue - no avail dirjob slots");
 		return 0;
 	}
-	n_avail_threads--;
-	MBUG(" enqueue - n_avail_threads now is %d", n_avail_threads);
- */
-	dj_ent = dj_calloc();
-	if (dj_ent == NULL) {
-		//n_avail_threads++;
-		pthread_mutex_unlock(&queue_lock);
-		free(npath);
-		MBUG(" enqueue - no avail dirjob slots");
+
+	nname = NULL;
+	if (name) {
+		nname = slab_strdup(name);
+		if (nname == NULL) {
+			FERR("[%02d] Failed allocating memory for name in enqueue "
+				"errno = %d", my_tpool->thread_num, errno);
+			__sync_sub_and_fetch(&job->outstanding, 1);
+			return 0;
+		}
+	}
+	__sync_add_and_fetch(&dj_outstanding, 1);
+	__sync_add_and_fetch(&job->queued, 1);
+
+	dj_ent.parent = dn;
+	dj_ent.name = nname;
+	dj_ent.ucred = creds;
+	dj_ent.job_id = dj_id;
+	dj_ent.job = dn->job;
+	dj_ent.nb = nb;
+	dn_hold_child(dn);
+	MBUG(" enqueue - queing djob name '%s'", name ? name : "*");
+	TR_START(t);
+	if (dq_push(&my_tpool->dq, &dj_ent)) {
+		TR_STOP(queue_ns, t);
+		/* the caller still has its own holds, so these can't hit 0 */
+		__sync_sub_and_fetch(&dn->fd_refs, 1);
+		__sync_sub_and_fetch(&dn->refs, 1);
+		__sync_sub_and_fetch(&job->queued, 1);
+		__sync_sub_and_fetch(&job->outstanding, 1);
+		__sync_sub_and_fetch(&dj_outstanding, 1);
+		if (nname) {
+			slab_free_str(nname);
+		}
+		MBUG(" enqueue - dq_push failed");
 		return 0;
 	}
-	dj_ent->path = npath;
-	dj_ent->ucred = creds;
-	dj_ent->job_id = dj_id;
-	MBUG(" enqueue - queing djob %p path '%s'", dj_ent, dj_ent->path);
-	add_status = ql_add(dj_ent);
-	pthread_cond_broadcast(&queue_cv);
-	pthread_mutex_unlock(&queue_lock);
+	__sync_add_and_fetch(&dj_queued, 1);
+	my_tpool->st->qdepth = my_tpool->dq.tail - my_tpool->dq.head;
+	if (ATOMIC_READ(n_idle)) {
+		wake_idle(0);
+	}
+	TR_STOP(queue_ns, t);
 
 	return 1;
 }
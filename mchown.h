@@ -6,9 +6,17 @@
 # define FERR(FMT, ...) fprintf(stderr, FMT "\n", ##__VA_ARGS__)
 # define WARN(FMT, ...) fprintf(stderr, FMT "\n", ##__VA_ARGS__)
 #else
+# define ERRLOG errlog
+# define LOG_ERR 0
+# define LOG_WARN 1
+# define LOG_INFO 2
+extern FILE *errlog;
+extern int log_level;
 # define FERR(FMT, ...) fprintf(ERRLOG, FMT "\n", ##__VA_ARGS__)
 # define WARN(FMT, ...) if (log_level >= LOG_WARN) \
 							fprintf(ERRLOG, FMT "\n", ##__VA_ARGS__)
+# define INFO(FMT, ...) if (log_level >= LOG_INFO) \
+							fprintf(ERRLOG, FMT "\n", ##__VA_ARGS__)
 #endif
 
 
@@ -16,54 +24,556 @@
 extern int debug;
 # define DBUG(FMT, ...) if (debug) fprintf(stderr, FMT "\n", ##__VA_ARGS__)
 # define MBUG(FMT, ...) if (debug) \
-	fprintf(stderr, "[%02d] " FMT "\n", my_tpool->thread_num, ##__VA_ARGS__)
+	fprintf(stderr, "[%02d] " FMT "\n", my_tpool ? my_tpool->thread_num : -1, \
+		##__VA_ARGS__)
 #else
 # define MBUG(FMT, ...) {}
 # define DBUG(FMT, ...) {}
 #endif
 
 
+#define ATOMIC_READ(X) __atomic_load_n(&(X), __ATOMIC_SEQ_CST)
+
+
 /*
  * the core data structure definitions for mchown
  */
 
+/*
+ * the owner a job is chowning to, in cred_tbl, shared by the jobs that
+ * want the same one
+ */
+struct creds {
+	uid_t u;
+	gid_t g;
+	int refs;                 /* jobs using this slot */
+};
+
+/*
+ * one hierarchy to chown, and how it's going.  the CLI only ever has one of
+ * these, mchownd has one for each request it's been sent.
+ */
+#define JOB_RUNNING 0
+#define JOB_DONE 1
+#define JOB_FAILED 2
+
+struct job_info {
+	uint64_t job_id;
+	struct creds *ucred;
+	char *path;               /* the top directory */
+	int stat_mode;
+	int state;                /* JOB_*, changes under jobs_lock */
+	int failed;               /* something fatal happened, stop working on it */
+	int err;                  /* errno of the first error */
+	unsigned int errors;
+	uint64_t files_chowned;
+	uint64_t dirs_chowned;
+	struct timespec start;
+	struct timespec end;
+	unsigned int weight;      /* share of the pool relative to other jobs */
+	unsigned int cap;         /* most dir_jobs at once, 0 for no limit */
+	unsigned int outstanding; /* dir_jobs queued or being worked on */
+	unsigned int queued;      /* dir_jobs sitting on the deques */
+	unsigned int running;     /* threads doing one of its dir_jobs */
+	const char *fs_name;      /* profile of the top dir, once it's open */
+	unsigned char watch;      /* keeping the tree done, see watch.c */
+	struct id_map *map;       /* --map/--from, NULL for just ucred */
+	struct link_set *links;   /* multiply linked inodes seen, see links.c */
+	uint64_t links_tracked;   /* how the set went, once it's gone */
+	uint64_t links_dropped;
+	uint64_t links_bytes;
+	struct job_info *next;
+	struct job_info *active_next;  /* on active_jobs while running */
+};
+
+#define LINKS_NONE ((struct link_set *)1)   /* the job does without */
+#define LINK_MEM_DEF 16           /* MB, default and limit for --link-mem */
+#define LINK_MEM_MAX 16384
+
+#define JOB_STOPPING(J) (shutdown_time || (J)->failed)
+
 /*
  * this is the structure that is on the queue, and tells mdpf what
  * directory to proces, as well as a few other important bits
  */
 struct dir_job {
-	unsigned char *path;
+	struct dnode *parent;  /* the dir it's in, NULL for the top of the job */
+	char *name;            /* name in parent, or the path of the top dir */
 	struct creds *ucred;
 	uint64_t job_id;  /* used to tag all the threads working on a particular
 					   * heirarchy */
-	struct dir_job *forward;
-	struct dir_job *back;
+	struct job_info *job;
+	struct name_batch *nb; /* files in parent to do instead, name is NULL */
 };
 
-#define TZERO_DJ(D)	(D)->path =  NULL; \
+#define TZERO_DJ(D)	(D)->parent =  NULL; \
+					(D)->name =  NULL; \
 					(D)->ucred =  NULL; \
-					(D)->job_id = 0UL
+					(D)->job_id = 0UL; \
+					(D)->job = NULL; \
+					(D)->nb = NULL
+
+/*
+ * some of the files of a directory too big for one thread, handed to the
+ * pool to be chowned, see nb_publish
+ */
+#define NB_ENTS 256               /* files per batch */
+#define NB_BUF (16 * 1024)        /* for their names */
+#define NB_QUEUED_MAX 2           /* on our deque, past that do them here */
+#define SPLIT_DEF 4096            /* entries before a directory is split */
+#define WEIGH_DEPTH 4             /* levels of a job that get dr_weigh'd */
+
+#define NB_FREE_MAX 4             /* kept on a thread's free list, see nb_get */
+
+struct name_batch {
+	struct name_batch *next;  /* on a free list */
+	int n;
+	unsigned int used;        /* of buf */
+	unsigned short off[NB_ENTS];
+	unsigned char types[NB_ENTS];
+	char buf[NB_BUF];
+};
+
+/*
+ * a directory that's being worked on, or that has work going on under it.
+ * see the dnode routines in mchown.c
+ */
+struct dnode {
+	struct dnode *parent;
+	int fd;                   /* -1 once nobody needs it open */
+	unsigned int fd_refs;
+	unsigned int refs;
+	unsigned char blind;      /* chowning without stat'ing, see adapt_blind */
+	unsigned char rdonly;     /* on a read-only mount */
+	dev_t dev;                /* to spot a mount being crossed */
+	struct fs_profile *prof;  /* the profile for the file system it's on */
+	struct job_info *job;
+	char name[];
+};
+
+/*
+ * values of stat_mode, and the per directory state for STAT_ADAPT
+ */
+#define STAT_ADAPT 0
+#define STAT_ALWAYS 1
+#define STAT_NEVER 2
+
+#define OPT_ALWAYS_STAT 256    /* long options with no short equivalent */
+#define OPT_NEVER_STAT 257
+#define OPT_STATS 258
+#define OPT_JSON 259
+#define OPT_PIN 260
+#define OPT_CORES_ONLY 261
+#define OPT_AUTO_THREADS 262
+#define OPT_FS_PROFILE 263
+#define OPT_LINK_MEM 264
+#define OPT_CHECKPOINT 265
+#define OPT_CHECKPOINT_SECS 266
+#define OPT_TIME_BUDGET 267
+#define OPT_RESUME 268
+#define OPT_WATCH 269
+#define OPT_MAP 270
+#define OPT_FROM 271
+#define OPT_ONE_FS 272
+#define OPT_SKIP_RO 273
+#define OPT_EXCLUDE 274
+#define OPT_EXCLUDE_FROM 275
+#define OPT_TRACE 276
+#define OPT_TRACE_SAMPLE 277
+#define OPT_SPLIT_DIRS 278
+
+#define CK_SECS_DEF 60            /* default for --checkpoint-secs */
+
+#define THREADS_MAX 4096          /* most -n or --auto-threads can ask for */
+
+/*
+ * values of pin_mode, see topo.c
+ */
+#define PIN_NONE 0
+#define PIN_CORE 1               /* each thread on a cpu of its own */
+#define PIN_NODE 2               /* each thread on the cpus of a NUMA node */
+
+/*
+ * how to go about a directory, by the file system it's on, see fsprof.c
+ */
+struct fs_profile {
+	const char *name;
+	long f_type;              /* from statfs, 0 for the generic profile */
+	int thr_pct;              /* pool threads, percent of the cores */
+	unsigned char dtype;      /* d_type can be believed */
+	unsigned char dont_sync;  /* stat with AT_STATX_DONT_SYNC */
+	unsigned char ino_sort;   /* do entries in inode order, see dr_sort */
+	unsigned char weigh;      /* queue the biggest subdirs first, dr_weigh */
+	unsigned int mounts;      /* times it's been picked, for the summary */
+};
 
+struct adapt {
+	int mode;                 /* the job's stat_mode */
+	int blind;
+	int seen;                 /* files stat'd since the last decision */
+	int hits;                 /* how many of those were already right */
+	int count;                /* for spacing out probes while blind */
+};
+
+
+/*
+ * each thread in the pool owns one of these.  the owner pushes and pops
+ * dir_jobs at the tail (newest first, which keeps it working depth first
+ * in a subtree it already has warm), and idle threads steal from the head,
+ * which is the oldest and usually the biggest piece of work.  the lock is
+ * only ever contended between the owner and a thief.
+ */
+struct dj_deque {
+	pthread_mutex_t lock;
+	struct dir_job *ring;     /* array of size slots */
+	unsigned int size;        /* power of 2 */
+	unsigned int head;        /* next slot to steal from */
+	unsigned int tail;        /* next slot to push into */
+};
+
+/*
+ * a batch of directory entries to be stat'd all at once through io_uring.
+ * names point into nbuf because the dirent they came from gets reused.
+ */
+#define STAT_BATCH_SZ 64
+
+struct stat_batch {
+	int n;
+	int at_flags;             /* more statx flags, from the profile */
+	struct fs_profile *fs;    /* for chown_reg, if the ring goes away */
+	char *names[STAT_BATCH_SZ];
+	unsigned char types[STAT_BATCH_SZ];
+	int err[STAT_BATCH_SZ];
+	struct stat st[STAT_BATCH_SZ];
+	char nbuf[STAT_BATCH_SZ][NAME_MAX + 1];
+};
+
+struct mring;
+
+/*
+ * what getdents64 hands back.  glibc doesn't export this one.
+ */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
 
-extern struct dir_job *dj_freelist;
+/*
+ * a getdents64 buffer, and the interesting entries in it
+ */
+#define DIRBUF_DEF_SZ (128 * 1024)
+#define DIRBUF_NESTED_SZ (32 * 1024)
+#define MDPF_DEPTH_MAX 256        /* levels mdpf recurses, then it queues */
+#define DJ_MAX_DEF (1 << 16)   /* default and limit for -q */
+#define DJ_MAX_MAX (1 << 24)
+#define DIRBUF_MIN_KB 32       /* limits for -b */
+#define DIRBUF_MAX_KB 16384
+
+struct dir_reader {
+	char *buf;
+	size_t sz;
+	struct linux_dirent64 **ents;
+	int nents;
+	struct dr_weight *wt;     /* for dr_weigh, NULL until it's needed */
+};
+
+/*
+ * statistics, see stats.c.  with --stats, the file is a stats_hdr, padded
+ * out to hdr_size, followed by nthr thr_stats of thr_size bytes each, one
+ * per thread with the main thread first.  each thr_stats is only written
+ * by its own thread.  cur_path is only good if path_seq is even, and the
+ * same before and after reading it.
+ */
+#define STATS_MAGIC "MCHSTATS"
+#define STATS_VERSION 6
+#define STATS_ALIGN 64            /* a cache line */
+#define STATS_PATH_SZ 192
+#define STATS_PUB_EVERY 8         /* dirs between stats_publish calls */
+
+struct stats_hdr {
+	char magic[8];
+	uint32_t version;             /* set last, 0 until the rest is good */
+	uint32_t hdr_size;
+	uint32_t thr_size;
+	uint32_t nthr;
+	int64_t pid;
+	int64_t start_sec;
+	uint64_t heartbeat_ns;        /* CLOCK_REALTIME of the last publish */
+	uint64_t dj_queued;
+	uint64_t dj_outstanding;
+	uint64_t dir_fds;
+	uint64_t active_threads;      /* pool threads working, see conc.c */
+} __attribute__ ((aligned (STATS_ALIGN)));
+
+struct thr_stats {
+	uint64_t dirs_scanned;
+	uint64_t files_scanned;
+	uint64_t links_scanned;
+	uint64_t dirs_changed;
+	uint64_t files_changed;
+	uint64_t links_changed;
+	uint64_t syscalls;
+	uint64_t uring_ops;           /* statx done through io_uring */
+	uint64_t errors;
+	uint64_t hardlinks_skipped;   /* another link already done, see links.c */
+	uint64_t pruned;              /* left out, see prune.c */
+	uint64_t spin_wins;           /* idle, and work came while spinning */
+	uint64_t parks;               /* idle, and had to sleep for it */
+	uint64_t csw_vol;             /* context switches, as of its last park */
+	uint64_t csw_invol;
+	uint64_t batches;             /* of another thread's dir, see nb_publish */
+	uint32_t busy;                /* working on a dir_job */
+	uint32_t qdepth;              /* dir_jobs on its deque */
+	uint32_t path_seq;
+	uint32_t pub_tick;            /* dirs since the last stats_publish */
+	char cur_path[STATS_PATH_SZ];
+} __attribute__ ((aligned (STATS_ALIGN)));
+
+/*
+ * per-thread slab caches, see slab.c.  a dnode with a NAME_MAX name is the
+ * biggest thing that needs to fit.
+ */
+#define SLAB_QUANTUM 16
+#define SLAB_MAX 320
+#define SLAB_CLASSES (SLAB_MAX / SLAB_QUANTUM)
+#define SLAB_BLOCK_SZ (64 * 1024)
+#define SLAB_BATCH 64             /* objects moved to or from the depot */
+
+struct slab_cache {
+	struct slab_obj *free[SLAB_CLASSES];
+	unsigned int nfree[SLAB_CLASSES];
+	char *blk;                /* where the next object gets carved from */
+	size_t blk_left;
+	char *blocks;             /* chained through their first word */
+	uint64_t nblocks;
+};
+
+/*
+ * mchownd's connection threads and its signal thread aren't pool threads,
+ * they have no my_tpool and no stats of their own, so what they do isn't
+ * counted
+ */
+#define TS_ADD(F, N) do { \
+	if (my_tpool) { \
+		my_tpool->st->F = my_tpool->st->F + (N); \
+	} \
+} while (0)
+
+/*
+ * the directory mdpf is on, with --trace, see trace.c.  TR_START and
+ * TR_STOP add the time between them to one of the counts, if it's a
+ * directory that's being sampled
+ */
+struct trace_span {
+	uint64_t start;           /* ns, 0 if this one isn't being sampled */
+	uint64_t rd_ns;           /* in getdents64 */
+	uint64_t stat_ns;
+	uint64_t chown_ns;
+	uint64_t queue_ns;        /* pushing onto the deque and waking idlers */
+	struct trace_span *up;    /* the directory this one's inside of */
+};
+
+#define TR_START(T) ((T) = (my_tpool && my_tpool->tr_span) ? trace_now() : 0)
+#define TR_STOP(F, T) do { \
+	if (T) { \
+		my_tpool->tr_span->F = my_tpool->tr_span->F + trace_now() - (T); \
+	} \
+} while (0)
 
 struct thread_pool {
 	pthread_t pthread_id;
 	int thread_num;
 	unsigned int busy;
 	uint64_t job_id;
+	unsigned int rseed;       /* for picking a victim to steal from */
+	struct dj_deque dq;
+	struct mring *ring;       /* NULL unless use_uring */
+	struct stat_batch *sb;
+	struct dir_reader **drs;  /* one per level of in-loop recursion */
+	int ndrs;
+	int dr_depth;
+	char *pathbuf;            /* for dn_path */
+	size_t pathbuf_sz;
+	int helping;              /* in sched_help, doing another job's dir */
+	unsigned int help_tick;   /* entries since the last look at sched_help */
+	struct thr_stats *st;     /* this thread's slot in thr_stats */
+	struct slab_cache sc;
+	int cpu;                  /* where it's pinned, -1 if it isn't */
+	int node;
+	int *victims;             /* threads to steal from, own node first */
+	int nlocal;               /* how many of victims are on our node */
+	int spin;                 /* pauses before parking, see idle_wait */
+	pthread_mutex_t ck_lock;  /* ck_path and taking dir_jobs, see ckpt.c */
+	char *ck_path;            /* the dir_job it's on, with --checkpoint */
+	size_t ck_path_sz;
+	struct trace_ring *tr;    /* its spans, with --trace */
+	struct trace_span *tr_span;  /* the one being timed, or NULL */
+	unsigned int tr_tick;     /* dirs since the last one sampled */
+	struct name_batch *nb_free;  /* empty name batches, see nb_get */
+	unsigned int nb_nfree;
 };
 
-struct dir_job *dequeue(void);
+int dequeue(struct dir_job *dj);
 int create_pool(int nthreads);
 int mdpf(struct dir_job *dj);
+char *dn_path(struct dnode *dn);
+void dn_hold_child(struct dnode *dn);
+struct dnode *dn_open(struct dir_job *dj);
+void dn_set_fs(struct dnode *dn, dev_t dev);
+void dn_done(struct dnode *dn);
+void dn_fd_put(struct dnode *dn);
+void dn_put(struct dnode *dn);
+void dj_drop(struct dir_job *dj);
 void join_pool(void);
-void dj_free(struct dir_job *del_dj);
+void wake_idle(int all);
+int dq_init(struct dj_deque *dq, unsigned int size);
+int dq_push(struct dj_deque *dq, struct dir_job *dj);
+int dq_pop(struct dj_deque *dq, struct dir_job *dj);
+int dq_steal(struct dj_deque *dq, struct dir_job *dj);
+int dq_take_job(struct dj_deque *dq, struct job_info *job, struct dir_job *dj,
+	int thief);
+void run_dir_job(struct dir_job *dj);
+void nb_run(struct dir_job *dj);
+struct mring *mring_init(void);
+void mring_fini(struct mring *r);
+int mring_probe(void);
+int mring_stat_batch(struct mring *r, int dir_fd, struct stat_batch *sb);
+struct dir_reader *dr_get(void);
+void dr_put(void);
+void dr_sort(struct dir_reader *dr);
+void dr_weigh(struct dir_reader *dr, int fd);
+int dr_fill(struct dir_reader *dr, int fd, int all);
+int mchown_init(int user_thr_cnt, int cred_slots);
+int topo_init(void);
+int parse_pin(const char *str);
+void topo_place(int tid);
+int topo_attr(int tid, pthread_attr_t *attr);
+void topo_pin_self(int tid);
+int topo_victims(int npool);
+int steal_victim(int x, unsigned int r);
+int parse_fs_profile(const char *str);
+struct fs_profile *fs_profile_fd(int fd, unsigned char *rdonly);
+void fs_profile_root(const char *path);
+int fs_stat(int dir_fd, char *name, struct stat *st, struct fs_profile *fp);
+void fs_profile_json(FILE *fp);
+int link_find(struct job_info *job, dev_t dev, uint64_t ino);
+int link_add(struct job_info *job, dev_t dev, uint64_t ino);
+void link_set_free(struct job_info *job);
+void link_json(FILE *fp, struct job_info *job);
+int ck_start(struct job_info *job);
+void ck_stop(void);
+int ck_dequeue(struct dir_job *dj);
+void ck_working(const char *path);
+void ck_record(struct dnode *parent, const char *name);
+int ck_done(int state);
+int ck_load(struct job_info *job);
+struct dnode *ck_open(struct job_info *job, struct dnode *parent, char *name);
+int ck_submit(struct job_info *job, struct dnode *dn, char *name);
+int ck_walk(struct job_info *job, struct dnode *top, char **list, size_t n,
+	int (*fn)(struct job_info *, struct dnode *, char *));
+int ck_list_add(char ***list, size_t *n, size_t *sz, const char *path);
+void ck_list_free(char **list, size_t n);
+int watch_init(char *path);
+void watch_dir(struct dnode *dn);
+struct job_info *watch_run(char *path, uid_t uid, gid_t gid);
+int idmap_load(char *file);
+int idmap_from(char *spec);
+int idmap_remap(void);
+int idmap_owner(struct id_map *map, struct stat *st, uid_t *u, gid_t *g);
+int prune_add(const char *pat);
+int prune_add_file(const char *file);
+int prune_entry(struct dnode *dn, char *name, unsigned char d_type,
+	struct stat *st);
+int prune_dir(struct dnode *dn, struct stat *st);
+int parse_auto_threads(const char *str);
+int conc_start(void);
+void conc_park(void);
+void conc_unpark(void);
+int stats_init(int npool);
+void stats_publish(void);
+void stats_set_path(char *path);
+void stats_json(const char *prog);
+void stats_csw(void);
+void json_str(FILE *fp, const char *s);
+void trace_init(void);
+uint64_t trace_now(void);
+void trace_begin(struct trace_span *sp);
+void trace_end(struct trace_span *sp, struct dnode *dn, int ents,
+	int changed);
+void trace_idle(uint64_t start);
+void trace_dump(const char *prog);
+void *slab_alloc(size_t sz);
+void slab_free(void *p, size_t sz);
+char *slab_strdup(const char *s);
+void slab_free_str(char *s);
+#ifdef ALLOC_COUNT
+void alloc_report(void);
+#endif
+int parse_uid(char *str, uid_t *uid);
+int parse_gid(char *str, gid_t *gid);
+struct job_info *job_new(char *path, uid_t uid, gid_t gid);
+struct job_info *job_find(uint64_t job_id);
+int job_wait(struct job_info *job);
+void job_done(struct job_info *job);
+void job_set_share(struct job_info *job, unsigned int weight,
+	unsigned int cap);
+unsigned int job_share(struct job_info *job);
+void job_trim(int keep);
+void job_err(struct job_info *job, int err);
+void job_fail(struct job_info *job, int err);
+int chown_stated(struct job_info *job, int dir_fd, char *dname,
+	struct stat *statbuf, struct creds *cred);
+int chown_tally(struct job_info *job, int rval, char *dname,
+	unsigned char d_type, int *reg_procd, int *lnk_procd);
+int job_submit(struct job_info *job);
 
 extern struct thread_pool *threads;
 extern __thread struct thread_pool *my_tpool;
-extern pthread_mutex_t queue_lock;
-extern pthread_cond_t queue_cv;
+extern pthread_mutex_t idle_lock;
+extern unsigned int n_idle;
+extern unsigned int dj_queued;
+extern unsigned int dj_outstanding;
+extern unsigned int dir_fds;
+extern unsigned int fd_budget;
+extern unsigned int dj_max;
+extern unsigned int split_ents;
 extern int shutdown_time;
 extern int nthreads;
+extern int use_uring;
+extern int stat_mode;
+extern size_t dirbuf_sz;
+extern struct job_info *job_list;
+extern pthread_mutex_t jobs_lock;
+extern pthread_cond_t jobs_cv;
+extern int sched_multi;
+extern char *stats_path;
+extern char *json_path;
+extern int stats_live;
+extern struct thr_stats *thr_stats;
+extern int pin_mode;
+extern int cores_only;
+extern int topo_nodes;
+extern int thr_min;
+extern int thr_max;
+extern int thr_active;
+extern struct stats_hdr *stats_hdr;
+extern struct fs_profile *fs_root;
+extern unsigned int link_mem;
+extern char *ck_file;
+extern unsigned int ck_secs;
+extern unsigned int time_budget;
+extern int ck_resume;
+extern int ck_stopping;
+extern int watching;
+extern struct id_map *id_map;
+extern int prune_on;
+extern int prune_xdev;
+extern int prune_ro;
+extern int watch_inotify;
+extern char *trace_path;
+extern unsigned int trace_sample;
+extern int trace_on;
 //extern int n_avail_threads;
@@ -0,0 +1,760 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * mchownd - the resident version of mchown.
+ *
+ * the thread pool, io_uring rings and directory buffers are set up once,
+ * and then hierarchies to chown are handed to it over a unix socket, as
+ * many at a time as anyone likes.  each one is a job, see the job routines
+ * in mchown.c.
+ *
+ * the protocol is one line per request, one line per reply:
+ *
+ *   SUBMIT <user> <group> [option ...] <path>
+ *                    -> OK <job id>
+ *   STATUS <job id>  -> OK <job line>
+ *   WAIT <job id>    -> OK <job line>, once the job is finished
+ *   LIST             -> JOB <job line> for each job, then OK <count>
+ *
+ * where a job line is
+ *
+ *   <id> <running|done|failed> files <n> dirs <n> errors <n> errno <n>
+ *   secs <elapsed> threads <n> fs <profile> <path>
+ *
+ * the SUBMIT options are always-stat, never-stat or adapt for the stat
+ * mode, prio=N to give the job N times the share of the pool that a
+ * prio=1 job gets (the default), and threads=N to keep it to about N
+ * threads.  see job_share.
+ *
+ * anything that goes wrong is ERR <message>.  only root, or whoever
+ * mchownd is running as, may connect.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mchown.h"
+
+#define DEF_SOCK_PATH "/run/mchownd.sock"
+#define DEF_LOG_PATH "/var/log/mchownd.log"
+#define CRED_SLOTS 256          /* distinct user/group pairs in flight */
+#define JOBS_KEPT 1024          /* finished jobs remembered for STATUS */
+#define PRIO_MAX 100
+#define LINE_MAX_SZ (PATH_MAX + 256)
+
+FILE *errlog;
+int log_level = LOG_WARN;
+
+static const char *sock_path = DEF_SOCK_PATH;
+
+
+/*
+ * SIGINT and SIGTERM are blocked everywhere else and taken here, so the
+ * exit can do more than a signal handler is allowed to: write the JSON
+ * summary, and take the socket away with us
+ */
+ static void *
+sig_thread(void *arg)
+{
+	sigset_t *sigs;
+	int sig;
+
+	sigs = (sigset_t *)arg;
+	while (sigwait(sigs, &sig)) {
+		;
+	}
+	INFO("mchownd exiting on signal %d", sig);
+	unlink(sock_path);
+	stats_publish();
+	stats_json("mchownd");
+	trace_dump("mchownd");
+#ifdef ALLOC_COUNT
+	alloc_report();
+#endif
+	exit(0);
+
+	return NULL;
+}
+
+
+/*
+ * describe a job in one line.  jobs_lock must be held
+ */
+ static void
+job_line(struct job_info *job, char *buf, size_t sz)
+{
+	struct timespec now;
+	struct timespec *end;
+	double secs;
+	const char *state;
+
+	if (job->state == JOB_RUNNING) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		end = &now;
+		state = "running";
+	} else {
+		end = &job->end;
+		state = (job->state == JOB_DONE) ? "done" : "failed";
+	}
+	secs = (double)(end->tv_sec - job->start.tv_sec) +
+		(double)(end->tv_nsec - job->start.tv_nsec) / 1e9;
+	snprintf(buf, sz, "%lu %s files %lu dirs %lu errors %u errno %d "
+		"secs %.3f threads %u fs %s %s", job->job_id, state,
+		job->files_chowned, job->dirs_chowned, job->errors, job->err, secs,
+		ATOMIC_READ(job->running), job->fs_name ? job->fs_name : "-",
+		job->path);
+}
+
+
+/*
+ * SUBMIT <user> <group> [option ...] <path>
+ * the path is the rest of the line, so it can have spaces in it
+ */
+ static void
+do_submit(FILE *out, char *args)
+{
+	char *user;
+	char *group;
+	char *path;
+	char *opt;
+	char *end;
+	char *save;
+	uid_t uid;
+	gid_t gid;
+	int mode;
+	int rval;
+	unsigned long prio;
+	unsigned long cap;
+	struct job_info *job;
+
+	user = strtok_r(args, " ", &save);
+	group = strtok_r(NULL, " ", &save);
+	path = strtok_r(NULL, "", &save);
+	if ((user == NULL) || (group == NULL) || (path == NULL)) {
+		fprintf(out, "ERR usage: SUBMIT <user> <group> [option ...] "
+			"<path>\n");
+		return;
+	}
+
+	mode = stat_mode;
+	prio = 1;
+	cap = 0;
+	while (path && (path[0] != '/')) {
+		opt = path;
+		path = strchr(path, ' ');
+		if (path) {
+			*path++ = '\0';
+		}
+		if (!strcmp(opt, "always-stat")) {
+			mode = STAT_ALWAYS;
+		} else if (!strcmp(opt, "never-stat")) {
+			mode = STAT_NEVER;
+		} else if (!strcmp(opt, "adapt")) {
+			mode = STAT_ADAPT;
+		} else if (!strncmp(opt, "prio=", 5)) {
+			prio = strtoul(opt + 5, &end, 10);
+			if ((opt[5] == '\0') || (*end != '\0') || (prio < 1) ||
+				(prio > PRIO_MAX)) {
+
+				fprintf(out, "ERR prio must be 1 to %d\n", PRIO_MAX);
+				return;
+			}
+		} else if (!strncmp(opt, "threads=", 8)) {
+			cap = strtoul(opt + 8, &end, 10);
+			if ((opt[8] == '\0') || (*end != '\0') || (cap < 1) ||
+				(cap > UINT_MAX)) {
+
+				fprintf(out, "ERR bad thread count '%s'\n", opt + 8);
+				return;
+			}
+		} else {
+			fprintf(out, "ERR unknown option '%s'\n", opt);
+			return;
+		}
+	}
+	if (path == NULL) {
+		fprintf(out, "ERR path must be absolute\n");
+		return;
+	}
+	if (parse_uid(user, &uid)) {
+		fprintf(out, "ERR unknown user '%s'\n", user);
+		return;
+	}
+	if (parse_gid(group, &gid)) {
+		fprintf(out, "ERR unknown group '%s'\n", group);
+		return;
+	}
+
+	job = job_new(path, uid, gid);
+	if (job == NULL) {
+		fprintf(out, "ERR could not make job, errno %d\n", errno);
+		return;
+	}
+	job->stat_mode = mode;
+	job_set_share(job, (unsigned int)prio, (unsigned int)cap);
+	rval = job_submit(job);
+	if (rval) {
+		/* nothing of it got queued, so it's finished before it started */
+		pthread_mutex_lock(&jobs_lock);
+		job->failed = 1;
+		job->err = rval;
+		pthread_mutex_unlock(&jobs_lock);
+		job_done(job);
+		fprintf(out, "ERR could not queue job, errno %d\n", rval);
+		return;
+	}
+	INFO("job %lu: '%s' to %d:%d", job->job_id, job->path, uid, gid);
+	fprintf(out, "OK %lu\n", job->job_id);
+
+	pthread_mutex_lock(&jobs_lock);
+	job_trim(JOBS_KEPT);
+	pthread_mutex_unlock(&jobs_lock);
+}
+
+
+/*
+ * STATUS <job id> and WAIT <job id>
+ */
+ static void
+do_status(FILE *out, char *args, int wait)
+{
+	struct job_info *job;
+	char line[LINE_MAX_SZ];
+	char *end;
+	uint64_t job_id;
+
+	job_id = strtoul(args, &end, 10);
+	if ((*args == '\0') || (*end != '\0')) {
+		fprintf(out, "ERR bad job id '%s'\n", args);
+		return;
+	}
+
+	pthread_mutex_lock(&jobs_lock);
+	job = job_find(job_id);
+	while (wait && job && (job->state == JOB_RUNNING)) {
+		pthread_cond_wait(&jobs_cv, &jobs_lock);
+		job = job_find(job_id);     /* in case it's been trimmed meanwhile */
+	}
+	if (job) {
+		job_line(job, line, sizeof(line));
+	}
+	pthread_mutex_unlock(&jobs_lock);
+
+	if (job == NULL) {
+		fprintf(out, "ERR no job %lu\n", job_id);
+		return;
+	}
+	fprintf(out, "OK %s\n", line);
+}
+
+
+/*
+ * LIST
+ */
+ static void
+do_list(FILE *out)
+{
+	struct job_info *job;
+	char line[LINE_MAX_SZ];
+	int n;
+
+	n = 0;
+	pthread_mutex_lock(&jobs_lock);
+	for (job = job_list; job; job = job->next) {
+		job_line(job, line, sizeof(line));
+		fprintf(out, "JOB %s\n", line);
+		n++;
+	}
+	pthread_mutex_unlock(&jobs_lock);
+	fprintf(out, "OK %d\n", n);
+}
+
+
+/*
+ * one of these runs for each connection, until the other end hangs up.
+ * it isn't one of the pool's threads, so my_tpool stays NULL, and what it
+ * allocates comes from slab.c's locked shared cache
+ */
+ static void *
+conn_thread(void *arg)
+{
+	int fd;
+	FILE *in;
+	FILE *out;
+	char line[LINE_MAX_SZ];
+	char *cmd;
+	char *args;
+	size_t len;
+
+	fd = (int)(intptr_t)arg;
+	in = fdopen(fd, "r");
+	out = fdopen(dup(fd), "w");
+	if ((in == NULL) || (out == NULL)) {
+		FERR("conn_thread: fdopen failed errno %d", errno);
+		if (in) {
+			fclose(in);
+		} else {
+			close(fd);
+		}
+		if (out) {
+			fclose(out);
+		}
+		return NULL;
+	}
+	setvbuf(out, NULL, _IOLBF, 0);
+
+	while (fgets(line, sizeof(line), in)) {
+		len = strlen(line);
+		if ((len == 0) || (line[len - 1] != '\n')) {
+			fprintf(out, "ERR line too long\n");
+			break;
+		}
+		line[--len] = '\0';
+		if ((len > 0) && (line[len - 1] == '\r')) {
+			line[--len] = '\0';
+		}
+		cmd = line;
+		args = strchr(line, ' ');
+		if (args) {
+			*args++ = '\0';
+		} else {
+			args = line + len;
+		}
+		MBUG("mchownd: command '%s' args '%s'", cmd, args);
+
+		if (!strcmp(cmd, "SUBMIT")) {
+			do_submit(out, args);
+		} else if (!strcmp(cmd, "STATUS")) {
+			do_status(out, args, 0);
+		} else if (!strcmp(cmd, "WAIT")) {
+			do_status(out, args, 1);
+		} else if (!strcmp(cmd, "LIST")) {
+			do_list(out);
+		} else if (cmd[0] != '\0') {
+			fprintf(out, "ERR unknown command '%s'\n", cmd);
+		}
+	}
+	fclose(in);
+	fclose(out);
+
+	return NULL;
+}
+
+
+/*
+ * only let in root, and whoever we're running as
+ */
+ static int
+peer_ok(int fd)
+{
+	struct ucred uc;
+	socklen_t len;
+
+	len = sizeof(uc);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &uc, &len)) {
+		WARN("SO_PEERCRED failed errno %d", errno);
+		return 0;
+	}
+	if ((uc.uid != 0) && (uc.uid != geteuid())) {
+		WARN("refusing connection from uid %d pid %d", uc.uid, uc.pid);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * make the listening socket.  a socket file left behind by an mchownd that
+ * died is removed, one that somebody is still answering on is not.
+ * returns the fd, or -1 after saying why
+ */
+ static int
+listen_sock(void)
+{
+	struct sockaddr_un sa;
+	int fd;
+	int tfd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(sock_path) >= sizeof(sa.sun_path)) {
+		FERR("socket path '%s' is too long", sock_path);
+		return -1;
+	}
+	strcpy(sa.sun_path, sock_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		FERR("socket failed errno %d", errno);
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) && (errno == EADDRINUSE)) {
+		tfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if ((tfd >= 0) &&
+			(connect(tfd, (struct sockaddr *)&sa, sizeof(sa)) == 0)) {
+
+			FERR("mchownd already running on '%s'", sock_path);
+			close(tfd);
+			close(fd);
+			return -1;
+		}
+		if (tfd >= 0) {
+			close(tfd);
+		}
+		unlink(sock_path);
+		errno = 0;
+		(void)bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+	}
+	if (errno) {
+		FERR("bind to '%s' failed errno %d", sock_path, errno);
+		close(fd);
+		return -1;
+	}
+	chmod(sock_path, 0600);
+	if (listen(fd, 64)) {
+		FERR("listen failed errno %d", errno);
+		close(fd);
+		unlink(sock_path);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+ static void
+usage(char *prog_name)
+{
+	char *basename;
+
+	basename = strrchr(prog_name, '/');
+	if (basename) {
+		basename++;
+	} else {
+		basename = prog_name;
+	}
+	printf("\nusage:\n%s [-h] [-f] [-v] [-u] [-n N] [--auto-threads MIN:MAX] "
+		"[-b KB] [-q N]\n\t[--split-dirs N] [-s socket] [-l logfile] [--always-stat|--never-stat] "
+		"[--pin none|core|node]\n\t[--cores-only] [--fs-profile PROFILE] "
+		"[--link-mem MB] [--stats FILE] [--json FILE]\n\t"
+		"[--trace FILE [--trace-sample N]]"
+#ifdef MDEBUG
+		" [-d]"
+#endif
+		"\n", basename);
+	printf("\tstarts the mchown daemon, which takes jobs over a unix socket\n");
+	printf("\t-h\thelp message\n");
+	printf("\t-f\tstay in the foreground, logging to stderr\n");
+	printf("\t-v\tlog every job\n");
+	printf("\t-u\tbatch the stat calls through io_uring, if the kernel\n");
+	printf("\t\tsupports it\n");
+#ifdef MDEBUG
+	printf("\t-d\ttoggle debugging output\n");
+#endif
+	printf("\t-n N\tuse a thread pool with N threads, more than there are\n");
+	printf("\t\tcores if you like\n");
+	printf("\t--auto-threads MIN:MAX\tkeep adjusting the number of working\n");
+	printf("\t\tthreads between MIN and MAX, by how fast it's going\n");
+	printf("\t-b KB\tsize in KB of each thread's directory read buffer,\n");
+	printf("\t\t%d to %d, default %d\n", DIRBUF_MIN_KB, DIRBUF_MAX_KB,
+		DIRBUF_DEF_SZ / 1024);
+	printf("\t-q N\tmost directories queued up for the threads at once,\n");
+	printf("\t\tbetween all the jobs, default %d\n", DJ_MAX_DEF);
+	printf("\t--split-dirs N\tonce a directory has more than N entries,\n");
+	printf("\t\thand the rest of its files to the other threads in\n");
+	printf("\t\tbatches, default %d, 0 for never\n", SPLIT_DEF);
+	printf("\t-s path\tthe socket to listen on, default %s\n", DEF_SOCK_PATH);
+	printf("\t-l path\tthe log file, default %s\n", DEF_LOG_PATH);
+	printf("\t--always-stat, --never-stat\n");
+	printf("\t\tthe stat mode for jobs that don't ask for one\n");
+	printf("\t--pin MODE\tpin the pool threads per cpu (core) or NUMA node\n");
+	printf("\t\t(node), default none\n");
+	printf("\t--cores-only\tone pool thread per physical core\n");
+	printf("\t--fs-profile NAME[,dtype=0|1][,dontsync=0|1][,inosort=0|1]\n");
+	printf("\t\t[,weigh=0|1][,threads=PCT]\n");
+	printf("\t\tuse the NAME profile for everything, instead of the one\n");
+	printf("\t\tfor each file system, or with auto, change them all.\n");
+	printf("\t\tthreads only matters with NAME, there's no path to go by\n");
+	printf("\t--link-mem MB\tmemory for remembering files with more than one\n");
+	printf("\t\tlink, between all the jobs, each of which gets up to an\n");
+	printf("\t\teighth.  default %d, 0 for none\n", LINK_MEM_DEF);
+	printf("\t--stats FILE\tkeep live per-thread counters in FILE\n");
+	printf("\t--json FILE\twrite a JSON summary to FILE on the way out\n");
+	printf("\t--trace FILE\twrite the last of what each thread did to FILE\n");
+	printf("\t\ton the way out, as Chrome trace JSON\n");
+	printf("\t--trace-sample N\tonly time one directory in N, default 1.\n");
+	printf("\t\tevery 100th or so is plenty to leave on all the time\n");
+}
+
+
+ int
+main(int argc, char **argv)
+{
+	int i;
+	int m;
+	int optret;
+	int user_thr_cnt;
+	int foreground;
+	int lfd;
+	int cfd;
+	const char *log_path;
+	pthread_t tid;
+	pthread_attr_t attr;
+	sigset_t sigs;
+	extern char *optarg;
+	extern int optind, opterr, optopt;
+	static struct option long_opts[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"foreground", no_argument, NULL, 'f'},
+		{"verbose", no_argument, NULL, 'v'},
+		{"threads", required_argument, NULL, 'n'},
+		{"buffer-kb", required_argument, NULL, 'b'},
+		{"max-queued", required_argument, NULL, 'q'},
+		{"split-dirs", required_argument, NULL, OPT_SPLIT_DIRS},
+		{"uring", no_argument, NULL, 'u'},
+		{"socket", required_argument, NULL, 's'},
+		{"log", required_argument, NULL, 'l'},
+		{"always-stat", no_argument, NULL, OPT_ALWAYS_STAT},
+		{"never-stat", no_argument, NULL, OPT_NEVER_STAT},
+		{"stats", required_argument, NULL, OPT_STATS},
+		{"json", required_argument, NULL, OPT_JSON},
+		{"pin", required_argument, NULL, OPT_PIN},
+		{"cores-only", no_argument, NULL, OPT_CORES_ONLY},
+		{"auto-threads", required_argument, NULL, OPT_AUTO_THREADS},
+		{"fs-profile", required_argument, NULL, OPT_FS_PROFILE},
+		{"link-mem", required_argument, NULL, OPT_LINK_MEM},
+		{"trace", required_argument, NULL, OPT_TRACE},
+		{"trace-sample", required_argument, NULL, OPT_TRACE_SAMPLE},
+		{NULL, 0, NULL, 0}
+	};
+
+	user_thr_cnt = 0;
+	foreground = 0;
+	log_path = NULL;
+	errlog = stderr;
+
+#define OPTSTR "hdfvun:b:q:s:l:"
+	optret = getopt_long(argc, argv, OPTSTR, long_opts, NULL);
+	while ((optret != -1) && (optret != '?')) {
+		switch (optret) {
+			case 'h':
+				usage(argv[0]);
+				exit(0);
+			case 'd':
+#ifdef MDEBUG
+				debug = !debug;
+#else
+				usage(argv[0]);
+				printf("\n-d option not available - not compiled with debug\n");
+				exit(0);
+#endif
+				break;
+			case 'f':
+				foreground = 1;
+				break;
+			case 'v':
+				log_level = LOG_INFO;
+				break;
+			case 'n':
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m > THREADS_MAX)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a thread count\n",
+						optarg);
+					exit(1);
+				}
+				if (m > 0) {
+					user_thr_cnt = m;
+				}
+				break;
+			case OPT_AUTO_THREADS:
+				if (parse_auto_threads(optarg)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as MIN:MAX threads, "
+						"1 to %d\n", optarg, THREADS_MAX);
+					exit(1);
+				}
+				break;
+			case 'b':
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < DIRBUF_MIN_KB) || (m > DIRBUF_MAX_KB)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a buffer size\n",
+						optarg);
+					exit(1);
+				}
+				dirbuf_sz = (size_t)m * 1024;
+				break;
+			case 'q':
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 1) || (m > DJ_MAX_MAX)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a queue limit\n",
+						optarg);
+					exit(1);
+				}
+				dj_max = (unsigned int)m;
+				break;
+			case 'u':
+				use_uring = 1;
+				break;
+			case 's':
+				sock_path = optarg;
+				break;
+			case 'l':
+				log_path = optarg;
+				break;
+			case OPT_ALWAYS_STAT:
+				stat_mode = STAT_ALWAYS;
+				break;
+			case OPT_NEVER_STAT:
+				stat_mode = STAT_NEVER;
+				break;
+			case OPT_PIN:
+				pin_mode = parse_pin(optarg);
+				if (pin_mode < 0) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as none, core or node\n",
+						optarg);
+					exit(1);
+				}
+				break;
+			case OPT_CORES_ONLY:
+				cores_only = 1;
+				break;
+			case OPT_FS_PROFILE:
+				if (parse_fs_profile(optarg)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a file system "
+						"profile\n", optarg);
+					exit(1);
+				}
+				break;
+			case OPT_LINK_MEM:
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 0) || (m > LINK_MEM_MAX)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as MB for the hard "
+						"link sets\n", optarg);
+					exit(1);
+				}
+				link_mem = (unsigned int)m;
+				break;
+			case OPT_STATS:
+				stats_path = optarg;
+				break;
+			case OPT_JSON:
+				json_path = optarg;
+				break;
+			case OPT_TRACE:
+				trace_path = optarg;
+				break;
+			case OPT_SPLIT_DIRS:
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 0)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a number of entries\n",
+						optarg);
+					exit(1);
+				}
+				split_ents = (unsigned int)m;
+				break;
+			case OPT_TRACE_SAMPLE:
+				i = sscanf(optarg, "%d", &m);
+				if ((i != 1) || (m < 1)) {
+					usage(argv[0]);
+					printf("\nCould not process '%s' as a sample rate\n",
+						optarg);
+					exit(1);
+				}
+				trace_sample = (unsigned int)m;
+				break;
+		}
+		optret = getopt_long(argc, argv, OPTSTR, long_opts, NULL);
+	}
+	if ((optret == '?') || (optind != argc)) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if ((log_path == NULL) && (!foreground)) {
+		log_path = DEF_LOG_PATH;
+	}
+	if (log_path) {
+		errlog = fopen(log_path, "a");
+		if (errlog == NULL) {
+			fprintf(stderr, "Could not open log file '%s' errno %d\n",
+				log_path, errno);
+			exit(1);
+		}
+		setvbuf(errlog, NULL, _IOLBF, 0);
+	}
+
+	lfd = listen_sock();
+	if (lfd < 0) {
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	/* the pool threads have to be started after this, they don't fork */
+	if ((!foreground) && daemon(0, 0)) {
+		FERR("daemon failed errno %d", errno);
+		unlink(sock_path);
+		exit(1);
+	}
+
+	/* before any threads are started, so they all inherit it */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	if (mchown_init(user_thr_cnt, CRED_SLOTS)) {
+		unlink(sock_path);
+		exit(1);
+	}
+	INFO("mchownd listening on '%s' with %d threads", sock_path, nthreads);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, sig_thread, &sigs)) {
+		FERR("could not start signal thread");
+		unlink(sock_path);
+		exit(1);
+	}
+	for (;;) {
+		cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (cfd < 0) {
+			if ((errno != EINTR) && (errno != ECONNABORTED)) {
+				WARN("accept failed errno %d", errno);
+			}
+			continue;
+		}
+		if (!peer_ok(cfd)) {
+			close(cfd);
+			continue;
+		}
+		if (pthread_create(&tid, &attr, conn_thread, (void *)(intptr_t)cfd)) {
+			WARN("could not start connection thread errno %d", errno);
+			close(cfd);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * pruning, leaving out whole subtrees: ones on other file systems with
+ * --one-file-system, ones on read-only mounts with --skip-read-only, and
+ * ones that match an --exclude, like the .snapshot or .zfs directories
+ * NFS servers put in every home directory.  a pruned directory is never
+ * read, so nothing under it costs anything.
+ *
+ * excludes are checked by mdpf on each entry before it's queued or
+ * recursed into, so an excluded directory isn't even opened.  a pattern
+ * without a '/' is a glob matched against the names of files and
+ * directories anywhere.  one with a '/' is matched against the paths of
+ * directories, the full path if it starts with '/', otherwise the path
+ * under the top, so it can name one directory, or a prefix, or a glob of
+ * them.
+ *
+ * the mount checks need the directory's st_dev and mount flags, which
+ * are only known once it's open: mdpf fstat's every directory it opens
+ * anyway, and dn_set_fs fstatfs's each one that's on a new st_dev.  so a
+ * mount point gets opened and then dropped, but never read.  when the
+ * entry was stat'd already, because d_type couldn't be believed, a
+ * different st_dev prunes it before that.
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mchown.h"
+
+int prune_on;                    /* there's something to check in mdpf */
+int prune_xdev;                  /* --one-file-system */
+int prune_ro;                    /* --skip-read-only */
+
+static char **prune_names;       /* excludes without a '/' */
+static int prune_nnames;
+static char **prune_paths;       /* excludes with a '/' */
+static int prune_npaths;
+
+
+/*
+ * add an --exclude pattern.
+ * returns 0, or -1 after saying why
+ */
+ int
+prune_add(const char *pat)
+{
+	char ***tbl;
+	char **ntbl;
+	char *p;
+	size_t len;
+	int *n;
+
+	p = strdup(pat);
+	if (p == NULL) {
+		FERR("No memory for the exclude '%s'", pat);
+		return -1;
+	}
+	/* dir/ means the same as dir */
+	for (len = strlen(p); (len > 1) && (p[len - 1] == '/'); len--) {
+		p[len - 1] = '\0';
+	}
+	if (strchr(p, '/')) {
+		tbl = &prune_paths;
+		n = &prune_npaths;
+	} else {
+		tbl = &prune_names;
+		n = &prune_nnames;
+	}
+	ntbl = realloc(*tbl, (size_t)(*n + 1) * sizeof(char *));
+	if (ntbl == NULL) {
+		FERR("No memory for the exclude '%s'", pat);
+		free(p);
+		return -1;
+	}
+	ntbl[(*n)++] = p;
+	*tbl = ntbl;
+	prune_on = 1;
+
+	return 0;
+}
+
+
+/*
+ * add every line of file as an --exclude.  blank lines and lines that
+ * start with # are skipped.
+ * returns 0, or -1 after saying why
+ */
+ int
+prune_add_file(const char *file)
+{
+	FILE *fp;
+	char line[PATH_MAX + 2];
+	size_t len;
+	int rval;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		FERR("Could not open the exclude list '%s' errno %d", file, errno);
+		return -1;
+	}
+	rval = 0;
+	while ((!rval) && fgets(line, sizeof(line), fp)) {
+		len = strlen(line);
+		while (len && isspace((unsigned char)line[len - 1])) {
+			line[--len] = '\0';
+		}
+		if (len && (line[0] != '#')) {
+			rval = prune_add(line);
+		}
+	}
+	fclose(fp);
+
+	return rval;
+}
+
+
+/*
+ * whether to leave out name, an entry in dn, before it's done or queued.
+ * d_type is what it's known to be, and st is its stat if it has one.
+ * returns 1 to leave it out
+ */
+ int
+prune_entry(struct dnode *dn, char *name, unsigned char d_type,
+	struct stat *st)
+{
+	char path[PATH_MAX];
+	char *rel;
+	size_t toplen;
+	int i;
+
+	for (i = 0; i < prune_nnames; i++) {
+		if (fnmatch(prune_names[i], name, 0) == 0) {
+			MBUG(" prune - '%s' matches '%s'", name, prune_names[i]);
+			return 1;
+		}
+	}
+	if (d_type != DT_DIR) {
+		return 0;
+	}
+	if (prune_xdev && st && (st->st_dev != dn->dev)) {
+		MBUG(" prune - '%s' is on another file system", name);
+		return 1;
+	}
+	if (prune_npaths == 0) {
+		return 0;
+	}
+
+	if (snprintf(path, sizeof(path), "%s/%s", dn_path(dn), name) >=
+		(int)sizeof(path)) {
+
+		return 0;
+	}
+	toplen = strlen(dn->job->path);
+	rel = path + toplen + ((path[toplen] == '/') ? 1 : 0);
+	for (i = 0; i < prune_npaths; i++) {
+		if (fnmatch(prune_paths[i], (prune_paths[i][0] == '/') ? path : rel,
+			FNM_PATHNAME) == 0) {
+
+			MBUG(" prune - '%s' matches '%s'", path, prune_paths[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * whether to leave out a directory that's just been opened and fstat'd,
+ * for being across a mount or on a read-only one.  the top of a job can
+ * only be left out for being read-only, and says so.
+ * returns 1 to leave it out
+ */
+ int
+prune_dir(struct dnode *dn, struct stat *st)
+{
+	if (prune_xdev && dn->parent && (st->st_dev != dn->parent->dev)) {
+		MBUG(" prune - '%s' is on another file system", dn_path(dn));
+		return 1;
+	}
+	if (prune_ro && dn->rdonly) {
+		if (dn->parent == NULL) {
+			WARN("'%s' is on a read-only mount, leaving it out",
+				dn_path(dn));
+		}
+		MBUG(" prune - '%s' is on a read-only mount", dn_path(dn));
+		return 1;
+	}
+
+	return 0;
+}
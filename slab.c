@@ -0,0 +1,304 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * slab allocator for the little things that come and go once per
+ * directory: the names on queued dir_jobs, and dnodes.  going through
+ * malloc for those means every thread banging on the malloc arenas a few
+ * times per directory, and the frees usually happen on some other thread
+ * than the malloc, which is the worst case for them.
+ *
+ * objects come in size classes of SLAB_QUANTUM bytes, up to SLAB_MAX.
+ * each pool thread keeps a free list per class, and carves new objects out
+ * of SLAB_BLOCK_SZ blocks when its list is empty.  an object is freed onto
+ * the list of whatever thread frees it, and since whoever steals a
+ * dir_job is the one that frees its name, a thread that mostly steals
+ * would end up with everyone's free objects.  so when a list gets past
+ * 2 * SLAB_BATCH, a batch of them goes to the depot, where a thread with an
+ * empty list looks before it carves.  the depot is the only thing that's
+ * locked.  blocks are never given back, the most there can be is bounded
+ * by dj_max and the depth of the trees.
+ *
+ * threads outside the pool, like mchownd's connection threads, share one
+ * cache under the lock.  anything bigger than SLAB_MAX goes to malloc.
+ *
+ * the size has to be handed back to slab_free, since there's no header.
+ *
+ * built with ALLOC_COUNT (make allocs), this also counts every call to
+ * the malloc family made from mchown's own code, see alloc_report().
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mchown.h"
+
+struct slab_obj {
+	struct slab_obj *next;
+	struct slab_obj *next_batch;    /* only for the first of a depot batch */
+};
+
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slab_obj *depot[SLAB_CLASSES];   /* batches of SLAB_BATCH */
+static struct slab_cache shared_sc;            /* for non-pool threads */
+
+#define SLAB_CLASS(SZ) (((SZ) + SLAB_QUANTUM - 1) / SLAB_QUANTUM - 1)
+
+
+/*
+ * get an object of class c for the cache.  the list is empty, so try the
+ * depot first, and carve one out of a block if there's nothing there.
+ * returns NULL if a new block couldn't be had
+ */
+ static void *
+slab_refill(struct slab_cache *sc, unsigned int c)
+{
+	struct slab_obj *o;
+	size_t csz;
+	char *blk;
+
+	if (ATOMIC_READ(depot[c])) {
+		pthread_mutex_lock(&slab_lock);
+		o = depot[c];
+		if (o) {
+			depot[c] = o->next_batch;
+		}
+		pthread_mutex_unlock(&slab_lock);
+		if (o) {
+			sc->free[c] = o->next;
+			sc->nfree[c] = SLAB_BATCH - 1;
+			return o;
+		}
+	}
+
+	csz = (size_t)(c + 1) * SLAB_QUANTUM;
+	if (sc->blk_left < csz) {
+		/* the rest of the old block is just left, it's never much */
+		blk = malloc(SLAB_BLOCK_SZ);
+		if (blk == NULL) {
+			return NULL;
+		}
+		/* the first bit of each block chains the blocks together */
+		*(char **)(void *)blk = sc->blocks;
+		sc->blocks = blk;
+		sc->blk = blk + SLAB_QUANTUM;
+		sc->blk_left = SLAB_BLOCK_SZ - SLAB_QUANTUM;
+		sc->nblocks++;
+	}
+	o = (struct slab_obj *)(void *)sc->blk;
+	sc->blk = sc->blk + csz;
+	sc->blk_left = sc->blk_left - csz;
+
+	return o;
+}
+
+
+/*
+ * allocate sz bytes.  returns NULL with errno set if there's no memory
+ */
+ void *
+slab_alloc(size_t sz)
+{
+	struct slab_cache *sc;
+	struct slab_obj *o;
+	unsigned int c;
+
+	if (sz > SLAB_MAX) {
+		return malloc(sz);
+	}
+	c = (unsigned int)SLAB_CLASS(sz);
+	if (my_tpool == NULL) {
+		sc = &shared_sc;
+		pthread_mutex_lock(&slab_lock);
+	} else {
+		sc = &my_tpool->sc;
+	}
+
+	o = sc->free[c];
+	if (o) {
+		sc->free[c] = o->next;
+		sc->nfree[c]--;
+	} else if (sc == &shared_sc) {
+		/* holding slab_lock already, so don't look in the depot */
+		o = NULL;
+	} else {
+		o = slab_refill(sc, c);
+	}
+	if (sc == &shared_sc) {
+		pthread_mutex_unlock(&slab_lock);
+		if (o == NULL) {
+			o = malloc((size_t)(c + 1) * SLAB_QUANTUM);
+		}
+	}
+	if (o == NULL) {
+		errno = ENOMEM;
+	}
+
+	return o;
+}
+
+
+/*
+ * free something from slab_alloc, sz being what it was allocated with
+ */
+ void
+slab_free(void *p, size_t sz)
+{
+	struct slab_cache *sc;
+	struct slab_obj *o;
+	struct slab_obj *batch;
+	unsigned int c;
+	unsigned int n;
+
+	if (sz > SLAB_MAX) {
+		free(p);
+		return;
+	}
+	c = (unsigned int)SLAB_CLASS(sz);
+	o = p;
+	if (my_tpool == NULL) {
+		pthread_mutex_lock(&slab_lock);
+		o->next = shared_sc.free[c];
+		shared_sc.free[c] = o;
+		shared_sc.nfree[c]++;
+		pthread_mutex_unlock(&slab_lock);
+		return;
+	}
+
+	sc = &my_tpool->sc;
+	o->next = sc->free[c];
+	sc->free[c] = o;
+	sc->nfree[c]++;
+	if (sc->nfree[c] < 2 * SLAB_BATCH) {
+		return;
+	}
+
+	/* too many, hand the first SLAB_BATCH of them to the depot */
+	batch = sc->free[c];
+	for (n = 1; n < SLAB_BATCH; n++) {
+		o = o->next;
+	}
+	sc->free[c] = o->next;
+	sc->nfree[c] = sc->nfree[c] - SLAB_BATCH;
+	o->next = NULL;
+	pthread_mutex_lock(&slab_lock);
+	batch->next_batch = depot[c];
+	depot[c] = batch;
+	pthread_mutex_unlock(&slab_lock);
+}
+
+
+/*
+ * strdup, from the slab.  free it with slab_free_str
+ */
+ char *
+slab_strdup(const char *s)
+{
+	size_t len;
+	char *p;
+
+	len = strlen(s) + 1;
+	p = slab_alloc(len);
+	if (p) {
+		memcpy(p, s, len);
+	}
+
+	return p;
+}
+
+
+ void
+slab_free_str(char *s)
+{
+	slab_free(s, strlen(s) + 1);
+}
+
+
+#ifdef ALLOC_COUNT
+/*
+ * the allocation counting build.  the link wraps malloc, calloc, realloc
+ * and strdup for mchown's own objects (see the allocs target in the
+ * Makefile), so this counts every call the code makes, and how many of
+ * them were made by a pool thread in the middle of a dir_job.  with the
+ * slab doing its job, the latter doesn't go up with the number of
+ * directories, only with the number of threads and slab blocks.
+ */
+void *__real_malloc(size_t sz);
+void *__real_calloc(size_t n, size_t sz);
+void *__real_realloc(void *p, size_t sz);
+char *__real_strdup(const char *s);
+void *__wrap_malloc(size_t sz);
+void *__wrap_calloc(size_t n, size_t sz);
+void *__wrap_realloc(void *p, size_t sz);
+char *__wrap_strdup(const char *s);
+
+static uint64_t alloc_calls;
+static uint64_t alloc_busy;        /* made while working on a dir_job */
+
+ static void
+alloc_count(void)
+{
+	__sync_add_and_fetch(&alloc_calls, 1);
+	if (my_tpool && my_tpool->st && my_tpool->st->busy) {
+		__sync_add_and_fetch(&alloc_busy, 1);
+	}
+}
+
+
+ void *
+__wrap_malloc(size_t sz)
+{
+	alloc_count();
+	return __real_malloc(sz);
+}
+
+
+ void *
+__wrap_calloc(size_t n, size_t sz)
+{
+	alloc_count();
+	return __real_calloc(n, sz);
+}
+
+
+ void *
+__wrap_realloc(void *p, size_t sz)
+{
+	alloc_count();
+	return __real_realloc(p, sz);
+}
+
+
+ char *
+__wrap_strdup(const char *s)
+{
+	alloc_count();
+	return __real_strdup(s);
+}
+
+
+/*
+ * say how many allocations there were, on stderr
+ */
+ void
+alloc_report(void)
+{
+	uint64_t blocks;
+	int t;
+
+	blocks = 0;
+	for (t = 0; t <= nthreads; t++) {
+		blocks = blocks + threads[t].sc.nblocks;
+	}
+	fprintf(stderr, "allocs: %lu calls, %lu during dir_jobs, %lu slab blocks\n",
+		ATOMIC_READ(alloc_calls), ATOMIC_READ(alloc_busy), blocks);
+}
+#endif
@@ -0,0 +1,307 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * statistics.  every thread counts what it does in its own slot of an
+ * array of struct thr_stats, each on its own cache lines, so counting costs
+ * nothing more than an increment.  with --stats the array lives in a file
+ * that's mmap'd shared, behind a struct stats_hdr, so anything that wants
+ * to watch a run can just map the file and look.  see mchown.h for the
+ * layout.  at the end, --json writes a summary.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "mchown.h"
+
+char *stats_path;                /* --stats file, NULL for none */
+char *json_path;                 /* --json file, "-" for stdout */
+int stats_live;                  /* stats are mapped, keep cur_path up */
+struct stats_hdr *stats_hdr;
+struct thr_stats *thr_stats;     /* nthreads + 1 of them */
+
+static size_t stats_sz;
+static struct timespec stats_start;
+
+
+/*
+ * set up the stats for npool threads, in the --stats file if there is one.
+ * returns 0, or -1 after saying why
+ */
+ int
+stats_init(int npool)
+{
+	size_t hsz;
+	int fd;
+
+	hsz = sizeof(struct stats_hdr);      /* already a multiple of STATS_ALIGN */
+	stats_sz = hsz + (size_t)npool * sizeof(struct thr_stats);
+	clock_gettime(CLOCK_REALTIME, &stats_start);
+
+	if (stats_path) {
+		fd = open(stats_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			FERR("Could not create stats file '%s' errno %d", stats_path,
+				errno);
+			return -1;
+		}
+		if (ftruncate(fd, (off_t)stats_sz)) {
+			FERR("Could not size stats file '%s' errno %d", stats_path,
+				errno);
+			close(fd);
+			return -1;
+		}
+		stats_hdr = mmap(NULL, stats_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+		close(fd);
+		if (stats_hdr == MAP_FAILED) {
+			FERR("Could not map stats file '%s' errno %d", stats_path, errno);
+			stats_hdr = NULL;
+			return -1;
+		}
+		stats_live = 1;
+	} else {
+		if (posix_memalign((void **)&stats_hdr, STATS_ALIGN, stats_sz)) {
+			FERR("Could not allocate stats");
+			return -1;
+		}
+		memset(stats_hdr, 0, stats_sz);
+	}
+	thr_stats = (struct thr_stats *)(void *)((char *)stats_hdr + hsz);
+
+	memcpy(stats_hdr->magic, STATS_MAGIC, sizeof(stats_hdr->magic));
+	stats_hdr->hdr_size = (uint32_t)hsz;
+	stats_hdr->thr_size = (uint32_t)sizeof(struct thr_stats);
+	stats_hdr->nthr = (uint32_t)npool;
+	stats_hdr->pid = getpid();
+	stats_hdr->start_sec = stats_start.tv_sec;
+	/* the version goes in last, so a reader knows the rest is there */
+	__atomic_store_n(&stats_hdr->version, STATS_VERSION, __ATOMIC_RELEASE);
+	DBUG("stats: %lu bytes %s", stats_sz, stats_live ? stats_path : "private");
+
+	return 0;
+}
+
+
+/*
+ * copy the pool-wide numbers into the header, and say we're still alive.
+ * any thread can do this, it's only ever a snapshot.
+ */
+ void
+stats_publish(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	stats_hdr->dj_queued = ATOMIC_READ(dj_queued);
+	stats_hdr->dj_outstanding = ATOMIC_READ(dj_outstanding);
+	stats_hdr->dir_fds = ATOMIC_READ(dir_fds);
+	stats_hdr->heartbeat_ns = (uint64_t)now.tv_sec * 1000000000UL +
+		(uint64_t)now.tv_nsec;
+}
+
+
+/*
+ * note the directory this thread is working on, for anyone watching.
+ * the end of a long path is the interesting part, so that's what's kept.
+ * path_seq is odd while it's changing.
+ */
+ void
+stats_set_path(char *path)
+{
+	struct thr_stats *st;
+	size_t len;
+
+	st = my_tpool->st;
+	len = strlen(path);
+	if (len >= STATS_PATH_SZ) {
+		path = path + len - (STATS_PATH_SZ - 1);
+		len = STATS_PATH_SZ - 1;
+	}
+	__atomic_add_fetch(&st->path_seq, 1, __ATOMIC_RELEASE);
+	memcpy(st->cur_path, path, len + 1);
+	__atomic_add_fetch(&st->path_seq, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * write a string out as a JSON string
+ */
+ void
+json_str(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if ((*s == '"') || (*s == '\\')) {
+			fprintf(fp, "\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf(fp, "\\u%04x", (unsigned int)(unsigned char)*s);
+		} else {
+			fputc(*s, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+
+/*
+ * the counters of one thread, or the totals, as a JSON object's members
+ */
+ static void
+json_counters(FILE *fp, struct thr_stats *st)
+{
+	fprintf(fp, "\"dirs_scanned\": %lu, \"files_scanned\": %lu, "
+		"\"links_scanned\": %lu, \"dirs_changed\": %lu, "
+		"\"files_changed\": %lu, \"links_changed\": %lu, "
+		"\"syscalls\": %lu, \"uring_ops\": %lu, \"errors\": %lu, "
+		"\"hardlinks_skipped\": %lu, \"pruned\": %lu, "
+		"\"spin_wins\": %lu, \"parks\": %lu, \"csw_vol\": %lu, "
+		"\"csw_invol\": %lu, \"batches\": %lu",
+		st->dirs_scanned, st->files_scanned, st->links_scanned,
+		st->dirs_changed, st->files_changed, st->links_changed,
+		st->syscalls, st->uring_ops, st->errors, st->hardlinks_skipped,
+		st->pruned, st->spin_wins, st->parks, st->csw_vol, st->csw_invol,
+		st->batches);
+}
+
+
+/*
+ * note this thread's context switches so far in its stats.  called when
+ * it wakes up from parking, and when it's done.  mchownd's signal thread
+ * isn't one of the pool's, and has no stats to put them in
+ */
+ void
+stats_csw(void)
+{
+	struct rusage ru;
+
+	if (my_tpool == NULL) {
+		return;
+	}
+	if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+		my_tpool->st->csw_vol = (uint64_t)ru.ru_nvcsw;
+		my_tpool->st->csw_invol = (uint64_t)ru.ru_nivcsw;
+	}
+}
+
+
+/*
+ * write the JSON summary to json_path, if there is one.  called at exit.
+ */
+ void
+stats_json(const char *prog)
+{
+	FILE *fp;
+	struct thr_stats tot;
+	struct thr_stats *st;
+	struct job_info *job;
+	struct timespec now;
+	struct rusage ru;
+	double secs;
+	uint32_t t;
+	const char *state;
+
+	stats_csw();
+	if (json_path == NULL) {
+		return;
+	}
+	if (!strcmp(json_path, "-")) {
+		fp = stdout;
+	} else {
+		fp = fopen(json_path, "w");
+		if (fp == NULL) {
+			FERR("Could not write JSON summary '%s' errno %d", json_path,
+				errno);
+			return;
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	secs = (double)(now.tv_sec - stats_start.tv_sec) +
+		(double)(now.tv_nsec - stats_start.tv_nsec) / 1e9;
+	memset(&tot, 0, sizeof(tot));
+	for (t = 0; t < stats_hdr->nthr; t++) {
+		st = &thr_stats[t];
+		tot.dirs_scanned = tot.dirs_scanned + st->dirs_scanned;
+		tot.files_scanned = tot.files_scanned + st->files_scanned;
+		tot.links_scanned = tot.links_scanned + st->links_scanned;
+		tot.dirs_changed = tot.dirs_changed + st->dirs_changed;
+		tot.files_changed = tot.files_changed + st->files_changed;
+		tot.links_changed = tot.links_changed + st->links_changed;
+		tot.syscalls = tot.syscalls + st->syscalls;
+		tot.uring_ops = tot.uring_ops + st->uring_ops;
+		tot.errors = tot.errors + st->errors;
+		tot.hardlinks_skipped = tot.hardlinks_skipped + st->hardlinks_skipped;
+		tot.pruned = tot.pruned + st->pruned;
+		tot.spin_wins = tot.spin_wins + st->spin_wins;
+		tot.parks = tot.parks + st->parks;
+		tot.csw_vol = tot.csw_vol + st->csw_vol;
+		tot.csw_invol = tot.csw_invol + st->csw_invol;
+		tot.batches = tot.batches + st->batches;
+	}
+
+	fprintf(fp, "{\n  \"program\": ");
+	json_str(fp, prog);
+	fprintf(fp, ",\n  \"pid\": %ld,\n  \"threads\": %d,\n"
+		"  \"active_threads\": %d,\n  \"elapsed_secs\": %.3f,\n"
+		"  \"totals\": {", (long)stats_hdr->pid, nthreads,
+		ATOMIC_READ(thr_active), secs);
+	json_counters(fp, &tot);
+	/* the whole process's, which counts threads that have exited too */
+	memset(&ru, 0, sizeof(ru));
+	(void)getrusage(RUSAGE_SELF, &ru);
+	fprintf(fp, "},\n  \"context_switches\": {\"voluntary\": %ld, "
+		"\"involuntary\": %ld, \"per_dir\": %.3f}", ru.ru_nvcsw, ru.ru_nivcsw,
+		tot.dirs_scanned ? (double)(ru.ru_nvcsw + ru.ru_nivcsw) /
+		(double)tot.dirs_scanned : 0.0);
+	fprintf(fp, ",\n  \"fs_profiles\": ");
+	fs_profile_json(fp);
+	fprintf(fp, ",\n  \"jobs\": [");
+	pthread_mutex_lock(&jobs_lock);
+	for (job = job_list; job; job = job->next) {
+		if (job->state == JOB_RUNNING) {
+			state = "running";
+		} else {
+			state = (job->state == JOB_DONE) ? "done" : "failed";
+		}
+		fprintf(fp, "%s\n    {\"id\": %lu, \"path\": ",
+			(job == job_list) ? "" : ",", job->job_id);
+		json_str(fp, job->path);
+		fprintf(fp, ", \"fs\": \"%s\", \"state\": \"%s\", "
+			"\"files_chowned\": %lu, \"dirs_chowned\": %lu, \"errors\": %u, "
+			"\"errno\": %d, ", job->fs_name ? job->fs_name : "", state,
+			job->files_chowned, job->dirs_chowned, job->errors, job->err);
+		link_json(fp, job);
+		fprintf(fp, "}");
+	}
+	pthread_mutex_unlock(&jobs_lock);
+	fprintf(fp, "\n  ],\n  \"per_thread\": [");
+	for (t = 0; t < stats_hdr->nthr; t++) {
+		fprintf(fp, "%s\n    {\"thread\": %u, \"cpu\": %d, \"node\": %d, ",
+			t ? "," : "", t, threads[t].cpu, threads[t].node);
+		json_counters(fp, &thr_stats[t]);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+
+	if (fp == stdout) {
+		fflush(fp);
+	} else {
+		fclose(fp);
+	}
+}
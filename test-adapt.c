@@ -0,0 +1,92 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * runs ./mchown on trees where stat'ing first does and doesn't pay, to
+ * see the adaptive mode switch between stat-first and blind.  on a tree
+ * where every file needs changing it has to go blind, and take well under
+ * the syscalls --always-stat does.  on one where nothing needs changing
+ * it must not change anything.  and in a directory of wrong files with
+ * subdirectories full of right ones, the subdirectories start out blind,
+ * and the probes have to turn them back to stat'ing before they've
+ * chowned much that was already right.  needs root, see test.h
+ */
+#define _GNU_SOURCE
+#include "test.h"
+
+#define NFILES 5000
+#define NW 3000
+#define NSUBS 20
+#define NSUB 200
+
+static char top[4096];
+static char json[4096];
+
+
+ int
+main(void)
+{
+	const char *stat_args[] = {"-n", "4", "--always-stat", "--json", json,
+		NULL};
+	const char *adapt_args[] = {"-n", "4", "--json", json, NULL};
+	char dir[4200];
+	long stat_calls;
+	long n;
+	uid_t u;
+	gid_t g;
+	int i;
+
+	if (!test_owner(&u, &g)) {
+		printf("skipped adapt, it has to be run as root\n");
+		return 0;
+	}
+	test_path(top, sizeof(top), "adapt");
+	test_path(json, sizeof(json), "adapt.json");
+	if (mk_files(top, "f", NFILES, 0, 0)) {
+		rm_tree(top);
+		return 1;
+	}
+
+	/* all wrong, twice, each time to somebody new */
+	CHECK(run_mchown(stat_args, top, u, g) == 0);
+	CHECK(wrong_owners(top, u, g) == 0);
+	CHECK(json_total(json, "files_changed") == NFILES);
+	stat_calls = json_total(json, "syscalls");
+	CHECK(stat_calls >= 2 * NFILES);
+	CHECK(run_mchown(adapt_args, top, u + 1, g + 1) == 0);
+	CHECK(wrong_owners(top, u + 1, g + 1) == 0);
+	CHECK(json_total(json, "files_changed") == NFILES);
+	n = json_total(json, "syscalls");
+	CHECK((n >= NFILES) && (n * 4 < stat_calls * 3));
+
+	/* all right */
+	CHECK(run_mchown(adapt_args, top, u + 1, g + 1) == 0);
+	CHECK(wrong_owners(top, u + 1, g + 1) == 0);
+	CHECK(json_total(json, "files_changed") == 0);
+	rm_tree(top);
+
+	/* wrong files around subdirectories of right ones */
+	snprintf(dir, sizeof(dir), "%s", top);
+	if (mk_files(dir, "w", NW, 0, 0)) {
+		rm_tree(top);
+		return 1;
+	}
+	for (i = 0; i < NSUBS; i++) {
+		snprintf(dir, sizeof(dir), "%s/d%d", top, i);
+		if (mk_files(dir, "r", NSUB, u + 2, g + 2)) {
+			rm_tree(top);
+			return 1;
+		}
+		(void)chown(dir, u + 2, g + 2);
+	}
+	CHECK(run_mchown(adapt_args, top, u + 2, g + 2) == 0);
+	CHECK(wrong_owners(top, u + 2, g + 2) == 0);
+	n = json_total(json, "files_changed");
+	CHECK((n >= NW) && (n < NW + NSUBS * NSUB / 2));
+
+	rm_tree(top);
+	unlink(json);
+
+	return test_done("adapt");
+}
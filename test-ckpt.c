@@ -0,0 +1,175 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * checks the checkpoint file: that a frontier written by ck_write comes
+ * back the same from ck_read, paths with newlines and backslashes in them
+ * too, and that one for some other path or owner, or one that was cut
+ * short, is turned down, and that what --resume couldn't get to stays in
+ * it.  also the paths a dir_job stands for, and the order ck_walk sorts a
+ * frontier into.
+ *
+ * ckpt.c is included, for its statics, and what it uses from the rest of
+ * mchown is stubbed out by test.h.  none of what would queue anything gets
+ * called from here.
+ */
+#include "ckpt.c"
+#include "test.h"
+
+
+ static struct dnode *
+mk_dnode(struct dnode *parent, const char *name)
+{
+	struct dnode *dn;
+
+	dn = calloc(1, sizeof(struct dnode) + strlen(name) + 1);
+	dn->parent = parent;
+	strcpy(dn->name, name);
+
+	return dn;
+}
+
+
+/*
+ * write the file with ck_write, then chop off its last cut bytes, and
+ * read it back for job
+ */
+ static int
+write_read(char **list, size_t n, size_t cut, struct job_info *job,
+	char ***rlist, size_t *rn)
+{
+	FILE *fp;
+	long len;
+
+	CHECK(ck_write("running", list, n) == 0);
+	if (cut) {
+		fp = fopen(ck_file, "r+");
+		fseek(fp, 0, SEEK_END);
+		len = ftell(fp);
+		fclose(fp);
+		CHECK(truncate(ck_file, len - (long)cut) == 0);
+	}
+	*rlist = NULL;
+	*rn = 0;
+
+	return ck_read(job, rlist, rn);
+}
+
+
+ int
+main(void)
+{
+	static char paths[][24] = {"/top/a", "/top/b/c", "/top/new\nline",
+		"/top/back\\slash", "/top/\\n", "/top/sp ace/"};
+	static char order[][8] = {"/t/a-b", "/t/a/c", "/t", "/t/a", "/t/a/b"};
+	static char sorted[][8] = {"/t", "/t/a", "/t/a/b", "/t/a/c", "/t/a-b"};
+	static char top_path[] = "/top";
+	static char other_path[] = "/other";
+	static char c_name[] = "c";
+	char *list[sizeof(paths) / sizeof(paths[0])];
+	char *olist[sizeof(order) / sizeof(order[0])];
+	char name[64];
+	char **rlist;
+	char *buf;
+	size_t sz;
+	size_t n;
+	size_t rn;
+	size_t i;
+	struct job_info wjob;       /* the one the file's written for */
+	struct job_info job;        /* and the one it's read for */
+	struct creds cred;
+	struct dnode *top;
+	struct dnode *a;
+	struct dir_job dj;
+	struct name_batch nb;
+
+	test_path(name, sizeof(name), "ckpt");
+	ck_file = name;
+	/* stderr is where ckpt.c says what's wrong, on purpose here */
+	if (test_quiet()) {
+		return 1;
+	}
+	n = sizeof(paths) / sizeof(paths[0]);
+	for (i = 0; i < n; i++) {
+		list[i] = paths[i];
+	}
+	memset(&wjob, 0, sizeof(wjob));
+	wjob.path = top_path;
+	ck_job = &wjob;
+	ck_uid = 1234;
+	ck_gid = 5678;
+	job = wjob;
+	cred.u = 1234;
+	cred.g = 5678;
+	job.ucred = &cred;
+
+	/* round trip */
+	CHECK(write_read(list, n, 0, &job, &rlist, &rn) == 0);
+	CHECK(rn == n);
+	for (i = 0; (i < n) && (i < rn); i++) {
+		CHECK(strcmp(list[i], rlist[i]) == 0);
+	}
+	ck_list_free(rlist, rn);
+
+	/* an empty frontier is still a good one */
+	CHECK(write_read(list, 0, 0, &job, &rlist, &rn) == 0);
+	CHECK(rn == 0);
+	ck_list_free(rlist, rn);
+
+	/* a frontier that isn't this job's */
+	job.path = other_path;
+	CHECK(write_read(list, n, 0, &job, &rlist, &rn) == -1);
+	CHECK((rlist == NULL) && (rn == 0));
+	job.path = top_path;
+	cred.u = 1;
+	CHECK(write_read(list, n, 0, &job, &rlist, &rn) == -1);
+	cred.u = 1234;
+	cred.g = 1;
+	CHECK(write_read(list, n, 0, &job, &rlist, &rn) == -1);
+	cred.g = 5678;
+
+	/* cut short, without its end line, or with part of it */
+	CHECK(write_read(list, n, strlen("end 6\n"), &job, &rlist, &rn) == -1);
+	CHECK(write_read(list, n, 2, &job, &rlist, &rn) == -1);
+	CHECK(write_read(list, n, strlen("end 6\n") + 3, &job, &rlist, &rn) ==
+		-1);
+
+	/* what --resume couldn't get to goes in every one written after */
+	ck_keep(&wjob, "/top/a/b/c", strlen("/top/a/b"), EACCES);
+	CHECK((wjob.errors == 1) && (wjob.err == EACCES));
+	CHECK(write_read(list, 2, 0, &job, &rlist, &rn) == 0);
+	CHECK((rn == 3) && (strcmp(rlist[2], "/top/a/b") == 0));
+	ck_list_free(rlist, rn);
+	unlink(ck_file);
+
+	/* the paths dir_jobs stand for, a name batch's is its directory's */
+	top = mk_dnode(NULL, "/top");
+	a = mk_dnode(top, "a");
+	buf = NULL;
+	sz = 0;
+	CHECK(!strcmp(ck_path_of(&buf, &sz, NULL, "/top"), "/top"));
+	CHECK(!strcmp(ck_path_of(&buf, &sz, a, "b"), "/top/a/b"));
+	TZERO_DJ(&dj);
+	dj.parent = a;
+	dj.name = c_name;
+	CHECK(!strcmp(ck_path_dj(&buf, &sz, &dj), "/top/a/c"));
+	dj.name = NULL;
+	dj.nb = &nb;
+	CHECK(!strcmp(ck_path_dj(&buf, &sz, &dj), "/top/a"));
+	free(buf);
+	free(a);
+	free(top);
+
+	/* ck_walk needs everything under a directory right after it */
+	n = sizeof(order) / sizeof(order[0]);
+	for (i = 0; i < n; i++) {
+		olist[i] = order[i];
+	}
+	qsort(olist, n, sizeof(char *), ck_cmp);
+	for (i = 0; i < n; i++) {
+		CHECK(strcmp(olist[i], sorted[i]) == 0);
+	}
+
+	return test_done("ckpt");
+}
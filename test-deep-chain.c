@@ -0,0 +1,196 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * runs ./mchown on trees too deep to recurse through: a chain of
+ * directories DEEP_LEVELS deep, which mdpf does by going round again, and
+ * a comb, the same chain with a leaf directory and a file beside each
+ * link, which with -n 1 -q 1 can't be queued and has to be recursed into
+ * until MDPF_DEPTH_MAX.  either one used to run a thread off the end of
+ * its stack.  checks that it exits 0 and that everything got chowned.
+ *
+ * the trees go in TMPDIR, or /tmp.  run it from the directory mchown was
+ * built in, see make test
+ */
+#define _GNU_SOURCE
+#include "test.h"
+
+#define DEEP_LEVELS 30000
+
+
+/*
+ * make a chain of levels directories called d under top, with a directory
+ * a and a file f beside each one for a comb.
+ * returns 0, or -1 after saying why
+ */
+ static int
+mk_chain(const char *top, int levels, int comb)
+{
+	int fd;
+	int nfd;
+	int i;
+
+	if (mkdir(top, 0755)) {
+		FERR("mkdir '%s' errno %d", top, errno);
+		return -1;
+	}
+	fd = open(top, O_RDONLY | O_DIRECTORY);
+	for (i = 0; (fd >= 0) && (i < levels); i++) {
+		if (comb) {
+			if (mkdirat(fd, "a", 0755)) {
+				break;
+			}
+			nfd = openat(fd, "f", O_CREAT | O_WRONLY, 0644);
+			if (nfd < 0) {
+				break;
+			}
+			close(nfd);
+		}
+		if (mkdirat(fd, "d", 0755)) {
+			break;
+		}
+		nfd = openat(fd, "d", O_RDONLY | O_DIRECTORY);
+		close(fd);
+		fd = nfd;
+	}
+	if ((fd < 0) || (i < levels)) {
+		FERR("making '%s' failed at level %d errno %d", top, i, errno);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
+
+
+/*
+ * count what's in the tree made by mk_chain that isn't owned by u:g.  it's
+ * too deep for test.h's wrong_owners, which recurses
+ */
+ static int
+chain_wrong(const char *top, int levels, int comb, uid_t u, gid_t g)
+{
+	struct stat st;
+	int fd;
+	int nfd;
+	int wrong;
+	int i;
+
+	wrong = 0;
+	fd = open(top, O_RDONLY | O_DIRECTORY);
+	if ((fd < 0) || fstat(fd, &st)) {
+		return -1;
+	}
+	wrong = wrong + ((st.st_uid != u) || (st.st_gid != g));
+	for (i = 0; i < levels; i++) {
+		if (comb) {
+			if (fstatat(fd, "a", &st, AT_SYMLINK_NOFOLLOW) == 0) {
+				wrong = wrong + ((st.st_uid != u) || (st.st_gid != g));
+			}
+			if (fstatat(fd, "f", &st, AT_SYMLINK_NOFOLLOW) == 0) {
+				wrong = wrong + ((st.st_uid != u) || (st.st_gid != g));
+			}
+		}
+		nfd = openat(fd, "d", O_RDONLY | O_DIRECTORY);
+		close(fd);
+		fd = nfd;
+		if ((fd < 0) || fstat(fd, &st)) {
+			return -1;
+		}
+		wrong = wrong + ((st.st_uid != u) || (st.st_gid != g));
+	}
+	close(fd);
+
+	return wrong;
+}
+
+
+/*
+ * take the tree down a level at a time from the top, by moving d/d up to
+ * where d was, so it's never more than one directory deep to get at
+ */
+ static void
+rm_chain(const char *top)
+{
+	int fd;
+	int dfd;
+
+	fd = open(top, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return;
+	}
+	for (;;) {
+		dfd = openat(fd, "d", O_RDONLY | O_DIRECTORY);
+		if (dfd < 0) {
+			break;
+		}
+		(void)unlinkat(dfd, "a", AT_REMOVEDIR);
+		(void)unlinkat(dfd, "f", 0);
+		close(dfd);
+		if (renameat(fd, "d/d", fd, "n")) {
+			(void)unlinkat(fd, "d", AT_REMOVEDIR);
+			break;
+		}
+		(void)unlinkat(fd, "d", AT_REMOVEDIR);
+		(void)renameat(fd, "n", fd, "d");
+	}
+	(void)unlinkat(fd, "a", AT_REMOVEDIR);
+	(void)unlinkat(fd, "f", 0);
+	close(fd);
+	(void)rmdir(top);
+}
+
+
+/*
+ * make the tree, chown it, and check it.
+ * returns 0 if it all went right
+ */
+ static int
+one_test(const char *name, const char **args, int comb)
+{
+	char top[4096];
+	uid_t u;
+	gid_t g;
+	int rval;
+	int wrong;
+
+	test_path(top, sizeof(top), name);
+	(void)test_owner(&u, &g);
+
+	if (mk_chain(top, DEEP_LEVELS, comb)) {
+		rm_chain(top);
+		return 1;
+	}
+	rval = run_mchown(args, top, u, g);
+	wrong = chain_wrong(top, DEEP_LEVELS, comb, u, g);
+	rm_chain(top);
+
+	if (rval != 0) {
+		printf("FAIL %s: mchown exited %d\n", name, rval);
+		return 1;
+	}
+	if (wrong != 0) {
+		printf("FAIL %s: %d with the wrong owner\n", name, wrong);
+		return 1;
+	}
+	printf("ok %s, %d levels\n", name, DEEP_LEVELS);
+
+	return 0;
+}
+
+
+ int
+main(void)
+{
+	const char *chain_args[] = {"-n", "2", NULL};
+	const char *comb_args[] = {"-n", "1", "-q", "1", NULL};
+
+	fails = fails + one_test("chain", chain_args, 0);
+	fails = fails + one_test("comb", comb_args, 1);
+
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * checks parse_fs_profile, what --fs-profile takes, and the lookup of a
+ * profile by f_type.  fsprof.c is included, so its statics can be looked
+ * at, and the table put back the way it was between checks
+ */
+#include "fsprof.c"
+#include "test.h"
+
+static struct fs_profile saved[FS_NPROFILES];
+
+
+ static void
+reset(void)
+{
+	memcpy(fs_profiles, saved, sizeof(saved));
+	fs_forced = NULL;
+	fs_root = &fs_profiles[0];
+}
+
+
+ static struct fs_profile *
+by_name(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < FS_NPROFILES; i++) {
+		if (!strcmp(fs_profiles[i].name, name)) {
+			return &fs_profiles[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+ int
+main(void)
+{
+	const char *bad[] = {"", ",", "bogus", "ext4,dtype=2", "ext4,threads=0",
+		"ext4,threads=10001", "ext4,threads=x", "ext4,weigh=-1",
+		"ext4,foo=1", "auto,inosort", NULL};
+	char huge[256];
+	unsigned char rdonly;
+	unsigned int i;
+
+	memcpy(saved, fs_profiles, sizeof(saved));
+
+	/* the defaults the README's table gives */
+	CHECK(by_name("ext4")->ino_sort && by_name("ext4")->weigh);
+	CHECK(!by_name("nfs")->weigh && !by_name("nfs")->dont_sync);
+	CHECK(!by_name("fuse")->dtype);
+	CHECK(fs_lookup(0xEF53L) == by_name("ext4"));
+	CHECK(fs_lookup(0x6969L) == by_name("nfs"));
+	CHECK(fs_lookup(0x12345678L) == &fs_profiles[0]);
+
+	/* a name forces that one everywhere */
+	CHECK(parse_fs_profile("xfs") == 0);
+	CHECK((fs_forced == by_name("xfs")) && (fs_root == fs_forced));
+	CHECK(fs_lookup(0x6969L) == by_name("xfs"));
+	CHECK(fs_profile_fd(-1, &rdonly) == by_name("xfs"));
+	CHECK((by_name("xfs")->mounts == 1) && (rdonly == 0));
+	reset();
+
+	/* and the settings after it only change that one */
+	CHECK(parse_fs_profile("nfs,threads=800,dontsync=1,weigh=1") == 0);
+	CHECK(by_name("nfs")->thr_pct == 800);
+	CHECK(by_name("nfs")->dont_sync && by_name("nfs")->weigh);
+	CHECK(by_name("smb")->thr_pct == 400);
+	reset();
+
+	/* auto keeps the lookup, and changes all of them */
+	CHECK(parse_fs_profile("auto,inosort=1,dtype=0") == 0);
+	CHECK(fs_forced == NULL);
+	for (i = 0; i < FS_NPROFILES; i++) {
+		CHECK(fs_profiles[i].ino_sort && !fs_profiles[i].dtype);
+	}
+	CHECK(fs_lookup(0xEF53L) == by_name("ext4"));
+	reset();
+
+	/* anything it doesn't know is no good, and changes nothing */
+	for (i = 0; bad[i]; i++) {
+		if (parse_fs_profile(bad[i]) != -1) {
+			printf("FAIL: '%s' was taken\n", bad[i]);
+			fails++;
+		}
+	}
+	memset(huge, 'x', sizeof(huge) - 1);
+	huge[sizeof(huge) - 1] = '\0';
+	CHECK(parse_fs_profile(huge) == -1);
+	CHECK(fs_forced == NULL);
+	CHECK(memcmp(fs_profiles, saved, sizeof(saved)) == 0);
+
+	return test_done("fsprof");
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * checks the --map tables and --from: that a table still finds everything
+ * after growing, that an id can't be mapped two ways, what idmap_load
+ * makes of a map file, and who idmap_owner says a file should belong to.
+ * idmap.c is included, for its statics.  the ids here are all numbers, so
+ * test.h's parse_uid and parse_gid do
+ */
+#include "idmap.c"
+#include "test.h"
+
+
+/*
+ * write text to a map file and load it into a new id_map.
+ * returns what idmap_load did
+ */
+ static int
+load(const char *file, const char *text)
+{
+	FILE *fp;
+
+	if (id_map) {
+		free(id_map->u.ents);
+		free(id_map->g.ents);
+		free(id_map);
+		id_map = NULL;
+	}
+	fp = fopen(file, "w");
+	if (fp == NULL) {
+		return -2;
+	}
+	fputs(text, fp);
+	fclose(fp);
+
+	return idmap_load((char *)file);
+}
+
+
+ int
+main(void)
+{
+	static char from_u[] = "100:";
+	static char from_g[] = ":200";
+	static char from_bad[] = "x:200";
+	struct id_tbl t;
+	struct stat st;
+	char file[64];
+	uid_t u;
+	gid_t g;
+	uint32_t i;
+	int bad;
+
+	/* stderr is where idmap.c says what's wrong, on purpose here */
+	if (test_quiet()) {
+		return 1;
+	}
+
+	/* a table that's grown many times still has everything in it */
+	memset(&t, 0, sizeof(t));
+	CHECK(idmap_get(&t, 7) == 7);
+	bad = 0;
+	for (i = 0; i < 5000; i++) {
+		bad = bad + (idmap_put(&t, i * 3 + 1, i + 100000) != 0);
+	}
+	CHECK(bad == 0);
+	CHECK((t.n == 5000) && (t.mask + 1 >= 2 * t.n));
+	bad = 0;
+	for (i = 0; i < 5000; i++) {
+		bad = bad + (idmap_get(&t, i * 3 + 1) != i + 100000);
+		bad = bad + (idmap_get(&t, i * 3 + 2) != i * 3 + 2);
+	}
+	CHECK(bad == 0);
+
+	/* the same mapping again is fine, a different one isn't */
+	CHECK(idmap_put(&t, 1, 100000) == 0);
+	CHECK(idmap_put(&t, 1, 5) == EEXIST);
+	CHECK(idmap_get(&t, 1) == 100000);
+	CHECK(t.n == 5000);
+	free(t.ents);
+
+	/* map files */
+	test_path(file, sizeof(file), "idmap");
+	CHECK(load(file, "# old new\n\nuser 1000 2000\n  group 10 20 # x\n"
+		"user 1001 2001\nuser 1000 2000\n") == 0);
+	CHECK(idmap_remap() && (id_map->u.n == 2) && (id_map->g.n == 1));
+	st.st_uid = 1000;
+	st.st_gid = 10;
+	u = 1;
+	g = 1;
+	CHECK(idmap_owner(id_map, &st, &u, &g) == 0);
+	CHECK((u == 2000) && (g == 20));
+	st.st_uid = 5;
+	st.st_gid = 6;
+	CHECK(idmap_owner(id_map, &st, &u, &g) == 0);
+	CHECK((u == 5) && (g == 6));
+
+	CHECK(load(file, "user 1000 2000\nuser 1000 3000\n") == -1);
+	CHECK(load(file, "user 1000\n") == -1);
+	CHECK(load(file, "owner 1 2\n") == -1);
+	CHECK(load(file, "group x 2\n") == -1);
+	CHECK(load(file, "user 1 4294967295\n") == -1);
+	unlink(file);
+
+	/* --from by itself just filters, the owner's the job's */
+	free(id_map->u.ents);
+	free(id_map->g.ents);
+	free(id_map);
+	id_map = NULL;
+	CHECK(idmap_from(from_u) == 0);
+	CHECK(!idmap_remap());
+	CHECK(!strcmp(from_u, "100:"));
+	st.st_uid = 100;
+	st.st_gid = 1;
+	u = 7;
+	g = 8;
+	CHECK(idmap_owner(id_map, &st, &u, &g) == 0);
+	CHECK((u == 7) && (g == 8));
+	st.st_uid = 101;
+	CHECK(idmap_owner(id_map, &st, &u, &g) == -1);
+	CHECK(idmap_from(from_g) == 0);
+	st.st_uid = 100;
+	st.st_gid = 200;
+	CHECK(idmap_owner(id_map, &st, &u, &g) == 0);
+	st.st_gid = 1;
+	CHECK(idmap_owner(id_map, &st, &u, &g) == -1);
+	CHECK(idmap_from(from_bad) == -1);
+
+	return test_done("idmap");
+}
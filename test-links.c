@@ -0,0 +1,115 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * runs ./mchown on a tree full of hard links: files in orig, with NLINKS
+ * more links to each of them in l0 on up, and some files in plain with
+ * just the one, with a few threads going at it.  with --always-stat every
+ * link gets looked at, so each inode has to be chowned exactly once, by
+ * whichever thread got to one of its links first, and every other link
+ * skipped, the ones two threads were on at the same time too.  with
+ * --link-mem 0 there's no set to skip anything with, and blind there's
+ * nothing to say which files have links, and either way it all still has
+ * to get chowned.  needs root, see test.h
+ */
+#define _GNU_SOURCE
+#include "test.h"
+
+#define NFILES 500
+#define NLINKS 3
+#define NPLAIN 100
+
+static char top[4096];
+static char json[4096];
+
+
+/*
+ * make the tree, owned by root.  returns 0, or -1 after saying why
+ */
+ static int
+mk_tree(void)
+{
+	char dir[4200];
+	char from[4300];
+	char to[4300];
+	int i;
+	int l;
+
+	if (mkdir(top, 0755)) {
+		printf("FAIL: mkdir '%s' errno %d\n", top, errno);
+		return -1;
+	}
+	snprintf(dir, sizeof(dir), "%s/orig", top);
+	if (mk_files(dir, "f", NFILES, 0, 0)) {
+		return -1;
+	}
+	snprintf(dir, sizeof(dir), "%s/plain", top);
+	if (mk_files(dir, "p", NPLAIN, 0, 0)) {
+		return -1;
+	}
+	for (l = 0; l < NLINKS; l++) {
+		snprintf(dir, sizeof(dir), "%s/l%d", top, l);
+		if (mkdir(dir, 0755)) {
+			printf("FAIL: mkdir '%s' errno %d\n", dir, errno);
+			return -1;
+		}
+		for (i = 0; i < NFILES; i++) {
+			snprintf(from, sizeof(from), "%s/orig/f%d", top, i);
+			snprintf(to, sizeof(to), "%s/l%d/f%d", top, l, i);
+			if (link(from, to)) {
+				printf("FAIL: link '%s' errno %d\n", to, errno);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+ int
+main(void)
+{
+	const char *stat_args[] = {"-n", "4", "--always-stat", "--json", json,
+		NULL};
+	const char *noset_args[] = {"-n", "4", "--always-stat", "--link-mem",
+		"0", "--json", json, NULL};
+	const char *blind_args[] = {"-n", "4", "--never-stat", "--json", json,
+		NULL};
+	uid_t u;
+	gid_t g;
+
+	if (!test_owner(&u, &g)) {
+		printf("skipped links, it has to be run as root\n");
+		return 0;
+	}
+	test_path(top, sizeof(top), "links");
+	test_path(json, sizeof(json), "links.json");
+	if (mk_tree()) {
+		rm_tree(top);
+		return 1;
+	}
+
+	/* each inode once */
+	CHECK(run_mchown(stat_args, top, u, g) == 0);
+	CHECK(wrong_owners(top, u, g) == 0);
+	CHECK(json_total(json, "files_changed") == NFILES + NPLAIN);
+	CHECK(json_total(json, "hardlinks_skipped") == NFILES * NLINKS);
+
+	/* no set */
+	CHECK(run_mchown(noset_args, top, u + 1, g + 1) == 0);
+	CHECK(wrong_owners(top, u + 1, g + 1) == 0);
+	CHECK(json_total(json, "hardlinks_skipped") == 0);
+
+	/* blind, every link gets chowned */
+	CHECK(run_mchown(blind_args, top, u + 2, g + 2) == 0);
+	CHECK(wrong_owners(top, u + 2, g + 2) == 0);
+	CHECK(json_total(json, "files_changed") ==
+		NFILES * (NLINKS + 1) + NPLAIN);
+
+	rm_tree(top);
+	unlink(json);
+
+	return test_done("links");
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * checks what gets pruned: --exclude globs on names anywhere, and on the
+ * paths of directories, under the top or from /, the patterns from an
+ * --exclude-from file, and --one-file-system and --skip-read-only.
+ * prune.c is included, for its statics.  the dnodes here are made with
+ * their whole path as their name, for test.h's dn_path
+ */
+#include "prune.c"
+#include "test.h"
+
+
+ static struct dnode *
+mk_dnode(struct job_info *job, struct dnode *parent, const char *path,
+	dev_t dev)
+{
+	struct dnode *dn;
+
+	dn = calloc(1, sizeof(struct dnode) + strlen(path) + 1);
+	dn->parent = parent;
+	dn->job = job;
+	dn->dev = dev;
+	strcpy(dn->name, path);
+
+	return dn;
+}
+
+
+ int
+main(void)
+{
+	static char top_path[] = "/data/top";
+	static char n_snap[] = ".snapshot";
+	static char n_obj[] = "x.o";
+	static char n_src[] = "x.c";
+	static char n_build[] = "build";
+	static char n_c[] = "c";
+	static char n_y[] = "y";
+	static char n_keep[] = "keep";
+	struct job_info job;
+	struct dnode *top;
+	struct dnode *ax;
+	struct dnode *x;
+	struct dnode *sub;
+	struct stat st;
+	FILE *fp;
+	char file[64];
+
+	/* the read-only top gets a WARN, on purpose here */
+	if (test_quiet()) {
+		return 1;
+	}
+	memset(&job, 0, sizeof(job));
+	job.path = top_path;
+	top = mk_dnode(&job, NULL, "/data/top", 1);
+	ax = mk_dnode(&job, top, "/data/top/a/x", 1);
+	x = mk_dnode(&job, top, "/data/top/x", 1);
+
+	/* nothing to prune, nothing is */
+	CHECK(!prune_on);
+	CHECK(prune_entry(top, n_snap, DT_DIR, NULL) == 0);
+
+	CHECK(prune_add("*.o") == 0);
+	CHECK(prune_add(".snapshot") == 0);
+	CHECK(prune_add("build//") == 0);     /* dir/ is the same as dir */
+	CHECK(prune_add("a/*/c") == 0);
+	CHECK(prune_add("/data/top/x/*") == 0);
+	CHECK(prune_on && (prune_nnames == 3) && (prune_npaths == 2));
+
+	/* names, anywhere, files or directories */
+	CHECK(prune_entry(top, n_obj, DT_REG, NULL) == 1);
+	CHECK(prune_entry(ax, n_obj, DT_REG, NULL) == 1);
+	CHECK(prune_entry(top, n_src, DT_REG, NULL) == 0);
+	CHECK(prune_entry(ax, n_snap, DT_DIR, NULL) == 1);
+	CHECK(prune_entry(ax, n_build, DT_DIR, NULL) == 1);
+	CHECK(prune_entry(top, n_build, DT_REG, NULL) == 1);
+
+	/* paths, only of directories: under the top, or from / */
+	CHECK(prune_entry(ax, n_c, DT_DIR, NULL) == 1);
+	CHECK(prune_entry(ax, n_c, DT_REG, NULL) == 0);
+	CHECK(prune_entry(top, n_c, DT_DIR, NULL) == 0);
+	CHECK(prune_entry(x, n_y, DT_DIR, NULL) == 1);
+	CHECK(prune_entry(ax, n_y, DT_DIR, NULL) == 0);
+	/* a * doesn't match across a / */
+	sub = mk_dnode(&job, ax, "/data/top/a/x/z", 1);
+	CHECK(prune_entry(sub, n_c, DT_DIR, NULL) == 0);
+	free(sub);
+
+	/* --one-file-system, before it's opened when it's been stat'd */
+	memset(&st, 0, sizeof(st));
+	st.st_dev = 2;
+	CHECK(prune_entry(top, n_keep, DT_DIR, &st) == 0);
+	prune_xdev = 1;
+	CHECK(prune_entry(top, n_keep, DT_DIR, &st) == 1);
+	CHECK(prune_entry(top, n_keep, DT_REG, &st) == 0);
+	st.st_dev = 1;
+	CHECK(prune_entry(top, n_keep, DT_DIR, &st) == 0);
+
+	/* and after it's opened, which is the only way for read-only */
+	sub = mk_dnode(&job, top, "/data/top/keep", 2);
+	st.st_dev = 2;
+	CHECK(prune_dir(sub, &st) == 1);
+	CHECK(prune_dir(top, &st) == 0);      /* the top has no parent */
+	prune_xdev = 0;
+	CHECK(prune_dir(sub, &st) == 0);
+	sub->rdonly = 1;
+	CHECK(prune_dir(sub, &st) == 0);
+	prune_ro = 1;
+	CHECK(prune_dir(sub, &st) == 1);
+	top->rdonly = 1;
+	CHECK(prune_dir(top, &st) == 1);
+	free(sub);
+
+	/* --exclude-from, skipping blank lines and comments */
+	test_path(file, sizeof(file), "prune");
+	fp = fopen(file, "w");
+	CHECK(fp != NULL);
+	if (fp) {
+		fputs("# caches\n\n  \n*.tmp  \nvar/cache\n", fp);
+		fclose(fp);
+		CHECK(prune_add_file(file) == 0);
+		CHECK((prune_nnames == 4) && (prune_npaths == 3));
+		CHECK(!strcmp(prune_names[3], "*.tmp"));
+		CHECK(!strcmp(prune_paths[2], "var/cache"));
+		unlink(file);
+	}
+	CHECK(prune_add_file(file) == -1);
+
+	free(x);
+	free(ax);
+	free(top);
+
+	return test_done("prune");
+}
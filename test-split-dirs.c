@@ -0,0 +1,115 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * runs ./mchown with --split-dirs on a tree with one huge directory in it,
+ * with some subdirectories of its own, and a small one beside it.  the
+ * huge one's files get handed out in name batches, to be done by whoever
+ * steals them, so this checks every file gets chowned exactly once, going
+ * by the --json totals: stat'ing first, blind, through io_uring if there
+ * is one, and with -q 1, where the batches can't be queued and get done
+ * on the spot.  and that with --split-dirs 0 there are no batches.  needs
+ * root, see test.h
+ */
+#define _GNU_SOURCE
+#include "test.h"
+
+#define NBIG 20000
+#define NSUBS 5
+#define NSUB 50
+#define NSMALL 100
+#define NALL (NBIG + NSUBS * NSUB + NSMALL)
+
+static char top[4096];
+static char json[4096];
+
+
+/*
+ * make the tree, owned by root.  returns 0, or -1 after saying why
+ */
+ static int
+mk_tree(void)
+{
+	char dir[4200];
+	int i;
+
+	if (mkdir(top, 0755)) {
+		printf("FAIL: mkdir '%s' errno %d\n", top, errno);
+		return -1;
+	}
+	snprintf(dir, sizeof(dir), "%s/big", top);
+	if (mk_files(dir, "f", NBIG, 0, 0)) {
+		return -1;
+	}
+	for (i = 0; i < NSUBS; i++) {
+		snprintf(dir, sizeof(dir), "%s/big/sub%d", top, i);
+		if (mk_files(dir, "s", NSUB, 0, 0)) {
+			return -1;
+		}
+	}
+	snprintf(dir, sizeof(dir), "%s/small", top);
+
+	return mk_files(dir, "f", NSMALL, 0, 0);
+}
+
+
+/*
+ * chown the tree to a new owner with args, and check it all got done once
+ */
+ static void
+one_run(const char **args, uid_t u, gid_t g, int batched)
+{
+	CHECK(run_mchown(args, top, u, g) == 0);
+	CHECK(wrong_owners(top, u, g) == 0);
+	CHECK(json_total(json, "files_changed") == NALL);
+	CHECK(json_total(json, "dirs_changed") == NSUBS + 3);
+	if (batched) {
+		CHECK(json_total(json, "batches") > 0);
+	} else {
+		CHECK(json_total(json, "batches") == 0);
+	}
+}
+
+
+ int
+main(void)
+{
+	const char *stat_args[] = {"-n", "4", "--split-dirs", "64",
+		"--always-stat", "--json", json, NULL};
+	const char *blind_args[] = {"-n", "4", "--split-dirs", "64",
+		"--never-stat", "--json", json, NULL};
+	const char *uring_args[] = {"-n", "4", "-u", "--split-dirs", "64",
+		"--json", json, NULL};
+	const char *nak_args[] = {"-n", "4", "-q", "1", "--split-dirs", "64",
+		"--json", json, NULL};
+	const char *whole_args[] = {"-n", "4", "--split-dirs", "0", "--json",
+		json, NULL};
+	uid_t u;
+	gid_t g;
+
+	if (!test_owner(&u, &g)) {
+		printf("skipped split-dirs, it has to be run as root\n");
+		return 0;
+	}
+	test_path(top, sizeof(top), "split-dirs");
+	test_path(json, sizeof(json), "split-dirs.json");
+	if (mk_tree()) {
+		rm_tree(top);
+		return 1;
+	}
+
+	one_run(stat_args, u, g, 1);
+	one_run(blind_args, u + 1, g + 1, 1);
+	one_run(uring_args, u + 2, g + 2, 1);
+	/* -q 1 can still queue one batch at a time, so there may be some */
+	CHECK(run_mchown(nak_args, top, u + 3, g + 3) == 0);
+	CHECK(wrong_owners(top, u + 3, g + 3) == 0);
+	CHECK(json_total(json, "files_changed") == NALL);
+	one_run(whole_args, u + 4, g + 4, 0);
+
+	rm_tree(top);
+	unlink(json);
+
+	return test_done("split-dirs");
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * what the test-*.c programs have in common.
+ *
+ * a unit test #includes the .c file it's testing, so it can get at the
+ * statics, and then this, which stubs out the rest of mchown for it.  the
+ * stubs do as little as they can; a test that needs one of them to do more
+ * says so where it calls it.
+ *
+ * a tree test makes a tree in TMPDIR, or /tmp, runs ./mchown on it with
+ * run_mchown, and looks at the owners and at the --json summary.  chowning
+ * to anybody else takes root, so a tree test that needs to see files
+ * change owner says it's skipped when it isn't.
+ *
+ * CHECK says what failed on stdout.  stderr is where the code being tested
+ * says what's wrong, which the unit tests make it do on purpose, so they
+ * send it to /dev/null with test_quiet.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifndef JOB_RUNNING
+# include <pthread.h>
+# include "mchown.h"
+#endif
+
+#define TEST_ID 4242           /* the owner for a tree test, as root */
+
+static int fails;
+
+#define CHECK(C) do { \
+	if (!(C)) { \
+		printf("FAIL line %d: %s\n", __LINE__, #C); \
+		fails++; \
+	} \
+} while (0)
+
+
+/*
+ * the rest of mchown, for the unit tests.  the ids are all numbers, so
+ * parse_uid and parse_gid don't look names up, and a dnode's name is its
+ * whole path, for dn_path
+ */
+__thread struct thread_pool *my_tpool;
+struct thread_pool *threads;
+unsigned int dj_queued;
+unsigned int dj_outstanding;
+unsigned int dir_fds;
+unsigned int fd_budget;
+int shutdown_time;
+int nthreads;
+int watching;
+int prune_ro;
+
+int dequeue(struct dir_job *dj __attribute__ ((unused))) { return 0; }
+void dj_drop(struct dir_job *dj __attribute__ ((unused))) { }
+void dn_done(struct dnode *dn __attribute__ ((unused))) { }
+void dn_hold_child(struct dnode *dn __attribute__ ((unused))) { }
+struct dnode *dn_open(struct dir_job *dj __attribute__ ((unused)))
+	{ return NULL; }
+char *dn_path(struct dnode *dn) { return dn->name; }
+void dn_set_fs(struct dnode *dn __attribute__ ((unused)),
+	dev_t dev __attribute__ ((unused))) { }
+int dq_push(struct dj_deque *dq __attribute__ ((unused)),
+	struct dir_job *dj __attribute__ ((unused))) { return 0; }
+void job_err(struct job_info *job, int err)
+	{ job->errors++; job->err = job->err ? job->err : err; }
+void job_fail(struct job_info *job, int err)
+	{ job_err(job, err); job->failed = 1; }
+void wake_idle(int all __attribute__ ((unused))) { }
+char *slab_strdup(const char *s) { return strdup(s); }
+void slab_free_str(char *s) { free(s); }
+
+
+ static int
+test_id(char *str, unsigned long *v)
+{
+	char *end;
+
+	*v = strtoul(str, &end, 10);
+
+	return ((*str != '\0') && (*end == '\0')) ? 0 : -1;
+}
+
+
+ int
+parse_uid(char *str, uid_t *uid)
+{
+	unsigned long v;
+
+	if (test_id(str, &v)) {
+		return -1;
+	}
+	*uid = (uid_t)v;
+
+	return 0;
+}
+
+
+ int
+parse_gid(char *str, gid_t *gid)
+{
+	unsigned long v;
+
+	if (test_id(str, &v)) {
+		return -1;
+	}
+	*gid = (gid_t)v;
+
+	return 0;
+}
+
+
+/*
+ * send stderr to /dev/null.  returns 0, or -1 if it couldn't be
+ */
+ int
+test_quiet(void)
+{
+	return (freopen("/dev/null", "w", stderr) == NULL) ? -1 : 0;
+}
+
+
+/*
+ * the end of a test's main.  returns what it should exit with
+ */
+ int
+test_done(const char *name)
+{
+	if (fails == 0) {
+		printf("ok %s\n", name);
+	}
+
+	return fails ? 1 : 0;
+}
+
+
+/*
+ * put the path of a file or tree called name for this test in buf
+ */
+ void
+test_path(char *buf, size_t sz, const char *name)
+{
+	const char *tmp;
+
+	tmp = getenv("TMPDIR");
+	snprintf(buf, sz, "%s/mchown-test-%s.%d", tmp ? tmp : "/tmp", name,
+		(int)getpid());
+}
+
+
+/*
+ * the owner a tree test chowns to, somebody else if it's root, else just
+ * what the files already are.  returns 1 if it's somebody else
+ */
+ int
+test_owner(uid_t *u, gid_t *g)
+{
+	*u = geteuid() ? geteuid() : TEST_ID;
+	*g = geteuid() ? getegid() : TEST_ID;
+
+	return geteuid() == 0;
+}
+
+
+/*
+ * run ./mchown with args, and then the tree and the owner, with its one
+ * line of output thrown away.
+ * returns its exit status, or 128 + the signal that killed it
+ */
+ int
+run_mchown(const char **args, const char *top, uid_t u, gid_t g)
+{
+	const char *argv[32];
+	char uid[16];
+	char gid[16];
+	pid_t pid;
+	int status;
+	int n;
+
+	snprintf(uid, sizeof(uid), "%u", u);
+	snprintf(gid, sizeof(gid), "%u", g);
+	n = 0;
+	argv[n++] = "./mchown";
+	while (*args && (n < 28)) {
+		argv[n++] = *args++;
+	}
+	argv[n++] = top;
+	argv[n++] = uid;
+	argv[n++] = gid;
+	argv[n] = NULL;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stdout) == NULL) {
+			_exit(126);
+		}
+		execv(argv[0], (char * const *)argv);
+		_exit(127);
+	}
+	if ((pid < 0) || (waitpid(pid, &status, 0) != pid)) {
+		return -1;
+	}
+	if (WIFSIGNALED(status)) {
+		return 128 + WTERMSIG(status);
+	}
+
+	return WEXITSTATUS(status);
+}
+
+
+/*
+ * one of the totals in a --json summary.  returns it, or -1 if it isn't
+ * there
+ */
+ long
+json_total(const char *file, const char *name)
+{
+	FILE *fp;
+	char line[4096];
+	char key[64];
+	char *p;
+	long v;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	snprintf(key, sizeof(key), "\"%s\": ", name);
+	v = -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strstr(line, "\"totals\"") == NULL) {
+			continue;
+		}
+		p = strstr(line, key);
+		if (p) {
+			v = strtol(p + strlen(key), NULL, 10);
+		}
+		break;
+	}
+	fclose(fp);
+
+	return v;
+}
+
+
+/*
+ * make the directory dir, if it isn't there, with n empty files in it
+ * called prefix0 on up, owned by u:g.
+ * returns 0, or -1 after saying why
+ */
+ int
+mk_files(const char *dir, const char *prefix, int n, uid_t u, gid_t g)
+{
+	char name[NAME_MAX + 1];
+	int dfd;
+	int fd;
+	int i;
+
+	if (mkdir(dir, 0755) && (errno != EEXIST)) {
+		printf("FAIL: mkdir '%s' errno %d\n", dir, errno);
+		return -1;
+	}
+	dfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dfd < 0) {
+		printf("FAIL: open '%s' errno %d\n", dir, errno);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "%s%d", prefix, i);
+		fd = openat(dfd, name, O_CREAT | O_WRONLY, 0644);
+		if ((fd < 0) || fchown(fd, u, g)) {
+			printf("FAIL: making '%s/%s' errno %d\n", dir, name, errno);
+			if (fd >= 0) {
+				close(fd);
+			}
+			close(dfd);
+			return -1;
+		}
+		close(fd);
+	}
+	close(dfd);
+
+	return 0;
+}
+
+
+/*
+ * go through everything in the directory dfd, counting what isn't owned
+ * by u:g, and removing it too if rm.  closes dfd.
+ * returns the count, or -1 if something couldn't be looked at
+ */
+ static long
+test_walk(int dfd, uid_t u, gid_t g, int rm)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	long n;
+	long c;
+	int fd;
+
+	dir = fdopendir(dfd);
+	if (dir == NULL) {
+		close(dfd);
+		return -1;
+	}
+	n = 0;
+	while ((n >= 0) && ((de = readdir(dir)) != NULL)) {
+		if ((!strcmp(de->d_name, ".")) || (!strcmp(de->d_name, ".."))) {
+			continue;
+		}
+		if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			n = -1;
+			break;
+		}
+		n = n + ((st.st_uid != u) || (st.st_gid != g));
+		if (S_ISDIR(st.st_mode)) {
+			fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			c = (fd < 0) ? -1 : test_walk(fd, u, g, rm);
+			n = (c < 0) ? -1 : n + c;
+		}
+		if (rm) {
+			(void)unlinkat(dfd, de->d_name,
+				S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0);
+		}
+	}
+	closedir(dir);
+
+	return n;
+}
+
+
+/*
+ * count what's under top, and top, that isn't owned by u:g.
+ * returns that, or -1 if the tree couldn't be gone through
+ */
+ long
+wrong_owners(const char *top, uid_t u, gid_t g)
+{
+	struct stat st;
+	long n;
+	int fd;
+
+	fd = open(top, O_RDONLY | O_DIRECTORY);
+	if ((fd < 0) || fstat(fd, &st)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	n = test_walk(fd, u, g, 0);
+
+	return (n < 0) ? -1 : n + ((st.st_uid != u) || (st.st_gid != g));
+}
+
+
+/*
+ * take down a tree made by a tree test
+ */
+ void
+rm_tree(const char *top)
+{
+	int fd;
+
+	fd = open(top, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		(void)test_walk(fd, 0, 0, 1);
+	}
+	(void)rmdir(top);
+}
@@ -12,11 +12,51 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <linux/futex.h>
 
 #include "mchown.h"
 
 int shutdown_time;    /* used to tell the threads not to grab any more dirs */
 
+/*
+ * idle threads.  a thread that finds nothing on any deque spins a while
+ * watching dj_queued, since work often turns up a moment later when some
+ * busy thread reads its next directory, and then parks on a futex.
+ *
+ * idle_seq is an event count.  a parker reads it, counts itself in n_idle,
+ * looks at dj_queued one last time, and sleeps only if idle_seq is still
+ * what it read.  whoever publishes a dir_job bumps dj_queued before
+ * looking at n_idle, so one side or the other always sees the other, and
+ * if anyone's parked, bumps idle_seq and wakes exactly one of them.  so N
+ * new dir_jobs wake at most N threads, there's no lock on either side, and
+ * a publisher with nobody parked, the usual case when it's busy, doesn't
+ * make a syscall at all.
+ *
+ * the spin doubles each time it pays off and halves each time it doesn't,
+ * between IDLE_SPIN_MIN and IDLE_SPIN_MAX pauses.  with more pool threads
+ * than cpus, a spinner would only be keeping a working thread off its cpu,
+ * so they park straight away.
+ */
+#define IDLE_SPIN_MIN 64
+#define IDLE_SPIN_MAX (16 * 1024)
+
+#if defined(__x86_64__) || defined(__i386__)
+# define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+# define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+# define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static unsigned int idle_seq;
+static int idle_spin_max;        /* 0 if oversubscribed */
+
 struct thread_pool *threads;
 __thread struct thread_pool *my_tpool;
 
@@ -46,44 +86,297 @@ join_pool(void)
 }
 
 
+/*
+ * work-stealing deque routines.  see struct dj_deque in mchown.h.
+ * dir_jobs are copied in and out by value, so there is nothing to allocate
+ * or free per push/pop.
+ */
+ int
+dq_init(struct dj_deque *dq, unsigned int size)
+{
+	unsigned int sz;
+
+	sz = 8;
+	while (sz < size) {
+		sz = sz << 1;
+	}
+	dq->ring = calloc(sz, sizeof(struct dir_job));
+	if (dq->ring == NULL) {
+		return errno;
+	}
+	dq->size = sz;
+	dq->head = dq->tail = 0;
+	pthread_mutex_init(&dq->lock, NULL);
+
+	return 0;
+}
+
+
+/*
+ * push a dir_job onto the tail of the deque.  only the owner does this,
+ * except for mchownd handing new jobs to the main thread's deque.  that
+ * one isn't bounded by the outstanding dir_job limit, so the ring doubles
+ * when it fills up.  thieves only look at the ring with the lock held.
+ * returns 0 on success, or ENOMEM if the ring couldn't be grown
+ */
+ int
+dq_push(struct dj_deque *dq, struct dir_job *dj)
+{
+	struct dir_job *nring;
+	unsigned int x;
+
+	pthread_mutex_lock(&dq->lock);
+	if ((dq->tail - dq->head) >= dq->size) {
+		nring = calloc((size_t)dq->size * 2, sizeof(struct dir_job));
+		if (nring == NULL) {
+			pthread_mutex_unlock(&dq->lock);
+			return ENOMEM;
+		}
+		for (x = 0; x < dq->size; x++) {
+			nring[x] = dq->ring[(dq->head + x) & (dq->size - 1)];
+		}
+		free(dq->ring);
+		dq->ring = nring;
+		dq->head = 0;
+		dq->tail = dq->size;
+		dq->size = dq->size * 2;
+	}
+	dq->ring[dq->tail & (dq->size - 1)] = *dj;
+	dq->tail++;
+	pthread_mutex_unlock(&dq->lock);
+
+	return 0;
+}
+
+
+/*
+ * pop the newest dir_job off the tail of the deque.  only the owner does
+ * this.  returns 1 if a dir_job was copied into dj, 0 if the deque is empty
+ */
+ int
+dq_pop(struct dj_deque *dq, struct dir_job *dj)
+{
+	int got;
+
+	got = 0;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail != dq->head) {
+		dq->tail--;
+		*dj = dq->ring[dq->tail & (dq->size - 1)];
+		got = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return got;
+}
+
+
+/*
+ * steal the oldest dir_job off the head of someone else's deque.
+ * returns 1 if a dir_job was copied into dj, 0 if the deque is empty
+ */
+ int
+dq_steal(struct dj_deque *dq, struct dir_job *dj)
+{
+	int got;
+
+	/* don't bother taking the lock on an empty deque */
+	if (ATOMIC_READ(dq->tail) == ATOMIC_READ(dq->head)) {
+		return 0;
+	}
+	got = 0;
+	if (pthread_mutex_trylock(&dq->lock)) {
+		return 0;  /* owner or another thief is in there, move along */
+	}
+	if (dq->tail != dq->head) {
+		*dj = dq->ring[dq->head & (dq->size - 1)];
+		dq->head++;
+		got = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return got;
+}
+
+
+/*
+ * take one of job's dir_jobs out of the deque, wherever it is in there,
+ * for the fair share scheduler.  the owner takes the newest one, a thief
+ * the oldest.  the deques are short, so just slide the ones behind it up.
+ * returns 1 if a dir_job was copied into dj, else 0
+ */
+ int
+dq_take_job(struct dj_deque *dq, struct job_info *job, struct dir_job *dj,
+	int thief)
+{
+	unsigned int mask;
+	unsigned int n;
+	unsigned int x;
+	int got;
+
+	if (ATOMIC_READ(dq->tail) == ATOMIC_READ(dq->head)) {
+		return 0;
+	}
+	if (thief) {
+		if (pthread_mutex_trylock(&dq->lock)) {
+			return 0;
+		}
+	} else {
+		pthread_mutex_lock(&dq->lock);
+	}
+	got = 0;
+	mask = dq->size - 1;
+	for (n = 0; n < dq->tail - dq->head; n++) {
+		x = thief ? dq->head + n : dq->tail - 1 - n;
+		if (dq->ring[x & mask].job != job) {
+			continue;
+		}
+		*dj = dq->ring[x & mask];
+		for (; x + 1 != dq->tail; x++) {
+			dq->ring[x & mask] = dq->ring[(x + 1) & mask];
+		}
+		dq->tail--;
+		got = 1;
+		break;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return got;
+}
+
+
+/*
+ * wake up parked pool threads because there's new work, or because it's
+ * shutdown time or thr_active changed.  called by the conc thread too,
+ * which has no my_tpool.
+ * @all - wake all of them, else just one, if there's one parked
+ */
+ void
+wake_idle(int all)
+{
+	if ((!all) && (ATOMIC_READ(n_idle) == 0)) {
+		return;
+	}
+	__sync_add_and_fetch(&idle_seq, 1);
+	(void)syscall(SYS_futex, &idle_seq, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1,
+		NULL, NULL, 0);
+	if (all) {
+		pthread_mutex_lock(&idle_lock);
+		conc_unpark();
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+
+/*
+ * whether a thread with nothing to do should go look again
+ */
+#define IDLE_DONE() (ATOMIC_READ(dj_queued) || ATOMIC_READ(shutdown_time) || \
+	(my_tpool->thread_num > ATOMIC_READ(thr_active)))
+
+/*
+ * nothing on any deque, wait for there to be, spinning and then parking.
+ * see idle_seq
+ */
+ static void
+idle_wait(void)
+{
+	unsigned int seq;
+	uint64_t t;
+	int i;
+
+	for (i = 0; i < my_tpool->spin; i++) {
+		if (IDLE_DONE()) {
+			TS_ADD(spin_wins, 1);
+			if (my_tpool->spin < idle_spin_max) {
+				my_tpool->spin = my_tpool->spin * 2;
+			}
+			return;
+		}
+		CPU_RELAX();
+	}
+	if (my_tpool->spin > IDLE_SPIN_MIN) {
+		my_tpool->spin = my_tpool->spin / 2;
+	}
+
+	seq = ATOMIC_READ(idle_seq);
+	__sync_add_and_fetch(&n_idle, 1);
+	if (!IDLE_DONE()) {
+		TS_ADD(parks, 1);
+		TS_ADD(syscalls, 1);
+		t = trace_on ? trace_now() : 0;
+		(void)syscall(SYS_futex, &idle_seq, FUTEX_WAIT_PRIVATE, seq, NULL,
+			NULL, 0);
+		if (t) {
+			trace_idle(t);     /* a gap in the pool, see trace.c */
+		}
+	}
+	__sync_sub_and_fetch(&n_idle, 1);
+	stats_csw();
+}
+
+
+/*
+ * do a dir_job that came off a deque
+ */
+ void
+run_dir_job(struct dir_job *dj)
+{
+	struct job_info *job;
+	uint64_t job_id;
+
+	job = dj->job;
+	job_id = my_tpool->job_id;
+	my_tpool->job_id = dj->job_id;
+	__sync_add_and_fetch(&job->running, 1);
+	my_tpool->st->busy++;
+	if (dj->nb) {
+		nb_run(dj);             /* files of a big directory, see nb_publish */
+	} else {
+		(void)mdpf(dj);
+	}
+	my_tpool->st->busy--;
+	if (dj->name) {
+		slab_free_str(dj->name);    /* enqueue and job_submit slab_strdup it */
+	}
+	__sync_sub_and_fetch(&dj_outstanding, 1);
+	__sync_sub_and_fetch(&job->outstanding, 1);
+	/* the last look at job, it can be freed after this, see job_trim */
+	__sync_sub_and_fetch(&job->running, 1);
+	my_tpool->job_id = job_id;
+}
+
+
 /*
  * this is the function that the threads are started with.
- * it waits for dirs to appear on the work queue.
+ * it pops dirs off of its own deque, or steals them from the other
+ * threads, and sleeps when there's nothing to be had anywhere.
  */
  void *
 get_dir_from_queue(void *tpool_entry)
 {
-	struct dir_job *dir_info;
+	struct dir_job dir_info;
 
 	my_tpool = (struct thread_pool *)tpool_entry;
 
-	dir_info = NULL;
 	//pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
 	while (! shutdown_time) {
 		my_tpool->busy = 0;
 		my_tpool->job_id = 0;
-		/* acquire the lock and cv, and wait */
-		pthread_mutex_lock(&queue_lock);
-		//n_avail_threads++;
-		if (dir_info) {
-			MBUG(" freeing dir_info @ %p", dir_info);
-			dj_free(dir_info);       /* free dir_info inside the lock */
+		if (my_tpool->thread_num > ATOMIC_READ(thr_active)) {
+			conc_park();     /* more threads than --auto-threads wants */
+			continue;
 		}
-		pthread_cond_wait(&queue_cv, &queue_lock);
-		dir_info = dequeue();  /* grab a dir_job from the queue */
-		if (dir_info) {
-			my_tpool->busy = 1;
-			my_tpool->job_id = dir_info->job_id;
-		//} else { n_avail_threads--;
-		}
-		pthread_mutex_unlock(&queue_lock);
-		if (dir_info) {
-			(void)mdpf(dir_info);
-			free(dir_info->path);    /* only the enqueue/dequeue code path
-                                      * allocates path ... for now */
+		if (!ck_dequeue(&dir_info)) {
+			idle_wait();
+			continue;
 		}
+		my_tpool->busy = 1;
+		run_dir_job(&dir_info);
+		ck_working(NULL);
 	}
+	stats_csw();
 
 	pthread_exit(NULL);
 
@@ -117,6 +410,7 @@ create_pool(int npthreads)
 {
 	int tid;
 	int status;
+	pthread_attr_t attr;
 
 	/* allocate 1 extra to store info about the main process thread */
 	npthreads = npthreads + 1;
@@ -129,15 +423,43 @@ create_pool(int npthreads)
 	DBUG(" struct threads size %d bytes allocated",
 		(int)sizeof(struct thread_pool) * npthreads);
 
+	/*
+	 * the deques start out with room for a dir_job per thread, and grow
+	 * when they need to, up to dj_max in all, see enqueue()
+	 */
+	idle_spin_max = (npthreads <= sysconf(_SC_NPROCESSORS_ONLN)) ?
+		IDLE_SPIN_MAX : 0;
+	for (tid = 0; tid < npthreads; tid++) {
+		threads[tid].rseed = (unsigned int)tid * 2654435761U + 1;
+		threads[tid].spin = idle_spin_max ? IDLE_SPIN_MIN : 0;
+		threads[tid].st = &thr_stats[tid];
+		pthread_mutex_init(&threads[tid].ck_lock, NULL);
+		topo_place(tid);
+		status = dq_init(&threads[tid].dq, (unsigned int)npthreads);
+		if (status != 0) {
+			FERR("Failed to allocate deque for thread %02d.  errno=%d", tid,
+				status);
+			return status;
+		}
+	}
+	status = topo_victims(npthreads);
+	if (status != 0) {
+		FERR("Failed to allocate steal order.  errno=%d", status);
+		return status;
+	}
+
 	for (tid = 1; tid < npthreads; tid++){
 		threads[tid].thread_num = tid;
 		/*
 		 * call stores the thread_id into the corresponding
-		 * element of threads
+		 * element of threads.  with --pin, the attr starts it on its cpu
 		 */
-		status = pthread_create(&threads[tid].pthread_id,
-			(const pthread_attr_t *)NULL, get_dir_from_queue,
-			(void *)&threads[tid]);
+		status = topo_attr(tid, &attr);
+		if (status == 0) {
+			status = pthread_create(&threads[tid].pthread_id, &attr,
+				get_dir_from_queue, (void *)&threads[tid]);
+			pthread_attr_destroy(&attr);
+		}
 		if (status != 0) {
 			FERR("Failed to create thread id=%d for pool.  Errno=%d", tid,
 				status);
@@ -148,7 +470,7 @@ create_pool(int npthreads)
 
 		DBUG(" thread %02d successfully fjorked", tid);
 	}
-	sched_yield();  /* grease the pool threads into the cv */
+	sched_yield();  /* grease the pool threads into idle_wait */
 
 	return 0;
 }
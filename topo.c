@@ -0,0 +1,419 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * CPU topology.  finds out from /sys which logical cpus are online, which
+ * of them are the second hyperthread of a core, and which NUMA node each
+ * is on, and uses that to size the pool, and with --pin, to place the
+ * threads.
+ *
+ * the cpus get handed out round robin between the nodes, and within a node
+ * the first hyperthread of every core comes before any second ones, so a
+ * pool smaller than the box is spread over the sockets and doesn't double
+ * up on cores.  --cores-only leaves the second hyperthreads out entirely.
+ *
+ * when the threads are pinned, each one steals from the threads on its
+ * own node before going off node, see steal_victim().
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mchown.h"
+
+#define SYS_CPU_DIR "/sys/devices/system/cpu"
+#define SYS_NODE_DIR "/sys/devices/system/node"
+#define TOPO_MAX_CPUS 4096
+
+struct topo_cpu {
+	int cpu;
+	int node;
+	int primary;              /* the first hyperthread of its core */
+};
+
+int pin_mode;                    /* PIN_*, from --pin */
+int cores_only;                  /* one thread per core, not per hyperthread */
+int topo_nodes;                  /* nodes with any of our cpus on them */
+
+static struct topo_cpu *topo_cpus;   /* in the order threads get them */
+static int ntopo_cpus;
+
+
+/*
+ * read a small /sys file into buf.  returns the length, or -1
+ */
+ static int
+read_sys(const char *path, char *buf, size_t sz)
+{
+	int fd;
+	ssize_t n;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	n = read(fd, buf, sz - 1);
+	close(fd);
+	if (n < 1) {
+		return -1;
+	}
+	buf[n] = '\0';
+
+	return (int)n;
+}
+
+
+/*
+ * read a cpu list like "0-3,8-11" from a /sys file into cpus.
+ * returns how many there were, or -1 if the file couldn't be read
+ */
+ static int
+read_cpulist(const char *path, int *cpus, int max)
+{
+	char buf[4096];
+	char *tok;
+	char *prog;
+	int begin;
+	int end;
+	int n;
+
+	if (read_sys(path, buf, sizeof(buf)) < 0) {
+		return -1;
+	}
+	n = 0;
+	for (prog = strtok_r(buf, ",\n", &tok); prog;
+		prog = strtok_r(NULL, ",\n", &tok)) {
+
+		switch (sscanf(prog, "%d-%d", &begin, &end)) {
+			case 1:
+				end = begin;
+				break;
+			case 2:
+				break;
+			default:
+				continue;
+		}
+		for (; (begin <= end) && (n < max); begin++) {
+			cpus[n++] = begin;
+		}
+	}
+
+	return n;
+}
+
+
+/*
+ * what --pin takes.  returns PIN_*, or -1 if it's none of them
+ */
+ int
+parse_pin(const char *str)
+{
+	if (!strcmp(str, "none")) {
+		return PIN_NONE;
+	} else if (!strcmp(str, "core")) {
+		return PIN_CORE;
+	} else if (!strcmp(str, "node")) {
+		return PIN_NODE;
+	}
+
+	return -1;
+}
+
+
+ static int
+topo_cmp(const void *a, const void *b)
+{
+	const struct topo_cpu *ca = a;
+	const struct topo_cpu *cb = b;
+
+	if (ca->node != cb->node) {
+		return ca->node - cb->node;
+	}
+	if (ca->primary != cb->primary) {
+		return cb->primary - ca->primary;
+	}
+	return ca->cpu - cb->cpu;
+}
+
+
+/*
+ * find out the topology, and put the cpus in the order the threads get
+ * them.  returns the number of cpus there are to run on, which is the
+ * number of cores with cores_only, or 0 if it couldn't be found out
+ */
+ int
+topo_init(void)
+{
+	struct topo_cpu *tc;
+	struct topo_cpu *order;
+	int *cpus;
+	int *ncpus;
+	int ncpu;
+	int nsib;
+	int nnode;
+	int i;
+	int j;
+	int n;
+	int rank;
+	int left;
+	char path[PATH_MAX];
+
+	cpus = malloc(TOPO_MAX_CPUS * sizeof(int));
+	tc = calloc(TOPO_MAX_CPUS, sizeof(struct topo_cpu));
+	if ((cpus == NULL) || (tc == NULL)) {
+		FERR("Could not allocate for the cpu topology");
+		free(cpus);
+		free(tc);
+		return 0;
+	}
+	ncpu = read_cpulist(SYS_CPU_DIR "/online", cpus, TOPO_MAX_CPUS);
+	if (ncpu < 1) {
+		FERR("Problem reading %s/online for core count.  errno = %d",
+			SYS_CPU_DIR, errno);
+		free(cpus);
+		free(tc);
+		return 0;
+	}
+	for (i = 0; i < ncpu; i++) {
+		tc[i].cpu = cpus[i];
+		tc[i].node = 0;
+	}
+
+	/* the lowest numbered cpu of each set of hyperthread siblings is first */
+	for (i = 0; i < ncpu; i++) {
+		snprintf(path, sizeof(path),
+			SYS_CPU_DIR "/cpu%d/topology/thread_siblings_list", tc[i].cpu);
+		nsib = read_cpulist(path, cpus, TOPO_MAX_CPUS);
+		tc[i].primary = 1;
+		for (j = 0; j < nsib; j++) {
+			if (cpus[j] < tc[i].cpu) {
+				tc[i].primary = 0;
+			}
+		}
+	}
+
+	/* no node directory just means no NUMA, everything's on node 0 */
+	nnode = read_cpulist(SYS_NODE_DIR "/online", cpus, TOPO_MAX_CPUS);
+	if (nnode > 0) {
+		ncpus = malloc(TOPO_MAX_CPUS * sizeof(int));
+		for (j = 0; ncpus && (j < nnode); j++) {
+			snprintf(path, sizeof(path), SYS_NODE_DIR "/node%d/cpulist",
+				cpus[j]);
+			n = read_cpulist(path, ncpus, TOPO_MAX_CPUS);
+			for (; n > 0; n--) {
+				for (i = 0; i < ncpu; i++) {
+					if (tc[i].cpu == ncpus[n - 1]) {
+						tc[i].node = cpus[j];
+					}
+				}
+			}
+		}
+		free(ncpus);
+	}
+	free(cpus);
+
+	if (cores_only) {
+		for (i = 0, n = 0; i < ncpu; i++) {
+			if (tc[i].primary) {
+				tc[n++] = tc[i];
+			}
+		}
+		ncpu = n;
+	}
+
+	/*
+	 * sorted by node, then first hyperthreads first.  then deal them out
+	 * a node at a time: the first cpu of each node, then the second of each
+	 */
+	qsort(tc, (size_t)ncpu, sizeof(struct topo_cpu), topo_cmp);
+	order = calloc((size_t)ncpu, sizeof(struct topo_cpu));
+	if (order == NULL) {
+		FERR("Could not allocate for the cpu topology");
+		free(tc);
+		return 0;
+	}
+	n = 0;
+	topo_nodes = 0;
+	for (rank = 0, left = ncpu; left > 0; rank++) {
+		for (i = 0; i < ncpu; i = j) {
+			for (j = i; (j < ncpu) && (tc[j].node == tc[i].node); j++) {
+				;
+			}
+			if (rank == 0) {
+				topo_nodes++;
+			}
+			if (i + rank < j) {
+				order[n++] = tc[i + rank];
+				left--;
+			}
+		}
+	}
+	free(tc);
+	topo_cpus = order;
+	ntopo_cpus = ncpu;
+	DBUG("topology: %d cpus on %d nodes%s", ncpu, topo_nodes,
+		cores_only ? ", cores only" : "");
+
+	return ncpu;
+}
+
+
+/*
+ * the cpu set thread tid goes on, by pin_mode.  returns 0 if it's not
+ * being pinned
+ */
+ static int
+topo_set(int tid, cpu_set_t *set)
+{
+	struct topo_cpu *tc;
+	int i;
+
+	if ((pin_mode == PIN_NONE) || (ntopo_cpus == 0)) {
+		return 0;
+	}
+	tc = &topo_cpus[tid % ntopo_cpus];
+	CPU_ZERO(set);
+	if (pin_mode == PIN_CORE) {
+		CPU_SET((size_t)tc->cpu, set);
+	} else {
+		for (i = 0; i < ntopo_cpus; i++) {
+			if (topo_cpus[i].node == tc->node) {
+				CPU_SET((size_t)topo_cpus[i].cpu, set);
+			}
+		}
+	}
+
+	return 1;
+}
+
+
+/*
+ * note where thread tid goes.  without pinning, it's nowhere in particular
+ */
+ void
+topo_place(int tid)
+{
+	if ((pin_mode == PIN_NONE) || (ntopo_cpus == 0)) {
+		threads[tid].cpu = -1;
+		threads[tid].node = 0;
+		return;
+	}
+	threads[tid].cpu = topo_cpus[tid % ntopo_cpus].cpu;
+	threads[tid].node = topo_cpus[tid % ntopo_cpus].node;
+	if (pin_mode == PIN_NODE) {
+		threads[tid].cpu = -1;     /* anywhere on the node */
+	}
+}
+
+
+/*
+ * set up attr to start thread tid where it goes.  the thread starts out
+ * there, so what it allocates for itself is on its own node.
+ * returns 0, or an errno
+ */
+ int
+topo_attr(int tid, pthread_attr_t *attr)
+{
+	cpu_set_t set;
+	int status;
+
+	status = pthread_attr_init(attr);
+	if ((status == 0) && topo_set(tid, &set)) {
+		status = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+		if (status) {
+			pthread_attr_destroy(attr);
+		}
+	}
+
+	return status;
+}
+
+
+/*
+ * pin the calling thread where thread tid goes.  this is for the main
+ * thread, which is already running.  anything it starts afterwards
+ * inherits it, so mchownd doesn't do this
+ */
+ void
+topo_pin_self(int tid)
+{
+	cpu_set_t set;
+	int status;
+
+	if (topo_set(tid, &set)) {
+		status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (status) {
+			WARN("Could not pin thread %02d to cpu %d errno %d", tid,
+				threads[tid].cpu, status);
+		}
+	}
+}
+
+
+/*
+ * work out every thread's steal order: the other threads on its own node,
+ * then everybody else.  without pinning, a thread's node doesn't mean
+ * anything, so they're all local.  returns 0, or an errno
+ */
+ int
+topo_victims(int npool)
+{
+	struct thread_pool *tp;
+	int t;
+	int v;
+	int n;
+
+	for (t = 0; t < npool; t++) {
+		tp = &threads[t];
+		tp->victims = malloc((size_t)npool * sizeof(int));
+		if (tp->victims == NULL) {
+			return ENOMEM;
+		}
+		n = 0;
+		for (v = 0; v < npool; v++) {
+			if ((v != t) && (threads[v].node == tp->node)) {
+				tp->victims[n++] = v;
+			}
+		}
+		tp->nlocal = n;
+		for (v = 0; v < npool; v++) {
+			if ((v != t) && (threads[v].node != tp->node)) {
+				tp->victims[n++] = v;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * the x'th of the other nthreads threads to try stealing from.  the ones on
+ * our own node come first, and each group starts at r, so the thieves
+ * don't all pile onto the same victim
+ */
+ int
+steal_victim(int x, unsigned int r)
+{
+	unsigned int nl;
+	unsigned int nr;
+
+	nl = (unsigned int)my_tpool->nlocal;
+	if ((unsigned int)x < nl) {
+		return my_tpool->victims[((unsigned int)x + r) % nl];
+	}
+	nr = (unsigned int)nthreads - nl;
+
+	return my_tpool->victims[nl + ((unsigned int)x - nl + r) % nr];
+}
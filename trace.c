@@ -0,0 +1,288 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * span tracing, for seeing where the time of a slow run went.  with
+ * --trace FILE each thread keeps a span for every directory mdpf does: its
+ * path, how many entries and changes, and how long it spent in getdents64,
+ * in stat, in chown, and pushing onto its deque.  the times a thread parked
+ * for lack of work are kept as idle spans.  at the end they're written out
+ * in the Chrome trace event format, which chrome://tracing and Perfetto
+ * load as is: one row per thread, so a straggler subtree is one long bar
+ * with the others idle around it.
+ *
+ * the spans go into a ring per thread, which only its thread writes, so
+ * there's no locking and recording one is a few stores.  a ring keeps the
+ * last TRACE_RING spans, and older ones are dropped, so it can be left on
+ * for a long run, or mchownd, and still show how it ended.  --trace-sample
+ * N only times one directory in N on each thread, which keeps the
+ * clock_gettime calls down to nothing on a tree of tiny directories.
+ *
+ * a directory's times are added up in the struct trace_span on mdpf's
+ * stack, which my_tpool->tr_span points at while it's the one being done.
+ * a directory mdpf recurses into gets its own, and the parent's is put
+ * back after, so its times are only its own.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mchown.h"
+
+#define TRACE_RING 8192           /* spans kept per thread, the last ones */
+#define TRACE_PATH_SZ 124         /* the tail of the path is what's kept */
+
+#define TR_DIR 0
+#define TR_IDLE 1
+
+struct trace_ev {
+	uint64_t ts;              /* ns since trace_t0 */
+	uint64_t dur;
+	uint64_t rd_ns;
+	uint64_t stat_ns;
+	uint64_t chown_ns;
+	uint64_t queue_ns;
+	uint64_t job_id;
+	uint32_t kind;            /* TR_DIR or TR_IDLE */
+	uint32_t ents;
+	uint32_t changed;
+	char path[TRACE_PATH_SZ];
+};
+
+struct trace_ring {
+	uint64_t head;            /* spans ever recorded, next is head % TRACE_RING */
+	struct trace_ev ev[TRACE_RING];
+};
+
+char *trace_path;                /* --trace FILE, NULL for none */
+unsigned int trace_sample = 1;   /* --trace-sample, time 1 dir in this many */
+int trace_on;
+
+static uint64_t trace_t0;
+
+
+ uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+/*
+ * start tracing, before the pool does anything
+ */
+ void
+trace_init(void)
+{
+	if (trace_sample < 1) {
+		trace_sample = 1;
+	}
+	trace_t0 = trace_now();
+	trace_on = 1;
+	DBUG("tracing to '%s', 1 dir in %u", trace_path, trace_sample);
+}
+
+
+/*
+ * the next slot in this thread's ring, making the ring the first time.
+ * returns NULL if there's no memory for it, and the span's just lost
+ */
+ static struct trace_ev *
+trace_slot(void)
+{
+	struct trace_ring *r;
+
+	r = my_tpool->tr;
+	if (r == NULL) {
+		r = calloc(1, sizeof(struct trace_ring));
+		if (r == NULL) {
+			return NULL;
+		}
+		__atomic_store_n(&my_tpool->tr, r, __ATOMIC_RELEASE);
+	}
+
+	return &r->ev[r->head % TRACE_RING];
+}
+
+
+/*
+ * the slot from trace_slot is filled in, let trace_dump see it
+ */
+ static void
+trace_commit(void)
+{
+	__atomic_store_n(&my_tpool->tr->head, my_tpool->tr->head + 1,
+		__ATOMIC_RELEASE);
+}
+
+
+/*
+ * mdpf is starting on a directory.  if it's one to be sampled, its times
+ * are added up in sp from here on, otherwise nothing is
+ */
+ void
+trace_begin(struct trace_span *sp)
+{
+	sp->up = my_tpool->tr_span;
+	if (++my_tpool->tr_tick < trace_sample) {
+		sp->start = 0;
+		my_tpool->tr_span = NULL;
+		return;
+	}
+	my_tpool->tr_tick = 0;
+	memset(sp, 0, offsetof(struct trace_span, up));
+	sp->start = trace_now();
+	my_tpool->tr_span = sp;
+}
+
+
+/*
+ * mdpf is done with dn, which had ents entries and changed changes.
+ * records the span if it was sampled, and goes back to the parent's
+ */
+ void
+trace_end(struct trace_span *sp, struct dnode *dn, int ents, int changed)
+{
+	struct trace_ev *ev;
+	char *path;
+	size_t len;
+
+	my_tpool->tr_span = sp->up;
+	if (sp->start == 0) {
+		return;
+	}
+	ev = trace_slot();
+	if (ev == NULL) {
+		return;
+	}
+	ev->ts = sp->start - trace_t0;
+	ev->dur = trace_now() - sp->start;
+	ev->rd_ns = sp->rd_ns;
+	ev->stat_ns = sp->stat_ns;
+	ev->chown_ns = sp->chown_ns;
+	ev->queue_ns = sp->queue_ns;
+	ev->job_id = dn->job->job_id;
+	ev->kind = TR_DIR;
+	ev->ents = (uint32_t)ents;
+	ev->changed = (uint32_t)changed;
+	path = dn_path(dn);
+	len = strlen(path);
+	if (len < TRACE_PATH_SZ) {
+		memcpy(ev->path, path, len + 1);
+	} else {
+		/* the end of a long path says more than the start does */
+		memcpy(ev->path, "...", 3);
+		memcpy(ev->path + 3, path + len - (TRACE_PATH_SZ - 4),
+			TRACE_PATH_SZ - 3);
+	}
+	trace_commit();
+}
+
+
+/*
+ * this thread was parked with nothing to do from start until now
+ */
+ void
+trace_idle(uint64_t start)
+{
+	struct trace_ev *ev;
+
+	ev = trace_slot();
+	if (ev == NULL) {
+		return;
+	}
+	memset(ev, 0, offsetof(struct trace_ev, path));
+	ev->ts = start - trace_t0;
+	ev->dur = trace_now() - start;
+	ev->kind = TR_IDLE;
+	ev->path[0] = '\0';
+	trace_commit();
+}
+
+
+/*
+ * write the spans in every thread's ring to trace_path.  called at exit.
+ * mchownd's threads can still be going then, so a span being recorded
+ * while its slot is written out can come out garbled, but only that one
+ */
+ void
+trace_dump(const char *prog)
+{
+	FILE *fp;
+	struct trace_ring *r;
+	struct trace_ev *ev;
+	uint64_t head;
+	uint64_t i;
+	uint64_t dropped;
+	long pid;
+	uint32_t t;
+
+	if (!trace_on) {
+		return;
+	}
+	fp = fopen(trace_path, "w");
+	if (fp == NULL) {
+		FERR("Could not write the trace '%s' errno %d", trace_path, errno);
+		return;
+	}
+
+	pid = (long)getpid();
+	dropped = 0;
+	fprintf(fp, "{\"traceEvents\": [\n{\"name\": \"process_name\", "
+		"\"ph\": \"M\", \"pid\": %ld, \"tid\": 0, \"args\": {\"name\": ", pid);
+	json_str(fp, prog);
+	fprintf(fp, "}}");
+	for (t = 0; t < stats_hdr->nthr; t++) {
+		fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+			"\"pid\": %ld, \"tid\": %u, \"args\": {\"name\": \"%s %02u\"}}",
+			pid, t, t ? "worker" : "main", t);
+		r = __atomic_load_n(&threads[t].tr, __ATOMIC_ACQUIRE);
+		if (r == NULL) {
+			continue;
+		}
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		i = (head > TRACE_RING) ? head - TRACE_RING : 0;
+		dropped = dropped + i;
+		for (; i < head; i++) {
+			ev = &r->ev[i % TRACE_RING];
+			if (ev->kind == TR_IDLE) {
+				fprintf(fp, ",\n{\"name\": \"idle\", \"cat\": \"idle\", "
+					"\"ph\": \"X\", \"pid\": %ld, \"tid\": %u, "
+					"\"ts\": %.3f, \"dur\": %.3f}", pid, t,
+					(double)ev->ts / 1e3, (double)ev->dur / 1e3);
+				continue;
+			}
+			fprintf(fp, ",\n{\"name\": ");
+			json_str(fp, ev->path);
+			fprintf(fp, ", \"cat\": \"dir\", \"ph\": \"X\", \"pid\": %ld, "
+				"\"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": "
+				"{\"entries\": %u, \"changed\": %u, \"readdir_us\": %.3f, "
+				"\"stat_us\": %.3f, \"chown_us\": %.3f, \"queue_us\": %.3f, "
+				"\"job\": %lu}}", pid, t, (double)ev->ts / 1e3,
+				(double)ev->dur / 1e3, ev->ents, ev->changed,
+				(double)ev->rd_ns / 1e3, (double)ev->stat_ns / 1e3,
+				(double)ev->chown_ns / 1e3, (double)ev->queue_ns / 1e3,
+				ev->job_id);
+		}
+	}
+	fprintf(fp, "\n],\n\"displayTimeUnit\": \"ms\",\n\"otherData\": "
+		"{\"sample\": %u, \"dropped\": %lu}}\n", trace_sample, dropped);
+	fclose(fp);
+	DBUG("wrote the trace to '%s', %lu spans dropped", trace_path, dropped);
+}
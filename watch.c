@@ -0,0 +1,444 @@
+/*
+ * Copyright 2020-2022 Andrew Sharp andy@tigerand.com, All Rights Reserved
+ */
+
+/*
+ * --watch, for the CLI: once the tree's been done, keep it that way.
+ *
+ * fanotify is set up before the first pass, with a FAN_MARK_FILESYSTEM
+ * mark on the file system the top is on, for FAN_CREATE and FAN_MOVED_TO,
+ * reporting the directory's file handle and the name.  nothing created
+ * after the first pass reads a directory can be missed that way.  it takes
+ * CAP_SYS_ADMIN and a 5.9 kernel.  without it, it's inotify, which has to
+ * watch each directory, so mdpf adds a watch for every directory as it
+ * opens it, before reading it, see watch_dir.  inotify needs a watch per
+ * directory, which is limited by fs.inotify.max_user_watches.
+ *
+ * after the first pass, the main thread reads the events a batch at a
+ * time, turns them into paths under the top, and goes through them with
+ * ck_walk, under a job of their own that stays open for as long as the
+ * watching goes on.  a new file gets chowned right there, if it needs it.
+ * a new directory goes to the pool, so mdpf does it and everything under
+ * it, which is what a mv of a whole tree into the watched one needs.
+ * events get lost if they come too fast; then the whole tree gets looked
+ * at again, the same way.
+ *
+ * other file systems mounted under the top aren't watched by fanotify.
+ * the watching stops with SIGINT, SIGTERM or --time-budget, like a
+ * checkpointed run does, see ckpt.c.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+
+#include "mchown.h"
+
+#define WATCH_POLL_MS 250
+#define WATCH_BUF_SZ (64 * 1024)
+#define WATCH_BATCH_MAX 65536     /* events taken before working on them */
+
+int watching;                     /* --watch */
+int watch_inotify;                /* mdpf has to call watch_dir */
+
+static int watch_fd = -1;
+static int watch_mnt_fd = -1;     /* for open_by_handle_at */
+static char *watch_top;           /* the path the way the job has it */
+static char *watch_real;          /* and the way fanotify will have it */
+static size_t watch_real_len;
+
+/* the inotify watch descriptors, and the paths of their directories */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **watch_wds;
+static int watch_nwds;
+static int watch_full;            /* ran out of inotify watches */
+
+
+/*
+ * get ready to watch path, before the first pass over it.
+ * returns 0, or -1 after saying why
+ */
+ int
+watch_init(char *path)
+{
+	watch_top = path;
+	watch_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+		FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+	if ((watch_fd >= 0) && (fanotify_mark(watch_fd, FAN_MARK_ADD |
+		FAN_MARK_FILESYSTEM, FAN_CREATE | FAN_MOVED_TO | FAN_ONDIR, AT_FDCWD,
+		path) == 0)) {
+
+		watch_real = realpath(path, NULL);
+		watch_mnt_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (watch_real && (watch_mnt_fd >= 0)) {
+			watch_real_len = strlen(watch_real);
+			DBUG("watching '%s' with fanotify", watch_real);
+			return 0;
+		}
+		FERR("Could not set up to watch '%s' errno %d", path, errno);
+		return -1;
+	}
+	DBUG("fanotify isn't available, errno %d, using inotify", errno);
+	if (watch_fd >= 0) {
+		close(watch_fd);
+	}
+
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch_fd < 0) {
+		FERR("Could not set up inotify to watch '%s' errno %d", path, errno);
+		return -1;
+	}
+	watch_inotify = 1;
+
+	return 0;
+}
+
+
+/*
+ * with inotify, watch a directory mdpf just opened, before it gets read
+ */
+ void
+watch_dir(struct dnode *dn)
+{
+	char proc[64];
+	char *path;
+	char **nwds;
+	int wd;
+	int n;
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dn->fd);
+	TS_ADD(syscalls, 1);
+	wd = inotify_add_watch(watch_fd, proc, IN_CREATE | IN_MOVED_TO |
+		IN_ONLYDIR);
+	if (wd < 0) {
+		if (__sync_bool_compare_and_swap(&watch_full, 0, 1)) {
+			WARN("Could not watch '%s' errno %d, new files under it and "
+				"others won't be seen.  see fs.inotify.max_user_watches",
+				dn_path(dn), errno);
+		}
+		return;
+	}
+	path = strdup(dn_path(dn));
+
+	pthread_mutex_lock(&watch_lock);
+	if (wd >= watch_nwds) {
+		for (n = watch_nwds ? watch_nwds : 1024; n <= wd; n = n * 2) {
+			;
+		}
+		nwds = realloc(watch_wds, (size_t)n * sizeof(char *));
+		if (nwds == NULL) {
+			pthread_mutex_unlock(&watch_lock);
+			free(path);
+			inotify_rm_watch(watch_fd, wd);
+			return;
+		}
+		memset(nwds + watch_nwds, 0, (size_t)(n - watch_nwds) *
+			sizeof(char *));
+		watch_wds = nwds;
+		watch_nwds = n;
+	}
+	/* the same directory again, maybe under another name by now */
+	free(watch_wds[wd]);
+	watch_wds[wd] = path;
+	pthread_mutex_unlock(&watch_lock);
+}
+
+
+/*
+ * add dir/name to the list.  returns 0, or ENOMEM
+ */
+ static int
+watch_add(char ***list, size_t *n, size_t *sz, const char *dir,
+	const char *name)
+{
+	char *path;
+	int err;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0) {
+		return ENOMEM;
+	}
+	err = ck_list_add(list, n, sz, path);
+	free(path);
+
+	return err;
+}
+
+
+/*
+ * the path under watch_top of a directory fanotify sent a handle for.
+ * returns 0 with it in buf, or -1 if it's gone or somewhere else
+ */
+ static int
+watch_fan_dir(struct file_handle *fh, char *buf, size_t bufsz)
+{
+	char proc[64];
+	char real[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	fd = open_by_handle_at(watch_mnt_fd, fh, O_PATH | O_CLOEXEC);
+	TS_ADD(syscalls, 1);
+	if (fd < 0) {
+		return -1;
+	}
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	len = readlink(proc, real, sizeof(real) - 1);
+	TS_ADD(syscalls, 2);
+	close(fd);
+	if (len < 0) {
+		return -1;
+	}
+	real[len] = '\0';
+	if (strncmp(real, watch_real, watch_real_len) ||
+		((real[watch_real_len] != '/') && (real[watch_real_len] != '\0'))) {
+
+		return -1;              /* not ours */
+	}
+	if (snprintf(buf, bufsz, "%s%s", watch_top, real + watch_real_len) >=
+		(int)bufsz) {
+
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * read what events there are, up to WATCH_BATCH_MAX, as paths.  sets
+ * *lost if some events were lost.
+ * returns 0, or an errno
+ */
+ static int
+watch_read(char ***list, size_t *n, int *lost)
+{
+	static char buf[WATCH_BUF_SZ]
+		__attribute__ ((aligned (__alignof__(struct inotify_event))));
+	char dir[PATH_MAX];
+	struct fanotify_event_metadata *meta;
+	struct fanotify_event_info_fid *fid;
+	struct file_handle *fh;
+	struct inotify_event *ev;
+	size_t sz;
+	ssize_t len;
+	char *p;
+	int err;
+
+	sz = *n;
+	err = 0;
+	while ((!err) && (*n < WATCH_BATCH_MAX)) {
+		len = read(watch_fd, buf, sizeof(buf));
+		TS_ADD(syscalls, 1);
+		if (len <= 0) {
+			if ((len < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+				err = errno;
+			}
+			break;
+		}
+
+		if (!watch_inotify) {
+			for (meta = (struct fanotify_event_metadata *)buf;
+				(!err) && FAN_EVENT_OK(meta, len);
+				meta = FAN_EVENT_NEXT(meta, len)) {
+
+				if (meta->mask & FAN_Q_OVERFLOW) {
+					*lost = 1;
+					continue;
+				}
+				fid = (struct fanotify_event_info_fid *)(meta + 1);
+				if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+					continue;
+				}
+				fh = (struct file_handle *)fid->handle;
+				p = (char *)fh->f_handle + fh->handle_bytes;
+				if (watch_fan_dir(fh, dir, sizeof(dir)) == 0) {
+					err = watch_add(list, n, &sz, dir, p);
+				}
+			}
+			continue;
+		}
+
+		for (p = buf; (!err) && (p < buf + len);
+			p = p + sizeof(struct inotify_event) + ev->len) {
+
+			ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				*lost = 1;
+				continue;
+			}
+			pthread_mutex_lock(&watch_lock);
+			if ((ev->wd < 0) || (ev->wd >= watch_nwds) ||
+				(watch_wds[ev->wd] == NULL)) {
+
+				;
+			} else if (ev->mask & IN_IGNORED) {
+				free(watch_wds[ev->wd]);
+				watch_wds[ev->wd] = NULL;
+			} else if (ev->len) {
+				err = watch_add(list, n, &sz, watch_wds[ev->wd], ev->name);
+			}
+			pthread_mutex_unlock(&watch_lock);
+		}
+	}
+
+	return err;
+}
+
+
+/*
+ * everything in the top directory, for when events were lost.
+ * returns 0, or an errno
+ */
+ static int
+watch_rescan(char ***list, size_t *n)
+{
+	DIR *dir;
+	struct dirent *de;
+	size_t sz;
+	int err;
+
+	dir = opendir(watch_top);
+	if (dir == NULL) {
+		return errno;
+	}
+	sz = *n;
+	err = 0;
+	while ((!err) && ((de = readdir(dir)) != NULL)) {
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+			err = watch_add(list, n, &sz, watch_top, de->d_name);
+		}
+	}
+	closedir(dir);
+
+	return err;
+}
+
+
+/*
+ * ck_walk's fn for an event: chown a new file, or hand a new directory to
+ * the pool
+ */
+ static int
+watch_one(struct job_info *job, struct dnode *dn, char *name)
+{
+	struct stat st;
+	int reg_procd;
+	int lnk_procd;
+	int rval;
+
+	TS_ADD(syscalls, 1);
+	if (fs_stat(dn->fd, name, &st, dn->prof)) {
+		return 0;                /* come and gone */
+	}
+	if (prune_on && prune_entry(dn, name, (unsigned char)IFTODT(st.st_mode),
+		&st)) {
+
+		TS_ADD(pruned, 1);
+		return 1;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		return ck_submit(job, dn, name) ? ENOMEM : 1;
+	}
+	if (S_ISREG(st.st_mode)) {
+		TS_ADD(files_scanned, 1);
+	} else if (S_ISLNK(st.st_mode)) {
+		TS_ADD(links_scanned, 1);
+	} else {
+		return 1;                /* not something mchown changes */
+	}
+
+	reg_procd = lnk_procd = 0;
+	rval = chown_stated(job, dn->fd, name, &st, job->ucred);
+	(void)chown_tally(job, rval, name, (unsigned char)IFTODT(st.st_mode),
+		&reg_procd, &lnk_procd);
+	__sync_add_and_fetch(&job->files_chowned, reg_procd + lnk_procd);
+	TS_ADD(files_changed, (uint64_t)reg_procd);
+	TS_ADD(links_changed, (uint64_t)lnk_procd);
+
+	return 1;
+}
+
+
+/*
+ * the first pass over path is done.  keep the tree done until it's time to
+ * stop, under a job of its own.  the first job's cred is gone by now, so
+ * the ids come from main.
+ * returns the watching's job, once it's done, or NULL after saying why
+ */
+ struct job_info *
+watch_run(char *path, uid_t uid, gid_t gid)
+{
+	struct job_info *job;
+	struct dnode *top;
+	struct pollfd pfd;
+	char **list;
+	size_t n;
+	int lost;
+	int rval;
+
+	job = job_new(path, uid, gid);
+	if (job == NULL) {
+		FERR("Failed to set up the job to watch '%s', errno = %d",
+			path, errno);
+		return NULL;
+	}
+	job->watch = 1;
+	top = ck_open(job, NULL, job->path);
+	if (top == NULL) {
+		FERR("Could not open '%s' to watch it errno %d", job->path, errno);
+		return NULL;
+	}
+	WARN("Watching '%s' with %s", job->path,
+		watch_inotify ? "inotify" : "fanotify");
+
+	pfd.fd = watch_fd;
+	pfd.events = POLLIN;
+	rval = 0;
+	while ((!rval) && (!ATOMIC_READ(ck_stopping)) &&
+		(!JOB_STOPPING(job))) {
+
+		if (poll(&pfd, 1, WATCH_POLL_MS) <= 0) {
+			continue;
+		}
+		list = NULL;
+		n = 0;
+		lost = 0;
+		rval = watch_read(&list, &n, &lost);
+		if ((!rval) && lost) {
+			WARN("Events were lost, looking at all of '%s' again",
+				job->path);
+			rval = watch_rescan(&list, &n);
+		}
+		if ((!rval) && n) {
+			MBUG("watch: %lu new paths", n);
+			rval = ck_walk(job, top, list, n, watch_one);
+		}
+		ck_list_free(list, n);
+		if (stats_live) {
+			stats_publish();
+		}
+	}
+	if (rval) {
+		FERR("Stopped watching '%s' errno %d", job->path, rval);
+		job_err(job, rval);
+	}
+
+	/* the job's done once the pool is done with what it was given */
+	dn_done(top);
+	job_wait(job);
+	close(watch_fd);
+
+	return job;
+}